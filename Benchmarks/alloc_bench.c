@@ -0,0 +1,256 @@
+// Times the allocator and directory primitives of libmfs, findFreeBlock(),
+// findFreeInode(), searchDirectory() and mfs_df(), on synthetic free map and
+// directory states: fresh, checkerboard, mostly full and free only at the
+// end. The library source is included so its static functions can be
+// called directly. Run it before and after any change to them.
+//
+// Usage: alloc_bench [reps]   (default 2000 per measurement)
+
+#include "libmfs.c"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define IMAGE_PATH "/tmp/alloc_bench.img"
+#define MAX_REPS 100000
+
+enum state { FRESH, CHECKERBOARD, MOSTLY_FULL, END_ONLY, STATES };
+
+static const char *state_names[STATES] = { "fresh", "checkerboard", "mostly full", "end only" };
+
+static uint64_t samples[MAX_REPS];
+static double ns_per_tick = 1;
+
+// Reads the cycle counter, or nanoseconds where there is none.
+static inline uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Measures how many nanoseconds one tick is.
+static void calibrate()
+{
+    double start = now();
+    uint64_t first = ticks();
+
+    while (now() - start < 0.05)
+    {
+    }
+
+    ns_per_tick = (now() - start) * 1e9 / (ticks() - first);
+}
+
+static int compareTicks(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints the median and minimum of reps samples.
+static void report(const char *primitive, const char *state, int reps)
+{
+    qsort(samples, reps, sizeof(uint64_t), compareTicks);
+    printf("%-16s %-22s %10llu ticks %10.1f ns  (min %llu)\n", primitive, state,
+           (unsigned long long)samples[reps / 2], samples[reps / 2] * ns_per_tick,
+           (unsigned long long)samples[0]);
+}
+
+// Sets the free block map to a state.
+static void setBlocks(struct mfs *fs, enum state state)
+{
+    for (int i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
+    {
+        switch (state)
+        {
+            case FRESH:        fs->free_blocks[i] = 1; break;
+            case CHECKERBOARD: fs->free_blocks[i] = i % 2; break;
+            case MOSTLY_FULL:  fs->free_blocks[i] = i % 1024 == 1023; break;
+            default:           fs->free_blocks[i] = i >= NUM_BLOCKS - 64; break;
+        }
+    }
+}
+
+// Sets the free inode map to a state.
+static void setInodes(struct mfs *fs, enum state state)
+{
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        switch (state)
+        {
+            case FRESH:        fs->free_inodes[i] = 1; break;
+            case CHECKERBOARD: fs->free_inodes[i] = i % 2; break;
+            case MOSTLY_FULL:  fs->free_inodes[i] = i % 64 == 63; break;
+            default:           fs->free_inodes[i] = i == NUM_FILES - 1; break;
+        }
+    }
+}
+
+// Fills the first count directory entries with distinct names.
+static void setDirectory(struct mfs *fs, int count)
+{
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        memset(&fs->directory_ptr[i], 0, sizeof(struct directoryEntry));
+        fs->directory_ptr[i].inode = -1;
+
+        if (i < count)
+        {
+            snprintf(fs->directory_ptr[i].filename, 64, "file%05d.dat", i);
+            fs->directory_ptr[i].in_use = 1;
+            fs->directory_ptr[i].inode = i;
+        }
+    }
+}
+
+// Times findFreeBlock() scanning from the start of the data region, as the
+// first allocation after open does, and following the next-fit cursor.
+static void benchBlocks(struct mfs *fs, int reps)
+{
+    for (int s = 0; s < STATES; s++)
+    {
+        setBlocks(fs, s);
+
+        for (int i = 0; i < reps; i++)
+        {
+            fs->next_block = FIRST_DATA_BLOCK;
+            uint64_t start = ticks();
+            int32_t block = findFreeBlock(fs);
+            samples[i] = ticks() - start;
+            fs->free_blocks[block] = 1;
+        }
+        report("findFreeBlock", state_names[s], reps);
+
+        // Consecutive allocations, with the map put back when it runs out.
+        fs->next_block = FIRST_DATA_BLOCK;
+        for (int i = 0; i < reps; i++)
+        {
+            uint64_t start = ticks();
+            int32_t block = findFreeBlock(fs);
+            samples[i] = ticks() - start;
+
+            if (block == -1)
+            {
+                setBlocks(fs, s);
+                i--;
+            }
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "%s, next-fit", state_names[s]);
+        report("findFreeBlock", name, reps);
+    }
+}
+
+static void benchInodes(struct mfs *fs, int reps)
+{
+    for (int s = 0; s < STATES; s++)
+    {
+        setInodes(fs, s);
+
+        for (int i = 0; i < reps; i++)
+        {
+            uint64_t start = ticks();
+            int32_t inode = findFreeInode(fs);
+            samples[i] = ticks() - start;
+            fs->free_inodes[inode] = 1;
+        }
+        report("findFreeInode", state_names[s], reps);
+    }
+}
+
+// Times a hit on the first and last entry and a miss, with the directory
+// empty, half full and full.
+static void benchDirectory(struct mfs *fs, int reps)
+{
+    static const int fills[] = { 1, NUM_FILES / 2, NUM_FILES };
+    static const char *fill_names[] = { "1 file", "half", "full" };
+    char first[64], last[64], state[32];
+
+    for (int f = 0; f < 3; f++)
+    {
+        setDirectory(fs, fills[f]);
+        snprintf(first, sizeof(first), "file%05d.dat", 0);
+        snprintf(last, sizeof(last), "file%05d.dat", fills[f] - 1);
+
+        const char *names[] = { first, last, "missing.dat" };
+        const char *kinds[] = { "first", "last", "miss" };
+
+        for (int k = 0; k < 3; k++)
+        {
+            for (int i = 0; i < reps; i++)
+            {
+                uint64_t start = ticks();
+                int entry = searchDirectory(fs, names[k]);
+                samples[i] = ticks() - start;
+                __asm__ volatile("" : : "r"(entry));
+            }
+
+            snprintf(state, sizeof(state), "%s, %s", fill_names[f], kinds[k]);
+            report("searchDirectory", state, reps);
+        }
+    }
+}
+
+static void benchDf(struct mfs *fs, int reps)
+{
+    for (int s = 0; s < STATES; s++)
+    {
+        setBlocks(fs, s);
+
+        for (int i = 0; i < reps; i++)
+        {
+            uint64_t start = ticks();
+            uint32_t free_bytes = mfs_df(fs);
+            samples[i] = ticks() - start;
+            __asm__ volatile("" : : "r"(free_bytes));
+        }
+        report("mfs_df", state_names[s], reps);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int reps = argc > 1 ? atoi(argv[1]) : 2000;
+
+    if (reps < 1 || reps > MAX_REPS)
+    {
+        printf("alloc_bench: Repetitions must be 1 to %d.\n", MAX_REPS);
+        return 1;
+    }
+
+    struct mfs *fs;
+
+    if (mfs_create(IMAGE_PATH, &fs) != MFS_OK)
+    {
+        printf("alloc_bench: Can not create %s.\n", IMAGE_PATH);
+        return 1;
+    }
+    unlink(IMAGE_PATH);
+
+    calibrate();
+    printf("%d repetitions, median ticks per call, %.3f ns per tick\n", reps, ns_per_tick);
+
+    benchBlocks(fs, reps);
+    benchInodes(fs, reps);
+    benchDirectory(fs, reps);
+    benchDf(fs, reps);
+
+    mfs_close(fs);
+
+    return 0;
+}
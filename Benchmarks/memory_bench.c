@@ -0,0 +1,161 @@
+// Compares image memory in base pages, transparent huge pages and explicit
+// huge pages. For each it creates an image, fills it with 1 MiB files and
+// prints the resident set size, how much of it is in huge pages, and the
+// best of several scrubs, reads of every file and fscks. The resident set
+// is printed again after the image is closed. Explicit huge pages fall back
+// to transparent ones unless /proc/sys/vm/nr_hugepages reserves some.
+//
+// Usage: memory_bench [reps]   (default 10 passes per measurement)
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmfs.h"
+
+#define IMAGE_PATH "/tmp/memory_bench.img"
+#define FILES 62                    // 1 MiB files, nearly the whole data region
+
+static const char *mode_names[] = { "base pages", "transparent huge pages", "explicit huge pages" };
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns a "<name>: <n> kB" field of a /proc file, or -1.
+static long procKb(const char *path, const char *name)
+{
+    char line[256];
+    long kb = -1;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (strncmp(line, name, strlen(name)) == 0)
+        {
+            kb = atol(line + strlen(name));
+            break;
+        }
+    }
+
+    fclose(fp);
+    return kb;
+}
+
+static long rssKb()
+{
+    return procKb("/proc/self/status", "VmRSS:");
+}
+
+// Runs every measurement with one page mode.
+static void benchMode(int mode, int reps, uint8_t *data, uint8_t *buffer)
+{
+    struct mfs *fs;
+    char name[32];
+
+    mfs_set_hugepages(mode);
+
+    if (mfs_create(IMAGE_PATH, &fs) != MFS_OK)
+    {
+        printf("memory_bench: Can not create %s.\n", IMAGE_PATH);
+        exit(1);
+    }
+
+    long created = rssKb();
+
+    for (int i = 0; i < FILES; i++)
+    {
+        snprintf(name, sizeof(name), "file%d", i);
+        mfs_insert(fs, name, data, MFS_MAX_FILE_SIZE, NULL);
+    }
+
+    struct mfs_cache_stats memory;
+
+    mfs_cache_stats(fs, &memory);
+
+    long full = rssKb();
+    long huge = procKb("/proc/self/smaps_rollup", "AnonHugePages:");
+    double scrub = 1e9, read = 1e9, fsck = 1e9;
+    int32_t checked = 0;
+
+    for (int r = 0; r < reps; r++)
+    {
+        struct mfs_scrub scrubbed;
+        struct mfs_fsck checks;
+
+        mfs_scrub(fs, &scrubbed);
+        checked = scrubbed.checked;
+        scrub = scrubbed.seconds < scrub ? scrubbed.seconds : scrub;
+
+        double start = now();
+        for (int i = 0; i < FILES; i++)
+        {
+            snprintf(name, sizeof(name), "file%d", i);
+            mfs_read(fs, name, 0, buffer, MFS_MAX_FILE_SIZE, NULL);
+        }
+        double elapsed = now() - start;
+        read = elapsed < read ? elapsed : read;
+
+        mfs_fsck(fs, 0, &checks);
+        fsck = checks.seconds < fsck ? checks.seconds : fsck;
+    }
+
+    mfs_close(fs);
+    unlink(IMAGE_PATH);
+
+    printf("%s, got %s\n", mode_names[mode], mode_names[memory.pages]);
+    printf("  RSS %ld kB after create, %ld kB full (%ld kB in huge pages), %ld kB after close\n",
+           created, full, huge, rssKb());
+    printf("  scrub %.0f MB/s, read every file %.0f MB/s, fsck %.3f ms\n",
+           checked * (double)MFS_BLOCK_SIZE / scrub / 1e6, FILES * (double)MFS_MAX_FILE_SIZE / read / 1e6, fsck * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    int reps = argc > 1 ? atoi(argv[1]) : 10;
+
+    if (reps < 1)
+    {
+        printf("memory_bench: Repetitions must be at least 1.\n");
+        return 1;
+    }
+
+    uint8_t *data = malloc(MFS_MAX_FILE_SIZE);
+    uint8_t *buffer = malloc(MFS_MAX_FILE_SIZE);
+
+    if (data == NULL || buffer == NULL)
+    {
+        printf("memory_bench: Out of memory.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < MFS_MAX_FILE_SIZE; i++)
+    {
+        data[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    printf("RSS %ld kB before any image, best of %d passes\n", rssKb(), reps);
+
+    for (int mode = MFS_PAGES_SMALL; mode <= MFS_PAGES_EXPLICIT; mode++)
+    {
+        benchMode(mode, reps, data, buffer);
+    }
+
+    free(data);
+    free(buffer);
+
+    return 0;
+}
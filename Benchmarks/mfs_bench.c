@@ -0,0 +1,384 @@
+// Drives libmfs through the work the shell commands do, across file sizes
+// from 1 byte to MFS_MAX_FILE_SIZE, directories from empty to full and
+// fresh or fragmented free maps. Prints ops/s, MB/s and p50/p99 latency for
+// every operation as JSON, to compare one build with another.
+//
+// Usage: mfs_bench [-q]   (-q runs a tenth of the repetitions)
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmfs.h"
+
+#define IMAGE_PATH "/tmp/mfs_bench.img"
+#define WORK_FILES 4                // Files each operation cycles through
+#define TARGET_BYTES (32 << 20)     // Data moved per operation and workload
+#define MIN_REPS 16
+#define MAX_REPS 4000
+#define SAVE_REPS 8
+#define FRAG_PAIRS 20               // Interleaved file pairs, one of each deleted
+
+static const uint32_t sizes[] = { 1, 1024, 16 * 1024, 256 * 1024, MFS_MAX_FILE_SIZE };
+
+static const struct
+{
+    const char *name;
+    int files;                      // Files in the directory besides the work files
+} directories[] =
+{
+    { "empty", 0 },
+    { "half", MFS_MAX_FILES / 2 },
+    { "full", MFS_MAX_FILES - WORK_FILES },
+};
+
+struct bench
+{
+    struct mfs *fs;
+    uint32_t size;
+    uint8_t *data;
+    uint8_t *buffer;
+    uint8_t key[MFS_KEY_SIZE];
+    char work[WORK_FILES][16];
+    unsigned seed;
+};
+
+// One timed operation. setup runs untimed before each repetition.
+struct op
+{
+    const char *name;
+    int (*setup)(struct bench *b, int i);
+    int (*run)(struct bench *b, int i);
+    int moves_data;                 // Counts b->size bytes per repetition
+};
+
+static int quick;
+static int first_result;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int runInsert(struct bench *b, int i)
+{
+    return mfs_insert(b->fs, b->work[i % WORK_FILES], b->data, b->size, NULL);
+}
+
+static int runRetrieve(struct bench *b, int i)
+{
+    return mfs_read(b->fs, b->work[i % WORK_FILES], 0, b->buffer, b->size, NULL) == (int)b->size ? MFS_OK : MFS_EIO;
+}
+
+// A 4 KiB read at a random block in the file, or the whole of a smaller file.
+static int runRead(struct bench *b, int i)
+{
+    uint32_t length = b->size < 4096 ? b->size : 4096;
+    uint32_t blocks = (b->size - length) / MFS_BLOCK_SIZE + 1;
+    uint32_t offset = rand_r(&b->seed) % blocks * MFS_BLOCK_SIZE;
+
+    return mfs_read(b->fs, b->work[i % WORK_FILES], offset, b->buffer, length, NULL) == (int)length ? MFS_OK : MFS_EIO;
+}
+
+static int runList(struct bench *b, int i)
+{
+    struct mfs_dirent entry;
+    int cursor = 0;
+
+    while (mfs_readdir(b->fs, &cursor, &entry) == MFS_OK)
+    {
+    }
+    return MFS_OK;
+}
+
+static int runDf(struct bench *b, int i)
+{
+    return mfs_df(b->fs) > 0 ? MFS_OK : MFS_ENOSPC;
+}
+
+// Undoes the previous repetition's encryption of the file.
+static int setupEncrypt(struct bench *b, int i)
+{
+    struct mfs_stat st;
+
+    if (mfs_stat(b->fs, b->work[i % WORK_FILES], &st) == MFS_OK && (st.attribute & MFS_ENCRYPTED))
+    {
+        return mfs_decrypt(b->fs, b->work[i % WORK_FILES], b->key);
+    }
+    return MFS_OK;
+}
+
+static int runEncrypt(struct bench *b, int i)
+{
+    return mfs_encrypt(b->fs, b->work[i % WORK_FILES], b->key);
+}
+
+// Puts back the file the previous repetition deleted.
+static int setupDelete(struct bench *b, int i)
+{
+    return runInsert(b, i);
+}
+
+static int runDelete(struct bench *b, int i)
+{
+    return mfs_unlink(b->fs, b->work[i % WORK_FILES]);
+}
+
+static int runSavefs(struct bench *b, int i)
+{
+    return mfs_save(b->fs);
+}
+
+static const struct op ops[] =
+{
+    { "insert", NULL, runInsert, 1 },
+    { "retrieve", NULL, runRetrieve, 1 },
+    { "read", NULL, runRead, 0 },
+    { "list", NULL, runList, 0 },
+    { "df", NULL, runDf, 0 },
+    { "encrypt", setupEncrypt, runEncrypt, 1 },
+    { "delete", setupDelete, runDelete, 0 },
+    { "savefs", setupDelete, runSavefs, 0 },
+};
+
+// Prints one result object. The JSON is written by hand to stay dependency free.
+static void report(const char *indent, const char *name, double *latency, int reps, double bytes, int errors)
+{
+    double total = 0;
+
+    for (int i = 0; i < reps; i++)
+    {
+        total += latency[i];
+    }
+    qsort(latency, reps, sizeof(double), compareDoubles);
+
+    printf("%s%s\"%s\": { \"reps\": %d, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"errors\": %d }",
+           first_result ? "" : ",\n", indent, name, reps, reps / total,
+           bytes / total / 1e6, latency[reps / 2] * 1e6, latency[(reps * 99) / 100] * 1e6, errors);
+    first_result = 0;
+}
+
+// Times reps repetitions of one operation.
+static void measure(struct bench *b, const struct op *op, int reps)
+{
+    double *latency = malloc(reps * sizeof(double));
+    int errors = 0;
+
+    for (int i = 0; i < reps; i++)
+    {
+        if (op->setup != NULL)
+        {
+            op->setup(b, i);
+        }
+
+        double start = now();
+        if (op->run(b, i) != MFS_OK)
+        {
+            errors++;
+        }
+        latency[i] = now() - start;
+    }
+
+    report("        ", op->name, latency, reps, op->moves_data ? (double)reps * b->size : 0, errors);
+    free(latency);
+}
+
+// Leaves single free blocks between the blocks of FRAG_PAIRS files.
+static void fragment(struct mfs *fs, uint8_t *data)
+{
+    char a[32], b[32];
+
+    for (int p = 0; p < FRAG_PAIRS; p++)
+    {
+        snprintf(a, sizeof(a), "frag%d", p);
+        snprintf(b, sizeof(b), "hole%d", p);
+        mfs_insert(fs, a, data, 0, NULL);
+        mfs_insert(fs, b, data, 0, NULL);
+
+        // Appending a block to each in turn interleaves their blocks.
+        for (int i = 0; i < MFS_MAX_FILE_SIZE / MFS_BLOCK_SIZE; i++)
+        {
+            mfs_write(fs, a, MFS_APPEND, data, MFS_BLOCK_SIZE);
+            mfs_write(fs, b, MFS_APPEND, data, MFS_BLOCK_SIZE);
+        }
+    }
+
+    for (int p = 0; p < FRAG_PAIRS; p++)
+    {
+        snprintf(b, sizeof(b), "hole%d", p);
+        mfs_unlink(fs, b);
+    }
+}
+
+// Builds an image in the given state and reopens it, so allocation starts
+// from the beginning of the free map as it does after open.
+static struct mfs *buildImage(int fragmented, int files, uint8_t *data)
+{
+    struct mfs *fs;
+    char name[32];
+
+    if (mfs_create(IMAGE_PATH, &fs) != MFS_OK)
+    {
+        return NULL;
+    }
+
+    if (fragmented)
+    {
+        fragment(fs, data);
+        files -= FRAG_PAIRS;
+    }
+
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(name, sizeof(name), "fill%d", i);
+        mfs_insert(fs, name, data, 1, NULL);
+    }
+
+    mfs_save(fs);
+    mfs_close(fs);
+
+    return mfs_open(IMAGE_PATH, 0, &fs) == MFS_OK ? fs : NULL;
+}
+
+// Times creating, saving and opening images.
+static void imageOps()
+{
+    int reps = quick ? 2 : 8;
+    double latency[8];
+    struct mfs *fs;
+
+    printf("  \"image\": {\n");
+
+    for (int i = 0; i < reps; i++)
+    {
+        double start = now();
+        mfs_create(IMAGE_PATH, &fs);
+        mfs_save(fs);
+        mfs_close(fs);
+        latency[i] = now() - start;
+    }
+    report("    ", "createfs", latency, reps, 0, 0);
+
+    for (int i = 0; i < reps; i++)
+    {
+        double start = now();
+        int err = mfs_open(IMAGE_PATH, 0, &fs);
+        latency[i] = now() - start;
+        if (err == MFS_OK)
+        {
+            mfs_close(fs);
+        }
+    }
+    report("    ", "open", latency, reps, 0, 0);
+
+    printf("\n  },\n");
+}
+
+int main(int argc, char *argv[])
+{
+    quick = argc > 1 && strcmp(argv[1], "-q") == 0;
+
+    struct bench b;
+
+    memset(&b, 0, sizeof(b));
+    b.data = malloc(MFS_MAX_FILE_SIZE);
+    b.buffer = malloc(MFS_MAX_FILE_SIZE);
+    b.seed = 1;
+
+    if (b.data == NULL || b.buffer == NULL)
+    {
+        printf("mfs_bench: Out of memory.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < MFS_MAX_FILE_SIZE; i++)
+    {
+        b.data[i] = (uint8_t)(i * 31 + 7);
+    }
+    for (int i = 0; i < MFS_KEY_SIZE; i++)
+    {
+        b.key[i] = (uint8_t)i;
+    }
+    for (int i = 0; i < WORK_FILES; i++)
+    {
+        snprintf(b.work[i], sizeof(b.work[i]), "work%d", i);
+    }
+
+    printf("{\n");
+    first_result = 1;
+    imageOps();
+    printf("  \"workloads\": [\n");
+
+    int first_workload = 1;
+
+    for (int fragmented = 0; fragmented <= 1; fragmented++)
+    {
+        for (int d = 0; d < (int)(sizeof(directories) / sizeof(directories[0])); d++)
+        {
+            int files = directories[d].files;
+
+            if (fragmented && files < FRAG_PAIRS)
+            {
+                files = FRAG_PAIRS;
+            }
+
+            b.fs = buildImage(fragmented, files, b.data);
+
+            if (b.fs == NULL)
+            {
+                fprintf(stderr, "mfs_bench: Can not build %s.\n", IMAGE_PATH);
+                return 1;
+            }
+
+            for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+            {
+                b.size = sizes[s];
+
+                printf("%s    { \"free_map\": \"%s\", \"directory\": \"%s\", \"files\": %d, \"size\": %u, \"ops\": {\n",
+                       first_workload ? "" : ",\n", fragmented ? "fragmented" : "fresh",
+                       directories[d].name, files + WORK_FILES, b.size);
+                first_workload = 0;
+                first_result = 1;
+
+                int reps = TARGET_BYTES / b.size;
+                reps = reps < MIN_REPS ? MIN_REPS : reps > MAX_REPS ? MAX_REPS : reps;
+                if (quick)
+                {
+                    reps = (reps + 9) / 10;
+                }
+
+                for (int o = 0; o < (int)(sizeof(ops) / sizeof(ops[0])); o++)
+                {
+                    measure(&b, &ops[o], ops[o].run == runSavefs ? (quick ? 2 : SAVE_REPS) : reps);
+                }
+
+                printf("\n    } }");
+            }
+
+            mfs_close(b.fs);
+        }
+    }
+
+    printf("\n  ]\n}\n");
+
+    unlink(IMAGE_PATH);
+    free(b.data);
+    free(b.buffer);
+
+    return 0;
+}
@@ -0,0 +1,245 @@
+// Measures requests against a resident mfs --serve process, compared with
+// opening the image for every request the way a per-request wrapper does.
+//
+// Usage: serve_bench [clients]   (run from the repository root, needs ./mfs)
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "libmfs.h"
+#include "serve.h"
+
+#define IMAGE_PATH "/tmp/serve_bench.img"
+#define SOCKET_PATH "/tmp/serve_bench.sock"
+#define FILES 64
+#define FILE_SIZE (16 * 1024)
+#define REQUESTS 4000               // Per client
+#define OPEN_REQUESTS 20            // Open, read, close cycles to time
+#define MAX_CLIENTS 16
+
+struct client
+{
+    int id;
+    int errors;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sendAll(int fd, const void *buf, size_t len)
+{
+    for (size_t done = 0; done < len; )
+    {
+        ssize_t n = write(fd, (const uint8_t *)buf + done, len - done);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int recvAll(int fd, void *buf, size_t len)
+{
+    for (size_t done = 0; done < len; )
+    {
+        ssize_t n = read(fd, (uint8_t *)buf + done, len - done);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int connectServer()
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one request and reads its response into payload.
+static int request(int fd, uint8_t op, const char *name, const void *data, uint32_t length,
+                   void *payload, struct serve_response *res)
+{
+    struct serve_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.name_len = name ? strlen(name) : 0;
+    req.length = length;
+
+    if (sendAll(fd, &req, sizeof(req)) == -1 ||
+        sendAll(fd, name, req.name_len) == -1 ||
+        (op == SERVE_INSERT && sendAll(fd, data, length) == -1) ||
+        recvAll(fd, res, sizeof(*res)) == -1 ||
+        recvAll(fd, payload, res->length) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void *run(void *arg)
+{
+    struct client *c = (struct client *)arg;
+    static __thread uint8_t buffer[MFS_MAX_FILES * sizeof(struct serve_entry) + FILE_SIZE];
+    struct serve_response res;
+    char name[64];
+    unsigned seed = c->id + 1;
+    int fd = connectServer();
+
+    if (fd == -1)
+    {
+        c->errors = REQUESTS;
+        return NULL;
+    }
+
+    for (int i = 0; i < REQUESTS; i++)
+    {
+        snprintf(name, sizeof(name), "file%d", rand_r(&seed) % FILES);
+
+        // Mostly whole-file reads, with some inserts, lists and df.
+        int kind = i % 10;
+        uint8_t op = kind < 6 ? SERVE_RETRIEVE : kind < 8 ? SERVE_INSERT : kind < 9 ? SERVE_LIST : SERVE_DF;
+
+        if (op == SERVE_INSERT)
+        {
+            memset(buffer, i, FILE_SIZE);
+        }
+
+        if (request(fd, op, op == SERVE_LIST || op == SERVE_DF ? NULL : name,
+                    buffer, op == SERVE_INSERT ? FILE_SIZE : 0, buffer, &res) == -1 ||
+            res.status < 0)
+        {
+            c->errors++;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int clients = argc > 1 ? atoi(argv[1]) : 4;
+
+    if (clients < 1 || clients > MAX_CLIENTS)
+    {
+        printf("serve_bench: Clients must be 1 to %d.\n", MAX_CLIENTS);
+        return 1;
+    }
+
+    struct mfs *fs;
+    static uint8_t data[FILE_SIZE];
+    char name[64];
+
+    if (mfs_create(IMAGE_PATH, &fs) != MFS_OK)
+    {
+        printf("serve_bench: Can not create %s.\n", IMAGE_PATH);
+        return 1;
+    }
+    for (int i = 0; i < FILES; i++)
+    {
+        memset(data, i + 1, FILE_SIZE);
+        snprintf(name, sizeof(name), "file%d", i);
+        mfs_insert(fs, name, data, FILE_SIZE, NULL);
+    }
+    mfs_save(fs);
+    mfs_close(fs);
+
+    // What a wrapper that opens the image for each request pays.
+    double start = now();
+    for (int i = 0; i < OPEN_REQUESTS; i++)
+    {
+        mfs_open(IMAGE_PATH, 0, &fs);
+        mfs_read(fs, "file0", 0, data, FILE_SIZE, NULL);
+        mfs_close(fs);
+    }
+    double elapsed = now() - start;
+    printf("open per request %10.0f req/s %8.3f ms/req\n",
+           OPEN_REQUESTS / elapsed, elapsed / OPEN_REQUESTS * 1e3);
+
+    pid_t server = fork();
+
+    if (server == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        execl("./mfs", "mfs", "--serve", SOCKET_PATH, IMAGE_PATH, (char *)NULL);
+        _exit(127);
+    }
+
+    // Wait for the server to listen.
+    int fd = -1;
+    for (int tries = 0; tries < 500 && fd == -1; tries++)
+    {
+        usleep(10000);
+        fd = connectServer();
+    }
+    if (fd == -1)
+    {
+        printf("serve_bench: Server did not start (run from the repository root).\n");
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        return 1;
+    }
+    close(fd);
+
+    struct client workers[MAX_CLIENTS];
+    pthread_t tids[MAX_CLIENTS];
+    int errors = 0;
+
+    start = now();
+    for (int t = 0; t < clients; t++)
+    {
+        workers[t].id = t;
+        workers[t].errors = 0;
+        pthread_create(&tids[t], NULL, run, &workers[t]);
+    }
+    for (int t = 0; t < clients; t++)
+    {
+        pthread_join(tids[t], NULL);
+        errors += workers[t].errors;
+    }
+    elapsed = now() - start;
+
+    printf("resident server  %10.0f req/s %8.3f ms/req  (%d clients%s)\n",
+           clients * REQUESTS / elapsed, elapsed / REQUESTS * 1e3, clients,
+           errors ? ", errors" : "");
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(IMAGE_PATH);
+
+    return errors ? 1 : 0;
+}
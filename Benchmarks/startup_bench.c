@@ -0,0 +1,142 @@
+// Times starting the shell and creating images: mfs -b started and quit,
+// mfs_create() alone, mfs_create() with the first mfs_save(), and the
+// createfs and savefs commands run through the shell. Prints the median
+// and minimum of each. Run it from the repository root, after make, before
+// and after changing how images are set up.
+//
+// Usage: startup_bench [reps]   (default 50 per measurement)
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "libmfs.h"
+
+#define IMAGE_PATH "/tmp/startup_bench.img"
+#define SCRIPT_PATH "/tmp/startup_bench.txt"
+#define MAX_REPS 1000
+
+static double samples[MAX_REPS];
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints the median and minimum of reps samples.
+static void report(const char *name, int reps)
+{
+    qsort(samples, reps, sizeof(double), compareDoubles);
+    printf("%-28s %10.1f us  (min %.1f us)\n", name, samples[reps / 2] * 1e6, samples[0] * 1e6);
+}
+
+// Runs ./mfs -f script with its output thrown away.
+static int runShell(const char *script)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+
+        dup2(null, STDOUT_FILENO);
+        execl("./mfs", "mfs", "-f", script, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Times the shell with a script of commands.
+static void benchShell(const char *name, const char *commands, int reps)
+{
+    FILE *script = fopen(SCRIPT_PATH, "w");
+
+    if (script == NULL)
+    {
+        printf("startup_bench: Can not create %s.\n", SCRIPT_PATH);
+        exit(1);
+    }
+    fputs(commands, script);
+    fclose(script);
+
+    for (int i = 0; i < reps; i++)
+    {
+        double start = now();
+
+        if (runShell(SCRIPT_PATH) == -1)
+        {
+            printf("startup_bench: ./mfs failed. Run it from the repository root after make.\n");
+            exit(1);
+        }
+        samples[i] = now() - start;
+    }
+    report(name, reps);
+}
+
+int main(int argc, char *argv[])
+{
+    int reps = argc > 1 ? atoi(argv[1]) : 50;
+
+    if (reps < 1 || reps > MAX_REPS)
+    {
+        printf("startup_bench: Repetitions must be 1 to %d.\n", MAX_REPS);
+        return 1;
+    }
+
+    struct mfs *fs;
+
+    printf("%d repetitions, median and minimum\n", reps);
+
+    for (int i = 0; i < reps; i++)
+    {
+        double start = now();
+
+        if (mfs_create(IMAGE_PATH, &fs) != MFS_OK)
+        {
+            printf("startup_bench: Can not create %s.\n", IMAGE_PATH);
+            return 1;
+        }
+        samples[i] = now() - start;
+        mfs_close(fs);
+    }
+    report("mfs_create", reps);
+
+    for (int i = 0; i < reps; i++)
+    {
+        double start = now();
+
+        mfs_create(IMAGE_PATH, &fs);
+        mfs_save(fs);
+        samples[i] = now() - start;
+        mfs_close(fs);
+    }
+    report("mfs_create + mfs_save", reps);
+
+    benchShell("mfs start and quit", "quit\n", reps);
+    benchShell("mfs createfs", "createfs " IMAGE_PATH "\n", reps);
+    benchShell("mfs createfs, savefs", "createfs " IMAGE_PATH "\nsavefs\n", reps);
+
+    unlink(IMAGE_PATH);
+    unlink(SCRIPT_PATH);
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Measures how read and insert throughput against one open image scale with
+// the number of threads calling into libmfs.
+//
+// Usage: stress_bench [max_threads]   (default: online CPUs, at least 4)
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libmfs.h"
+
+#define IMAGE_PATH "/tmp/stress_bench.img"
+#define SHARED_FILES 64             // Read by every thread
+#define FILES_PER_THREAD 8          // Rewritten by one thread only
+#define FILE_SIZE (16 * 1024)
+#define READ_OPS 20000              // Per thread
+#define INSERT_OPS 2000             // Per thread
+#define MAX_THREADS 16              // 64 + 16 * 8 files fit in the directory
+
+struct worker
+{
+    struct mfs *fs;
+    int id;
+    int insert;
+    int errors;
+    uint8_t buffer[FILE_SIZE];
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    char name[64];
+    unsigned seed = w->id * 7919 + 1;
+
+    if (w->insert)
+    {
+        for (int i = 0; i < INSERT_OPS; i++)
+        {
+            snprintf(name, sizeof(name), "t%d_%d", w->id, i % FILES_PER_THREAD);
+            memset(w->buffer, i + 1, FILE_SIZE);
+            if (mfs_insert(w->fs, name, w->buffer, FILE_SIZE, NULL) != MFS_OK)
+            {
+                w->errors++;
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < READ_OPS; i++)
+        {
+            snprintf(name, sizeof(name), "shared%d", rand_r(&seed) % SHARED_FILES);
+            if (mfs_read(w->fs, name, 0, w->buffer, FILE_SIZE, NULL) != FILE_SIZE)
+            {
+                w->errors++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Runs one phase with the given number of threads and prints its rate.
+static void phase(struct mfs *fs, int threads, int insert, double *base)
+{
+    static struct worker workers[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    int errors = 0;
+
+    double start = now();
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].fs = fs;
+        workers[t].id = t;
+        workers[t].insert = insert;
+        workers[t].errors = 0;
+        pthread_create(&tids[t], NULL, run, &workers[t]);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        errors += workers[t].errors;
+    }
+    double elapsed = now() - start;
+
+    double ops = (double)threads * (insert ? INSERT_OPS : READ_OPS) / elapsed;
+    if (threads == 1)
+    {
+        *base = ops;
+    }
+
+    printf("%-6s %2d threads %10.0f ops/s %8.1f MB/s %5.2fx%s\n",
+           insert ? "insert" : "read", threads, ops, ops * FILE_SIZE / 1e6,
+           ops / *base, errors ? "  (errors)" : "");
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc == 1 && max_threads < 4)
+    {
+        max_threads = 4;
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS)
+    {
+        printf("stress_bench: Thread count must be 1 to %d.\n", MAX_THREADS);
+        return 1;
+    }
+
+    struct mfs *fs;
+    int err = mfs_create(IMAGE_PATH, &fs);
+
+    if (err != MFS_OK)
+    {
+        printf("stress_bench: %s.\n", mfs_strerror(err));
+        return 1;
+    }
+
+    static uint8_t data[FILE_SIZE];
+    char name[64];
+
+    for (int i = 0; i < SHARED_FILES; i++)
+    {
+        memset(data, i + 1, FILE_SIZE);
+        snprintf(name, sizeof(name), "shared%d", i);
+        mfs_insert(fs, name, data, FILE_SIZE, NULL);
+    }
+
+    double base = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        phase(fs, threads, 0, &base);
+    }
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        phase(fs, threads, 1, &base);
+    }
+
+    mfs_close(fs);
+    unlink(IMAGE_PATH);
+
+    return 0;
+}
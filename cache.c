@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "trace.h"
+
+// Creates a cache of capacity frames over the image open on fd.
+struct blockCache *cacheCreate(int fd, const char *path, int capacity, int block_size, int num_blocks)
+{
+    // Input: int fd - The image file, open for reading and writing.
+    //        const char *path - The image file's path. The spill file is
+    //                           created next to it.
+    //        int capacity - Number of blocks the cache may hold.
+    //        int block_size - Bytes per block.
+    //        int num_blocks - Blocks in the image.
+    // Output: struct blockCache *. The new cache, or NULL if out of memory.
+
+    struct blockCache *cache = calloc(1, sizeof(struct blockCache));
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->fd = fd;
+    cache->spill_fd = -1;
+    cache->capacity = capacity;
+    cache->block_size = block_size;
+    cache->num_blocks = num_blocks;
+    cache->frames = malloc((size_t)capacity * block_size);
+    cache->frame_block = malloc(capacity * sizeof(int32_t));
+    cache->pins = calloc(capacity, sizeof(uint16_t));
+    cache->referenced = calloc(capacity, 1);
+    cache->dirty = calloc(capacity, 1);
+    cache->block_frame = malloc(num_blocks * sizeof(int32_t));
+    cache->spill_slot = malloc(num_blocks * sizeof(int32_t));
+    cache->spill_path = malloc(strlen(path) + sizeof(".spill.XXXXXX"));
+
+    if (cache->frames == NULL || cache->frame_block == NULL || cache->pins == NULL ||
+        cache->referenced == NULL || cache->dirty == NULL || cache->block_frame == NULL ||
+        cache->spill_slot == NULL || cache->spill_path == NULL)
+    {
+        cacheDestroy(cache);
+        return NULL;
+    }
+
+    memset(cache->frame_block, 0xff, capacity * sizeof(int32_t));
+    memset(cache->block_frame, 0xff, num_blocks * sizeof(int32_t));
+    memset(cache->spill_slot, 0xff, num_blocks * sizeof(int32_t));
+    sprintf(cache->spill_path, "%s.spill.XXXXXX", path);
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->unpinned, NULL);
+
+    return cache;
+}
+
+// Frees the cache. Dirty and spilled blocks are discarded, call cacheFlush() first to keep them.
+void cacheDestroy(struct blockCache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    free(cache->frames);
+    free(cache->frame_block);
+    free(cache->pins);
+    free(cache->referenced);
+    free(cache->dirty);
+    free(cache->block_frame);
+    free(cache->spill_slot);
+    free(cache->spill_path);
+
+    if (cache->spill_fd != -1)
+    {
+        close(cache->spill_fd);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->unpinned);
+    free(cache);
+}
+
+// Writes a dirty frame to its block's slot in the spill file. Called with the lock held.
+static int spillFrame(struct blockCache *cache, int frame)
+{
+    // Input: struct blockCache *cache - The cache.
+    //        int frame - A dirty frame.
+    // Output: int. 0, or -1 if the spill file can not be created or
+    //         written, leaving the frame dirty.
+    // Description: The spill file is created on the first spill and
+    //              unlinked at once, so it goes away with the cache. A block
+    //              keeps its slot until the next cacheFlush().
+
+    int32_t block = cache->frame_block[frame];
+
+    if (cache->spill_fd == -1)
+    {
+        cache->spill_fd = mkstemp(cache->spill_path);
+
+        if (cache->spill_fd == -1)
+        {
+            sprintf(cache->spill_path + strlen(cache->spill_path) - 6, "XXXXXX");
+            cache->io_errors++;
+            return -1;
+        }
+        unlink(cache->spill_path);
+    }
+
+    int32_t slot = cache->spill_slot[block] != -1 ? cache->spill_slot[block] : cache->spill_count;
+    uint8_t *data = cache->frames + (size_t)frame * cache->block_size;
+
+    TRACE_BEGIN("io", "spill");
+    if (pwrite(cache->spill_fd, data, cache->block_size, (off_t)slot * cache->block_size) != cache->block_size)
+    {
+        TRACE_END("io", "spill");
+        cache->io_errors++;
+        return -1;
+    }
+    TRACE_END("io", "spill");
+
+    if (cache->spill_slot[block] == -1)
+    {
+        cache->spill_slot[block] = slot;
+        cache->spill_count++;
+    }
+
+    cache->dirty[frame] = 0;
+    cache->writebacks++;
+
+    return 0;
+}
+
+// Finds a frame to reuse with the CLOCK algorithm. Called with the lock held.
+static int evict(struct blockCache *cache)
+{
+    // Each unpinned frame gets a second chance: a set reference bit is
+    // cleared and the hand moves on. Two full sweeps without a victim
+    // mean every frame is pinned, and errno is ENOBUFS. A dirty victim
+    // that can not be spilled stays cached and errno is EIO.
+
+    for (int step = 0; step < 2 * cache->capacity; step++)
+    {
+        int frame = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        if (cache->pins[frame] > 0)
+        {
+            continue;
+        }
+
+        if (cache->referenced[frame])
+        {
+            cache->referenced[frame] = 0;
+            continue;
+        }
+
+        if (cache->frame_block[frame] != -1)
+        {
+            if (cache->dirty[frame] && spillFrame(cache, frame) == -1)
+            {
+                errno = EIO;
+                return -1;
+            }
+            cache->block_frame[cache->frame_block[frame]] = -1;
+            cache->frame_block[frame] = -1;
+        }
+
+        return frame;
+    }
+
+    errno = ENOBUFS;
+    return -1;
+}
+
+// Returns a pinned pointer to a block, loading it on a miss.
+uint8_t *cacheGet(struct blockCache *cache, int32_t block)
+{
+    // Input: struct blockCache *cache - The cache.
+    //        int32_t block - Index of the block in the image.
+    // Output: uint8_t *. The block's block_size bytes, valid until the
+    //         matching cachePut(). NULL if a frame could not be freed or
+    //         the block could not be read.
+    // Description: A block that was spilled is read back from the spill
+    //              file, any other from the image. While every frame is
+    //              pinned the call waits for one to be put back. Callers
+    //              pin at most two blocks at a time, so with at least 64
+    //              frames that wait ends unless 32 threads are inside it.
+
+    pthread_mutex_lock(&cache->lock);
+
+    int frame;
+
+    while ((frame = cache->block_frame[block]) == -1 && (frame = evict(cache)) == -1 && errno == ENOBUFS)
+    {
+        pthread_cond_wait(&cache->unpinned, &cache->lock);
+    }
+
+    if (frame != -1 && cache->frame_block[frame] == block)
+    {
+        cache->hits++;
+    }
+    else
+    {
+        if (frame == -1)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+
+        uint8_t *data = cache->frames + (size_t)frame * cache->block_size;
+        int32_t slot = cache->spill_slot[block];
+        ssize_t n;
+
+        TRACE_BEGIN("io", "cacheMiss");
+        if (slot != -1)
+        {
+            n = pread(cache->spill_fd, data, cache->block_size, (off_t)slot * cache->block_size);
+        }
+        else
+        {
+            n = pread(cache->fd, data, cache->block_size, (off_t)block * cache->block_size);
+        }
+        TRACE_END("io", "cacheMiss");
+
+        if (n != cache->block_size)
+        {
+            cache->io_errors++;
+            pthread_mutex_unlock(&cache->lock);
+            errno = EIO;
+            return NULL;
+        }
+
+        cache->frame_block[frame] = block;
+        cache->block_frame[block] = frame;
+        cache->dirty[frame] = 0;
+        cache->misses++;
+    }
+
+    cache->pins[frame]++;
+    cache->referenced[frame] = 1;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return cache->frames + (size_t)frame * cache->block_size;
+}
+
+// Returns a block the caller already has pinned, without pinning it again.
+uint8_t *cachePeek(struct blockCache *cache, int32_t block)
+{
+    // Input: struct blockCache *cache - The cache.
+    //        int32_t block - A block currently pinned by cacheGet().
+    // Output: uint8_t *. The block's frame, NULL if it is not cached.
+
+    pthread_mutex_lock(&cache->lock);
+
+    int frame = cache->block_frame[block];
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return frame == -1 ? NULL : cache->frames + (size_t)frame * cache->block_size;
+}
+
+// Unpins a block returned by cacheGet().
+void cachePut(struct blockCache *cache, int32_t block, int dirty)
+{
+    // Input: struct blockCache *cache - The cache.
+    //        int32_t block - The block passed to cacheGet().
+    //        int dirty - Non-zero if the block was modified.
+    // Output: void.
+
+    pthread_mutex_lock(&cache->lock);
+
+    int frame = cache->block_frame[block];
+
+    if (frame != -1)
+    {
+        if (dirty)
+        {
+            cache->dirty[frame] = 1;
+        }
+        if (cache->pins[frame] > 0 && --cache->pins[frame] == 0)
+        {
+            pthread_cond_signal(&cache->unpinned);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Writes every dirty and spilled block to the image file.
+int cacheFlush(struct blockCache *cache)
+{
+    // Input: struct blockCache *cache - The cache, with no block pinned.
+    // Output: int. Returns 0 on success, -1 if a read or write failed.
+    // Description: Dirty frames are written first, then spilled blocks that
+    //              are not cached are copied from the spill file. Only once
+    //              everything is in the image are the frames marked clean
+    //              and the spill file emptied, so a failed flush loses
+    //              nothing and can be retried.
+
+    uint8_t *copy = malloc(cache->block_size);
+
+    if (copy == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    int ret = 0;
+
+    TRACE_BEGIN("io", "cacheFlush");
+    for (int frame = 0; frame < cache->capacity && ret == 0; frame++)
+    {
+        int32_t block = cache->frame_block[frame];
+
+        // A clean frame of a spilled block holds what the spill file does.
+        if (block != -1 && (cache->dirty[frame] || cache->spill_slot[block] != -1) &&
+            pwrite(cache->fd, cache->frames + (size_t)frame * cache->block_size, cache->block_size,
+                   (off_t)block * cache->block_size) != cache->block_size)
+        {
+            ret = -1;
+        }
+    }
+
+    for (int32_t block = 0; block < cache->num_blocks && cache->spill_count > 0 && ret == 0; block++)
+    {
+        int32_t slot = cache->spill_slot[block];
+
+        if (slot != -1 && cache->block_frame[block] == -1 &&
+            (pread(cache->spill_fd, copy, cache->block_size, (off_t)slot * cache->block_size) != cache->block_size ||
+             pwrite(cache->fd, copy, cache->block_size, (off_t)block * cache->block_size) != cache->block_size))
+        {
+            ret = -1;
+        }
+    }
+    TRACE_END("io", "cacheFlush");
+
+    if (ret == 0)
+    {
+        memset(cache->dirty, 0, cache->capacity);
+
+        if (cache->spill_count > 0)
+        {
+            memset(cache->spill_slot, 0xff, cache->num_blocks * sizeof(int32_t));
+            cache->spill_count = 0;
+            if (ftruncate(cache->spill_fd, 0) == -1)
+            {
+                cache->io_errors++;
+            }
+        }
+    }
+    else
+    {
+        cache->io_errors++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    free(copy);
+
+    return ret;
+}
@@ -0,0 +1,47 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// A fixed-size cache of image blocks with CLOCK (second chance) eviction.
+// Blocks are pinned by cacheGet() and unpinned by cachePut(). A dirty block
+// that is evicted goes to a spill file beside the image, never over the
+// block in the image, whose directory and inodes still describe the image
+// as last saved. cacheFlush() writes dirty and spilled blocks to the image.
+struct blockCache
+{
+    int fd;                 // Image file, read and written with pread/pwrite
+    char *spill_path;       // mkstemp() template for the spill file
+    int spill_fd;           // Unlinked spill file, -1 until the first spill
+    int32_t *spill_slot;    // Slot in the spill file of each block, -1 if none
+    int32_t spill_count;    // Slots used
+    int capacity;           // Number of frames
+    int block_size;
+    int num_blocks;
+
+    uint8_t *frames;        // capacity * block_size bytes
+    int32_t *frame_block;   // Block held by each frame, -1 if empty
+    uint16_t *pins;         // Outstanding cacheGet() calls per frame
+    uint8_t *referenced;    // CLOCK reference bit per frame
+    uint8_t *dirty;         // Frame differs from its spill slot, or the image
+    int32_t *block_frame;   // Frame holding each block, -1 if not cached
+    int hand;               // CLOCK hand
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;    // Dirty blocks spilled by eviction
+    uint64_t io_errors;
+
+    pthread_mutex_t lock;
+    pthread_cond_t unpinned;    // Signalled when a frame's last pin goes
+};
+
+struct blockCache *cacheCreate(int fd, const char *path, int capacity, int block_size, int num_blocks);
+void cacheDestroy(struct blockCache *cache);
+uint8_t *cacheGet(struct blockCache *cache, int32_t block);
+uint8_t *cachePeek(struct blockCache *cache, int32_t block);
+void cachePut(struct blockCache *cache, int32_t block, int dirty);
+int cacheFlush(struct blockCache *cache);
+
+#endif
@@ -0,0 +1,199 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static void (*xor_kernel)(uint8_t *, size_t, uint8_t);
+static pthread_once_t xor_once = PTHREAD_ONCE_INIT;
+
+// Portable fallback: XOR a machine word at a time, then the tail byte by byte.
+static void xorBufferWord(uint8_t *data, size_t len, uint8_t key)
+{
+    uint64_t wide = 0x0101010101010101ULL * key;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word ^= wide;
+        memcpy(data + i, &word, sizeof(word));
+    }
+
+    for (; i < len; i++)
+    {
+        data[i] ^= key;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void xorBufferSSE2(uint8_t *data, size_t len, uint8_t key)
+{
+    __m128i wide = _mm_set1_epi8((char)key);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((__m128i *)(data + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(data + i + 16));
+        __m128i c = _mm_loadu_si128((__m128i *)(data + i + 32));
+        __m128i d = _mm_loadu_si128((__m128i *)(data + i + 48));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(a, wide));
+        _mm_storeu_si128((__m128i *)(data + i + 16), _mm_xor_si128(b, wide));
+        _mm_storeu_si128((__m128i *)(data + i + 32), _mm_xor_si128(c, wide));
+        _mm_storeu_si128((__m128i *)(data + i + 48), _mm_xor_si128(d, wide));
+    }
+
+    xorBufferWord(data + i, len - i, key);
+}
+
+__attribute__((target("avx2")))
+static void xorBufferAVX2(uint8_t *data, size_t len, uint8_t key)
+{
+    __m256i wide = _mm256_set1_epi8((char)key);
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i a = _mm256_loadu_si256((__m256i *)(data + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(data + i + 32));
+        __m256i c = _mm256_loadu_si256((__m256i *)(data + i + 64));
+        __m256i d = _mm256_loadu_si256((__m256i *)(data + i + 96));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(a, wide));
+        _mm256_storeu_si256((__m256i *)(data + i + 32), _mm256_xor_si256(b, wide));
+        _mm256_storeu_si256((__m256i *)(data + i + 64), _mm256_xor_si256(c, wide));
+        _mm256_storeu_si256((__m256i *)(data + i + 96), _mm256_xor_si256(d, wide));
+    }
+
+    xorBufferSSE2(data + i, len - i, key);
+}
+#endif
+
+// Picks the widest vector unit the CPU supports for xorBuffer().
+static void xorBufferInit()
+{
+    xor_kernel = xorBufferWord;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        xor_kernel = xorBufferAVX2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        xor_kernel = xorBufferSSE2;
+    }
+#endif
+}
+
+// XORs len bytes of data in place with the 1-byte key.
+void xorBuffer(uint8_t *data, size_t len, uint8_t key)
+{
+    // Input: uint8_t *data - The bytes to encrypt/decrypt in place.
+    //        size_t len - The number of bytes in data.
+    //        uint8_t key - The 1-byte XOR cipher.
+    // Output: void.
+    // Description: The kernel is chosen once, on the first call from any
+    //              thread.
+
+    pthread_once(&xor_once, xorBufferInit);
+
+    xor_kernel(data, len, key);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)                \
+    a += b; d ^= a; d = ROTL32(d, 16);          \
+    c += d; b ^= c; b = ROTL32(b, 12);          \
+    a += b; d ^= a; d = ROTL32(d, 8);           \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Produces one 64-byte ChaCha20 keystream block (RFC 8439, 20 rounds).
+static void chacha20Block(const uint32_t input[16], uint8_t out[64])
+{
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        store32(out + 4 * i, x[i] + input[i]);
+    }
+}
+
+// XORs len bytes of data in place with the ChaCha20 keystream for one file block.
+void chacha20Xor(uint8_t *data, size_t len, const uint8_t *key, uint64_t nonce, uint32_t block_pos)
+{
+    // Input: uint8_t *data - The bytes to encrypt/decrypt in place.
+    //        size_t len - The number of bytes in data.
+    //        const uint8_t *key - CHACHA20_KEY_SIZE byte key.
+    //        uint64_t nonce - Per-file nonce stored in the inode.
+    //        uint32_t block_pos - Index of the block within the file.
+    // Output: void.
+    // Description: Counter mode: keystream block n of the file block is
+    //              ChaCha20(key, counter = n, nonce = nonce || block_pos).
+
+    uint32_t state[16];
+    uint8_t stream[64];
+
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+
+    for (int i = 0; i < 8; i++)
+    {
+        state[4 + i] = load32(key + 4 * i);
+    }
+
+    state[12] = 0;
+    state[13] = (uint32_t)nonce;
+    state[14] = (uint32_t)(nonce >> 32);
+    state[15] = block_pos;
+
+    size_t i = 0;
+    while (i < len)
+    {
+        chacha20Block(state, stream);
+        state[12]++;
+
+        size_t n = len - i < sizeof(stream) ? len - i : sizeof(stream);
+        for (size_t j = 0; j < n; j++)
+        {
+            data[i + j] ^= stream[j];
+        }
+        i += n;
+    }
+}
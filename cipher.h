@@ -0,0 +1,17 @@
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XORs len bytes of data in place with the 1-byte key.
+void xorBuffer(uint8_t *data, size_t len, uint8_t key);
+
+#define CHACHA20_KEY_SIZE 32
+
+// XORs len bytes of data in place with the ChaCha20 keystream for one
+// file block. The 96-bit nonce is the file's 64-bit nonce followed by
+// block_pos, so every block can be processed independently.
+void chacha20Xor(uint8_t *data, size_t len, const uint8_t *key, uint64_t nonce, uint32_t block_pos);
+
+#endif
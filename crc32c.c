@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_CRC 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_kernel)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// Software fallback: slicing-by-8, eight table lookups per 8 input bytes.
+static uint32_t crc32cSlicing(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef HAVE_X86_CRC
+// Hardware path: the SSE4.2 crc32 instruction, 8 bytes at a time.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+
+    while (len--)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return crc;
+}
+#endif
+
+static void crc32cInit()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+        }
+    }
+
+    crc_kernel = crc32cSlicing;
+
+#ifdef HAVE_X86_CRC
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc_kernel = crc32cSSE42;
+    }
+#endif
+}
+
+// Returns the CRC32C (Castagnoli) of len bytes of data.
+uint32_t crc32c(const void *data, size_t len)
+{
+    // Input: const void *data - The bytes to checksum.
+    //        size_t len - The number of bytes in data.
+    // Output: uint32_t. The CRC32C of data.
+    // Description: The tables and the SSE4.2/slicing-by-8 choice are set up
+    //              once, on the first call from any thread.
+
+    pthread_once(&crc_once, crc32cInit);
+
+    return ~crc_kernel(~0U, (const uint8_t *)data, len);
+}
@@ -0,0 +1,10 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns the CRC32C (Castagnoli) of len bytes of data.
+uint32_t crc32c(const void *data, size_t len);
+
+#endif
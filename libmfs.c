@@ -0,0 +1,4977 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <stdarg.h>
+
+#include "libmfs.h"
+#include "cipher.h"
+#include "crc32c.h"
+#include "cache.h"
+#include "trace.h"
+
+#define NUM_BLOCKS 65536
+#define HUGE_PAGE_SIZE (2 << 20)
+#define BLOCK_SIZE MFS_BLOCK_SIZE
+#define MAX_BLOCKS_PER_FILE 1024
+#define MAX_FILE_SIZE MFS_MAX_FILE_SIZE
+#define NUM_FILES MFS_MAX_FILES
+
+#define READONLY MFS_READONLY
+#define HIDDEN MFS_HIDDEN
+#define ENCRYPTED MFS_ENCRYPTED
+
+// Block position used to derive a file's key check value. It is past
+// MAX_BLOCKS_PER_FILE so it never collides with a data block's keystream.
+#define KEY_CHECK_BLOCK 0xFFFFFFFF
+
+// Files with at least this many blocks are decrypted by several threads.
+#define PARALLEL_DECRYPT_BLOCKS 64
+
+// Batches of at least this many blocks are inserted by several threads.
+#define PARALLEL_INSERT_BLOCKS 64
+
+// Marks a file of a batch insert that replaces an existing file.
+#define BATCH_REWRITE -2
+
+// Marks a file of a batch insert replaced by a later file of the same name.
+#define BATCH_REPLACED -3
+
+// Upper bound on threads used by decryption, batch inserts and scrub.
+#define MAX_WORKER_THREADS 8
+
+// Statistics, see mfs_stats(). Several threads may update them at once, so
+// they use relaxed atomics. With MFS_STATS 0 they compile to nothing.
+#if MFS_STATS
+#define STAT_ADD(fs, counter, n) __atomic_fetch_add(&(fs)->stats.counter, (n), __ATOMIC_RELAXED)
+#define STAT_START(start) uint64_t start = nowNs()
+#define STAT_TIME(fs, hist, start) mfs_hist_record(&(fs)->stats.hist, nowNs() - (start))
+#else
+#define STAT_ADD(fs, counter, n) ((void)0)
+#define STAT_START(start) ((void)0)
+#define STAT_TIME(fs, hist, start) ((void)0)
+#endif
+
+// directory
+struct directoryEntry
+{
+    char filename[64];
+    short in_use;
+    int32_t inode;
+};
+
+// inode
+struct inode
+{
+    int32_t blocks[MAX_BLOCKS_PER_FILE];
+    short in_use;
+    uint32_t file_size;
+    time_t date;
+    uint8_t attribute;
+    uint64_t nonce;         // Per-file ChaCha20 nonce, set when ENCRYPTED
+    uint64_t key_check;     // Keystream sample used to reject a wrong key
+};
+
+// Image layout. The inode table is larger than the 257 blocks the original
+// spec reserved for it, so the free block map and the data region are placed
+// after wherever the inode table actually ends.
+#define DIRECTORY_BLOCK 0
+#define HEADER_BLOCK 18
+#define FREE_INODE_BLOCK 19
+#define INODE_BLOCK 20
+#define INODE_BLOCKS ((NUM_FILES * sizeof(struct inode) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define FREE_BLOCK_MAP_BLOCK (INODE_BLOCK + INODE_BLOCKS)
+#define CRC_BLOCK (FREE_BLOCK_MAP_BLOCK + NUM_BLOCKS / BLOCK_SIZE)
+#define REFCOUNT_BLOCK (CRC_BLOCK + NUM_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE)
+#define SNAPSHOT_BLOCK (REFCOUNT_BLOCK + NUM_BLOCKS * sizeof(uint16_t) / BLOCK_SIZE)
+#define SNAPSHOT_BLOCKS ((MAX_SNAPSHOTS * sizeof(struct snapshot) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define FIRST_DATA_BLOCK (SNAPSHOT_BLOCK + SNAPSHOT_BLOCKS)
+
+// A snapshot is a copy of the directory, free inode map and inode table
+// (blocks [0, SNAPSHOT_META_BLOCKS)) stored in ordinary data blocks. Every
+// data block the snapshot's files use holds an extra reference in
+// block_refs[], so later changes to live files copy those blocks instead
+// of overwriting them.
+#define MAX_SNAPSHOTS 8
+#define SNAPSHOT_META_BLOCKS FREE_BLOCK_MAP_BLOCK
+
+struct snapshot
+{
+    char name[64];
+    short in_use;
+    time_t date;
+    int32_t blocks[SNAPSHOT_META_BLOCKS];   // Where each metadata block is saved
+};
+
+// Block 18, between the directory and the free inode map, was never used.
+// It holds the image header. An image without one reads as generation 0.
+struct imageHeader
+{
+    uint64_t generation;    // Bumped whenever a process changes the image
+};
+
+// One of the locks in struct mfs. The rwlock orders the threads of this
+// process. When the image is shared between processes an fcntl lock on
+// a byte range of the image file orders the processes as well; holders
+// counts the threads sharing that fcntl lock so only the last one drops it.
+struct imageLock
+{
+    pthread_rwlock_t rwlock;
+    pthread_mutex_t mutex;  // Guards holders
+    int holders;            // Threads holding it shared, -1 if held exclusively
+    off_t start;            // Byte range of the image file it stands for
+    off_t length;
+};
+
+// An open image. Everything the shell used to keep in globals lives here,
+// so several images can be open in one process.
+struct mfs
+{
+    // The image. With a block cache only the metadata blocks
+    // [0, FIRST_DATA_BLOCK) are allocated here and data blocks go through
+    // block_cache instead. Either way data blocks are accessed with
+    // getBlock()/putBlock().
+    uint8_t (*data_blocks)[BLOCK_SIZE];
+
+    struct blockCache *block_cache;   // NULL when the whole image is resident
+    int image_fd;                     // Image file backing block_cache
+    char *image_name;                 // Image file name
+
+    // Blocks changed since the last save. Only these (plus the metadata
+    // region) are written back to the image.
+    uint8_t dirty_blocks[NUM_BLOCKS];
+    uint8_t image_dirty_all;          // Not saved since mfs_create()
+
+    uint8_t *free_blocks;
+    uint8_t *free_inodes;
+    uint32_t *block_crcs;   // CRC32C of every block, refreshed by putBlock()
+    uint16_t *block_refs;   // References to a block beyond its first owner
+    uint8_t verify_reads;   // Check CRC32C on every read
+
+    struct directoryEntry *directory_ptr;
+    struct inode *inode_ptr;
+    struct snapshot *snapshot_ptr;
+
+    // Locks, outermost first. image_lock is held shared by every call and
+    // exclusively by the calls that work on the whole image (save,
+    // snapshots, rollback, scrub). dir_lock is shared for lookups and
+    // exclusive to add or remove names. inode_locks[] guard each file's
+    // inode and data blocks. alloc_lock guards the free maps, block_refs[]
+    // and next_block, is only shared by mfs_df() and is never held while
+    // another lock is taken. In a shared image they lock the header, the
+    // directory, each inode and the free block map of the image file.
+    struct imageLock image_lock;
+    struct imageLock dir_lock;
+    struct imageLock inode_locks[NUM_FILES];
+    struct imageLock alloc_lock;
+
+    int32_t next_block;     // Where findFreeBlock() resumes scanning
+
+    // A shared image is the image file mapped MAP_SHARED into data_blocks,
+    // so every process sees the others' changes as they are made. A
+    // private copy remembers the generation it was loaded at instead and
+    // refuses to save over a newer image.
+    uint8_t shared;
+    uint8_t pages;          // MFS_PAGES_* data_blocks was allocated with
+    size_t image_bytes;     // Length of the data_blocks mapping
+    struct imageHeader *header_ptr;
+    uint64_t generation;    // Generation of the image when loaded or last saved
+
+    struct mfs_stats stats;
+};
+
+static struct mfs *newImage(const char *path, int rows);
+static int openShared(const char *path, struct mfs **fs);
+static void pointMetadata(struct mfs *fs);
+static int saveImage(struct mfs *fs);
+static int claimGeneration(struct mfs *fs, int image_fd);
+static void initMetadata(struct mfs *fs);
+static void *allocImage(size_t bytes, size_t *mapped, uint8_t *pages);
+static int32_t findFreeBlock(struct mfs *fs);
+static int32_t findFreeInode(struct mfs *fs);
+static int searchDirectory(struct mfs *fs, const char *filename);
+static int findFile(struct mfs *fs, const char *filename);
+static int lockFile(struct mfs *fs, const char *filename, int write);
+static void unlockFile(struct mfs *fs, int inode_index);
+static void initLock(struct imageLock *lock, off_t start, off_t length);
+static void destroyLock(struct imageLock *lock);
+static void lockShared(struct mfs *fs, struct imageLock *lock);
+static void lockExclusive(struct mfs *fs, struct imageLock *lock);
+static void releaseLock(struct mfs *fs, struct imageLock *lock);
+static void lockRange(int image_fd, off_t start, off_t length, short type);
+static int findFreeEntry(struct mfs *fs, int directory_entry);
+static int insertFile(struct mfs *fs, const char *name, const void *data, uint32_t size, const uint8_t *key);
+static int publishInsert(struct mfs *fs, const char *name, uint32_t size, int32_t *blocks,
+                         const uint8_t *key, uint64_t nonce);
+static int fillBlocks(struct mfs *fs, int32_t *blocks, const void *data, uint32_t size,
+                      const uint8_t *key, uint64_t nonce);
+static int markReplaced(struct mfs_file *files, int32_t *inodes, int count);
+static int compareBatchFiles(const void *a, const void *b);
+static void reserveBatch(struct mfs *fs, struct mfs_file *files, int32_t *inodes, int count);
+static void publishBatch(struct mfs *fs, struct mfs_file *files, int32_t *inodes, int count);
+static void releaseInode(struct mfs *fs, int32_t inode_index);
+static int cloneFile(struct mfs *fs, const char *source, const char *destination);
+static int unlinkInode(struct mfs *fs, int directory_entry, int32_t inode_index);
+static int undeleteFile(struct mfs *fs, const char *name);
+static void setName(char *dst, const char *name);
+static int32_t blockForWrite(struct mfs *fs, int32_t inode_index, int block_pos);
+static void truncateBlocks(struct mfs *fs, int32_t inode_index, int first_pos);
+static void releaseBlocks(struct mfs *fs, int32_t *blocks, int first_pos);
+static int isZeroBlock(const uint8_t *block);
+static void freeBlock(struct mfs *fs, int32_t block);
+static int32_t fileBlocks(struct mfs *fs, int32_t inode_index);
+static int32_t sharedBlocks(struct mfs *fs, int32_t inode_index);
+static void statInode(struct mfs *fs, int32_t inode_index, struct mfs_stat *st);
+static void fragInode(struct mfs *fs, int32_t inode_index, struct mfs_fragfile *info);
+static int readInode(struct mfs *fs, int32_t inode_index, uint32_t offset, uint8_t *buf, uint32_t size, const uint8_t *key);
+static int cipherFile(struct mfs *fs, const char *name, const uint8_t *key, uint8_t cipher, int encrypting);
+static int cipherInode(struct mfs *fs, int inode_index, const uint8_t *key, uint8_t cipher, int encrypting);
+static int cipherBlocks(struct mfs *fs, int inode_index, const uint8_t *key, uint64_t nonce,
+                        uint8_t cipher, int count);
+static int writeInode(struct mfs *fs, int inode_index, int32_t offset, const void *data, uint32_t size);
+static int truncateInode(struct mfs *fs, int inode_index, uint32_t size);
+static int searchSnapshot(struct mfs *fs, const char *name);
+static int rollbackSnapshot(struct mfs *fs, const char *snap);
+static int dropSnapshot(struct mfs *fs, const char *snap);
+static int takeSnapshot(struct mfs *fs, const char *snap);
+static void pinFiles(struct mfs *fs, struct directoryEntry *directory, struct inode *inodes, int pin);
+static int loadSnapshot(struct mfs *fs, int index, uint8_t **meta);
+static uint8_t *getBlock(struct mfs *fs, int32_t block);
+static void putBlock(struct mfs *fs, int32_t block, int dirty);
+static int verifyBlock(struct mfs *fs, int32_t block);
+static int workerThreads(int items, int threshold);
+static int checkKey(struct mfs *fs, int32_t inode_index, const uint8_t *key);
+static int decryptBlocks(struct mfs *fs, int32_t inode_index, const uint8_t *key, uint8_t *buffer, int first_pos, int count);
+static uint64_t keyCheck(const uint8_t *key, uint64_t nonce);
+static uint64_t randomNonce();
+#if MFS_STATS
+static uint64_t nowNs();
+#endif
+
+// Creates a new, empty image.
+int mfs_create(const char *path, struct mfs **fs)
+{
+    // Input: const char *path - Image file to create.
+    //        struct mfs **fs - Receives the handle.
+    // Output: int. MFS_OK or an error code.
+    // Description: The image is built in memory, which comes zeroed from
+    //              the kernel a page at a time as it is used. The image file
+    //              is created if it does not exist, but an existing one is
+    //              left alone: a process may have it mapped with MFS_SHARED.
+    //              Its generation is read instead, so the first mfs_save()
+    //              replaces it under the write lock as any other save would.
+    //              That save writes the metadata and the blocks written
+    //              since, and leaves the rest of the file as holes.
+
+    if (strlen(path) > MFS_NAME_MAX)
+    {
+        return MFS_ENAMETOOLONG;
+    }
+
+    int image_fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (image_fd == -1)
+    {
+        return MFS_EIO;
+    }
+
+    // A file too short to hold the header, such as a new one, reads as
+    // generation 0.
+    struct imageHeader header;
+
+    memset(&header, 0, sizeof(header));
+    lockRange(image_fd, 0, 0, F_RDLCK);
+
+    ssize_t got = pread(image_fd, &header, sizeof(header), (off_t)HEADER_BLOCK * BLOCK_SIZE);
+
+    lockRange(image_fd, 0, 0, F_UNLCK);
+    close(image_fd);
+
+    if (got == -1)
+    {
+        return MFS_EIO;
+    }
+
+    struct mfs *image = newImage(path, NUM_BLOCKS);
+
+    if (image == NULL)
+    {
+        return MFS_ENOMEM;
+    }
+
+    initMetadata(image);
+    image->image_dirty_all = 1;
+    image->generation = header.generation;
+
+    *fs = image;
+    return MFS_OK;
+}
+
+// Opens an existing image.
+int mfs_open(const char *path, int cache_blocks, struct mfs **fs)
+{
+    // Input: const char *path - Image file to open.
+    //        int cache_blocks - Data blocks to keep in memory, 0 to load
+    //                           the whole image, or MFS_SHARED.
+    //        struct mfs **fs - Receives the handle.
+    // Output: int. MFS_OK or an error code.
+    // Description: Without a cache the whole image is read into memory. With
+    //              one only the metadata blocks are read now and a CLOCK
+    //              cache serves the rest. Dirty data blocks it evicts go to
+    //              an unlinked spill file beside the image, and mfs_save()
+    //              copies them into the image, so the image file does not
+    //              change before mfs_save() is called. MFS_SHARED maps the
+    //              image instead, see openShared(). A private copy is read
+    //              while no process sharing the image is changing it.
+
+    STAT_START(start);
+
+    if (cache_blocks == MFS_SHARED)
+    {
+        int ret = openShared(path, fs);
+
+        if (ret == MFS_OK)
+        {
+            STAT_TIME(*fs, open, start);
+        }
+        return ret;
+    }
+
+    if (cache_blocks != 0 && cache_blocks < MFS_MIN_CACHE_BLOCKS)
+    {
+        return MFS_EINVAL;
+    }
+
+    int image_fd = open(path, cache_blocks ? O_RDWR : O_RDONLY);
+
+    if (image_fd == -1)
+    {
+        return MFS_ENOENT;
+    }
+
+    int rows = cache_blocks ? FIRST_DATA_BLOCK : NUM_BLOCKS;
+    struct stat buf;
+
+    if (fstat(image_fd, &buf) == -1 || buf.st_size < (off_t)NUM_BLOCKS * BLOCK_SIZE)
+    {
+        close(image_fd);
+        return MFS_ETRUNCATED;
+    }
+
+    struct mfs *image = newImage(path, rows);
+
+    if (image == NULL)
+    {
+        close(image_fd);
+        return MFS_ENOMEM;
+    }
+
+    size_t length = (size_t)rows * BLOCK_SIZE;
+    size_t done = 0;
+
+    TRACE_BEGIN("io", "readImage");
+    lockRange(image_fd, 0, 0, F_RDLCK);
+
+    while (done < length)
+    {
+        ssize_t n = pread(image_fd, (uint8_t *)image->data_blocks + done, length - done, done);
+
+        if (n <= 0)
+        {
+            TRACE_END("io", "readImage");
+            close(image_fd);
+            mfs_close(image);
+            return MFS_EIO;
+        }
+        done += n;
+        STAT_ADD(image, syscalls, 1);
+    }
+
+    lockRange(image_fd, 0, 0, F_UNLCK);
+    TRACE_END("io", "readImage");
+    STAT_ADD(image, syscalls, 2);
+    image->generation = image->header_ptr->generation;
+
+    if (cache_blocks == 0)
+    {
+        close(image_fd);
+    }
+    else
+    {
+        image->image_fd = image_fd;
+        image->block_cache = cacheCreate(image_fd, path, cache_blocks, BLOCK_SIZE, NUM_BLOCKS);
+
+        if (image->block_cache == NULL)
+        {
+            mfs_close(image);
+            return MFS_ENOMEM;
+        }
+    }
+
+    STAT_TIME(image, open, start);
+
+    *fs = image;
+    return MFS_OK;
+}
+
+// Maps an image that other processes may have open too.
+static int openShared(const char *path, struct mfs **fs)
+{
+    // Input: const char *path - Image file to open.
+    //        struct mfs **fs - Receives the handle.
+    // Output: int. MFS_OK or an error code.
+    // Description: The image file is mapped MAP_SHARED in place of the image
+    //              memory, so every process works on the same pages and
+    //              sees another's changes once that process releases its
+    //              locks. Nothing is read up front and nothing is ever
+    //              reloaded. Each lock in struct mfs also locks its part of
+    //              the image file, and each change bumps the generation in
+    //              the header so private copies can tell they are stale.
+
+    int image_fd = open(path, O_RDWR);
+
+    if (image_fd == -1)
+    {
+        return MFS_ENOENT;
+    }
+
+    struct stat buf;
+
+    if (fstat(image_fd, &buf) == -1 || buf.st_size < (off_t)NUM_BLOCKS * BLOCK_SIZE)
+    {
+        close(image_fd);
+        return MFS_ETRUNCATED;
+    }
+
+    struct mfs *image = newImage(path, 0);
+
+    if (image == NULL)
+    {
+        close(image_fd);
+        return MFS_ENOMEM;
+    }
+
+    image->image_fd = image_fd;
+
+    void *map = mmap(NULL, (size_t)NUM_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        mfs_close(image);
+        return MFS_EIO;
+    }
+
+    image->data_blocks = map;
+    image->image_bytes = (size_t)NUM_BLOCKS * BLOCK_SIZE;
+    image->shared = 1;
+    STAT_ADD(image, syscalls, 1);
+    pointMetadata(image);
+    image->generation = image->header_ptr->generation;
+
+    *fs = image;
+    return MFS_OK;
+}
+
+// Writes the image back to its file.
+int mfs_save(struct mfs *fs)
+{
+    // Input: struct mfs *fs - The image.
+    // Output: int. MFS_OK, MFS_ESTALE or MFS_EIO.
+    // Description: The metadata blocks and every data block marked dirty
+    //              since the last save are written. A freshly created image
+    //              is written out in full. With a block cache the dirty data
+    //              blocks are flushed from the cache instead. Other calls
+    //              wait until the image is written. A private copy is not
+    //              written over an image another process has changed since
+    //              it was loaded. A shared image is already the image file,
+    //              so saving only waits for the mapping to reach the disk.
+
+    STAT_START(start);
+
+    if (fs->shared)
+    {
+        lockShared(fs, &fs->image_lock);
+        TRACE_BEGIN("io", "msync");
+        int ret = msync(fs->data_blocks, (size_t)NUM_BLOCKS * BLOCK_SIZE, MS_SYNC) == 0 ? MFS_OK : MFS_EIO;
+        TRACE_END("io", "msync");
+        STAT_ADD(fs, syscalls, 1);
+        releaseLock(fs, &fs->image_lock);
+
+        STAT_TIME(fs, save, start);
+        return ret;
+    }
+
+    lockExclusive(fs, &fs->image_lock);
+    TRACE_BEGIN("io", "saveImage");
+    int ret = saveImage(fs);
+    TRACE_END("io", "saveImage");
+    releaseLock(fs, &fs->image_lock);
+
+    STAT_TIME(fs, save, start);
+    return ret;
+}
+
+// Writes the image back to its file. Called with image_lock held exclusively.
+static int saveImage(struct mfs *fs)
+{
+    if (fs->block_cache != NULL)
+    {
+        lockRange(fs->image_fd, 0, 0, F_WRLCK);
+
+        int ret = claimGeneration(fs, fs->image_fd);
+
+        // The data goes first, so the metadata never points at blocks the
+        // file does not hold yet.
+        if (ret == MFS_OK &&
+            (cacheFlush(fs->block_cache) == -1 ||
+             pwrite(fs->image_fd, (uint8_t *)fs->data_blocks, (size_t)FIRST_DATA_BLOCK * BLOCK_SIZE, 0) !=
+             (ssize_t)FIRST_DATA_BLOCK * BLOCK_SIZE))
+        {
+            ret = MFS_EIO;
+        }
+
+        lockRange(fs->image_fd, 0, 0, F_UNLCK);
+        STAT_ADD(fs, syscalls, 4);
+        return ret;
+    }
+
+    // Nothing is truncated before the lock is held and the generation
+    // checked, so a process sharing the file never sees it shrink.
+    int image_fd = open(fs->image_name, O_RDWR | O_CREAT, 0644);
+    FILE *disk_image = image_fd == -1 ? NULL : fdopen(image_fd, "r+");
+
+    if (disk_image == NULL)
+    {
+        if (image_fd != -1)
+        {
+            close(image_fd);
+        }
+        return MFS_EIO;
+    }
+
+    STAT_ADD(fs, syscalls, 2);
+
+    // The lock on the whole file waits out every process sharing the image
+    // and goes away with fclose().
+    lockRange(image_fd, 0, 0, F_WRLCK);
+    int ret = claimGeneration(fs, image_fd);
+    STAT_ADD(fs, syscalls, 2);
+
+    if (ret != MFS_OK)
+    {
+        fclose(disk_image);
+        return ret;
+    }
+
+    // A new image's data blocks are zero unless they are dirty, so the file
+    // is sized to hold them all and the clean ones are left as holes. Any
+    // older file at the same path is emptied first, so none of its data
+    // survives in the holes.
+    if (fs->image_dirty_all)
+    {
+        if (ftruncate(image_fd, 0) == -1 || ftruncate(image_fd, (off_t)NUM_BLOCKS * BLOCK_SIZE) == -1)
+        {
+            ret = MFS_EIO;
+        }
+        STAT_ADD(fs, syscalls, 2);
+    }
+
+    if (fwrite(&fs->data_blocks[0][0], BLOCK_SIZE, FIRST_DATA_BLOCK, disk_image) != FIRST_DATA_BLOCK)
+    {
+        ret = MFS_EIO;
+    }
+    STAT_ADD(fs, syscalls, 1);
+
+    // Write each run of consecutive dirty blocks with a single fwrite.
+    int i = FIRST_DATA_BLOCK;
+    while (i < NUM_BLOCKS)
+    {
+        if (!fs->dirty_blocks[i])
+        {
+            i++;
+            continue;
+        }
+
+        int run = i;
+        while (run < NUM_BLOCKS && fs->dirty_blocks[run])
+        {
+            run++;
+        }
+
+        fseek(disk_image, (long)i * BLOCK_SIZE, SEEK_SET);
+        if (fwrite(&fs->data_blocks[i][0], BLOCK_SIZE, run - i, disk_image) != run - i)
+        {
+            ret = MFS_EIO;
+        }
+        STAT_ADD(fs, syscalls, 2);
+        i = run;
+    }
+
+    if (fclose(disk_image) != 0)
+    {
+        ret = MFS_EIO;
+    }
+
+    if (ret == MFS_OK)
+    {
+        memset(fs->dirty_blocks, 0, NUM_BLOCKS);
+        fs->image_dirty_all = 0;
+    }
+
+    return ret;
+}
+
+// Moves a private copy and its image file on to the next generation.
+static int claimGeneration(struct mfs *fs, int image_fd)
+{
+    // Input: struct mfs *fs - The image, a private copy.
+    //        int image_fd - The image file, locked for writing.
+    // Output: int. MFS_OK, MFS_ESTALE if the file is no longer at the
+    //         generation the copy was loaded or last saved at, or MFS_EIO.
+    // Description: A file too short to hold the header, such as a new one
+    //              mfs_create() made, reads as generation 0.
+
+    struct imageHeader header;
+
+    memset(&header, 0, sizeof(header));
+
+    if (pread(image_fd, &header, sizeof(header), (off_t)HEADER_BLOCK * BLOCK_SIZE) == -1)
+    {
+        return MFS_EIO;
+    }
+
+    if (header.generation != fs->generation)
+    {
+        return MFS_ESTALE;
+    }
+
+    fs->header_ptr->generation = ++fs->generation;
+
+    return MFS_OK;
+}
+
+// Releases an image. Unsaved changes to a resident image are lost.
+void mfs_close(struct mfs *fs)
+{
+    if (fs == NULL)
+    {
+        return;
+    }
+
+    if (fs->block_cache != NULL)
+    {
+        cacheDestroy(fs->block_cache);
+    }
+
+    if (fs->image_fd != -1)
+    {
+        close(fs->image_fd);
+    }
+
+    destroyLock(&fs->image_lock);
+    destroyLock(&fs->dir_lock);
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        destroyLock(&fs->inode_locks[i]);
+    }
+    destroyLock(&fs->alloc_lock);
+
+    if (fs->data_blocks != NULL)
+    {
+        munmap(fs->data_blocks, fs->image_bytes);
+    }
+    free(fs->image_name);
+    free(fs);
+}
+
+// Allocates a handle with rows blocks of zeroed image memory, or none for
+// an image that is mapped by the caller.
+static struct mfs *newImage(const char *path, int rows)
+{
+    struct mfs *fs = calloc(1, sizeof(struct mfs));
+
+    if (fs == NULL)
+    {
+        return NULL;
+    }
+
+    initLock(&fs->image_lock, (off_t)HEADER_BLOCK * BLOCK_SIZE, BLOCK_SIZE);
+    initLock(&fs->dir_lock, (off_t)DIRECTORY_BLOCK * BLOCK_SIZE, (HEADER_BLOCK - DIRECTORY_BLOCK) * BLOCK_SIZE);
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        initLock(&fs->inode_locks[i], (off_t)INODE_BLOCK * BLOCK_SIZE + i * sizeof(struct inode),
+                 sizeof(struct inode));
+    }
+    initLock(&fs->alloc_lock, (off_t)FREE_BLOCK_MAP_BLOCK * BLOCK_SIZE,
+             (SNAPSHOT_BLOCK - FREE_BLOCK_MAP_BLOCK) * BLOCK_SIZE);
+
+    fs->data_blocks = rows ? allocImage((size_t)rows * BLOCK_SIZE, &fs->image_bytes, &fs->pages) : NULL;
+    fs->image_name = strdup(path);
+    fs->image_fd = -1;
+    fs->next_block = FIRST_DATA_BLOCK;
+
+    if ((rows && fs->data_blocks == NULL) || fs->image_name == NULL)
+    {
+        mfs_close(fs);
+        return NULL;
+    }
+
+    if (rows)
+    {
+        pointMetadata(fs);
+    }
+
+    return fs;
+}
+
+// Pages asked for by mfs_set_hugepages().
+static int page_mode = MFS_PAGES_TRANSPARENT;
+
+// Chooses the pages for the memory of images created or opened from now on.
+int mfs_set_hugepages(int mode)
+{
+    // Input: int mode - MFS_PAGES_SMALL, MFS_PAGES_TRANSPARENT or
+    //                   MFS_PAGES_EXPLICIT.
+    // Output: int. MFS_OK, or MFS_EINVAL for an unknown mode.
+
+    if (mode < MFS_PAGES_SMALL || mode > MFS_PAGES_EXPLICIT)
+    {
+        return MFS_EINVAL;
+    }
+
+    __atomic_store_n(&page_mode, mode, __ATOMIC_RELAXED);
+    return MFS_OK;
+}
+
+// Maps zeroed memory for an image.
+static void *allocImage(size_t bytes, size_t *mapped, uint8_t *pages)
+{
+    // Input: size_t bytes - Memory wanted.
+    //        size_t *mapped - Receives the length to pass to munmap().
+    //        uint8_t *pages - Receives the MFS_PAGES_* used.
+    // Output: void *. The memory, or NULL.
+    // Description: The kernel zeroes pages as they are first touched, so
+    //              memory the image never uses costs nothing. Huge pages
+    //              are only asked for when bytes fills at least one.
+    //              Explicit ones come from the pool reserved in
+    //              /proc/sys/vm/nr_hugepages, and when it is empty the
+    //              mapping falls back to transparent ones. For those the
+    //              mapping is aligned to a huge page, which the kernel
+    //              needs to back it with them, and marked MADV_HUGEPAGE so
+    //              they are used when the system setting is madvise.
+
+    int mode = __atomic_load_n(&page_mode, __ATOMIC_RELAXED);
+    size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    uint8_t *map;
+
+    if (mode != MFS_PAGES_SMALL && bytes >= HUGE_PAGE_SIZE)
+    {
+        if (mode == MFS_PAGES_EXPLICIT)
+        {
+            map = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+            if (map != MAP_FAILED)
+            {
+                *mapped = rounded;
+                *pages = MFS_PAGES_EXPLICIT;
+                return map;
+            }
+        }
+
+        map = mmap(NULL, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (map != MAP_FAILED)
+        {
+            uint8_t *start = (uint8_t *)(((uintptr_t)map + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+            // Give back what is left over on either side of the aligned range.
+            if (start > map)
+            {
+                munmap(map, start - map);
+            }
+            munmap(start + rounded, map + HUGE_PAGE_SIZE - start);
+
+            madvise(start, rounded, MADV_HUGEPAGE);
+            *mapped = rounded;
+            *pages = MFS_PAGES_TRANSPARENT;
+            return start;
+        }
+    }
+
+    map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    *mapped = bytes;
+    *pages = MFS_PAGES_SMALL;
+    return map;
+}
+
+// Points the metadata fields of a handle into its image memory.
+static void pointMetadata(struct mfs *fs)
+{
+    fs->directory_ptr = (struct directoryEntry *)&fs->data_blocks[DIRECTORY_BLOCK][0];
+    fs->inode_ptr = (struct inode *)&fs->data_blocks[INODE_BLOCK][0];
+    fs->free_blocks = (uint8_t *)&fs->data_blocks[FREE_BLOCK_MAP_BLOCK][0];
+    fs->free_inodes = (uint8_t *)&fs->data_blocks[FREE_INODE_BLOCK][0];
+    fs->block_crcs = (uint32_t *)&fs->data_blocks[CRC_BLOCK][0];
+    fs->block_refs = (uint16_t *)&fs->data_blocks[REFCOUNT_BLOCK][0];
+    fs->snapshot_ptr = (struct snapshot *)&fs->data_blocks[SNAPSHOT_BLOCK][0];
+    fs->header_ptr = (struct imageHeader *)&fs->data_blocks[HEADER_BLOCK][0];
+}
+
+// Initializes the metadata of a new image.
+static void initMetadata(struct mfs *fs)
+{
+    // Input: struct mfs *fs - The image, zero filled.
+    // Output: void. Every file, inode and block is marked free.
+    // Description: Zero already means an unused entry or inode with no
+    //              attributes, so only the directory's inode numbers and
+    //              the free maps are set. The inode table is left alone: a
+    //              free inode's block list is never read, and every path
+    //              that allocates an inode fills its list in first. Its
+    //              pages are not touched until files are added.
+
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        fs->directory_ptr[i].inode = -1;
+    }
+
+    memset(fs->free_inodes, 1, NUM_FILES);
+    memset(fs->free_blocks, 1, NUM_BLOCKS);
+}
+
+// Free space in bytes.
+uint32_t mfs_df(struct mfs *fs)
+{
+    // Input: struct mfs *fs - The image.
+    // Output: uint32_t. Returns the amount of free space in the file system in bytes.
+    // Description: Loops through free_blocks[] starting at FIRST_DATA_BLOCK
+    //              and ends at NUM_BLOCKS. int count is increased for every
+    //              free block found.
+    //              Returns count * BLOCK_SIZE.
+
+    int count = 0;
+
+    lockShared(fs, &fs->alloc_lock);
+    for (int i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
+    {
+        if (fs->free_blocks[i])
+        {
+            count++;
+        }
+    }
+    releaseLock(fs, &fs->alloc_lock);
+
+    return count * BLOCK_SIZE;
+}
+
+// Turns CRC32C verification of reads on or off.
+void mfs_set_verify(struct mfs *fs, int on)
+{
+    fs->verify_reads = on ? 1 : 0;
+}
+
+// Finds free block in free_blocks[] array.
+static int32_t findFreeBlock(struct mfs *fs)
+{
+    // Input: struct mfs *fs - The image.
+    // Output: int32_t. Returns free block.
+    // Description: Loops through free_blocks[] starting where the last search
+    //              stopped and wrapping around to FIRST_DATA_BLOCK, so threads
+    //              allocating one block after another do not rescan the
+    //              blocks in use. If a free block is found, its index is
+    //              returned and that block is marked not free.
+    //              Returns -1 if no free blocks are found.
+
+    TRACE_BEGIN("alloc", "findFreeBlock");
+    lockExclusive(fs, &fs->alloc_lock);
+
+    int32_t block = fs->next_block;
+
+    for (int n = FIRST_DATA_BLOCK; n < NUM_BLOCKS; n++)
+    {
+        if (fs->free_blocks[block])
+        {
+            fs->free_blocks[block] = 0;
+            fs->next_block = block + 1 < NUM_BLOCKS ? block + 1 : FIRST_DATA_BLOCK;
+            releaseLock(fs, &fs->alloc_lock);
+            STAT_ADD(fs, blocks_scanned, n - FIRST_DATA_BLOCK + 1);
+            STAT_ADD(fs, blocks_allocated, 1);
+            TRACE_END("alloc", "findFreeBlock");
+            return block;
+        }
+
+        block = block + 1 < NUM_BLOCKS ? block + 1 : FIRST_DATA_BLOCK;
+    }
+
+    releaseLock(fs, &fs->alloc_lock);
+    STAT_ADD(fs, blocks_scanned, NUM_BLOCKS - FIRST_DATA_BLOCK);
+    TRACE_END("alloc", "findFreeBlock");
+    return -1;
+}
+
+// Finds free inode in free_inodes[] array
+static int32_t findFreeInode(struct mfs *fs)
+{
+    // Input: struct mfs *fs - The image.
+    // Output: int32_t. Returns free inode.
+    // Description: Loops through free_inodes[] up till NUM_FILES. If a free inode is found,
+    //              index of free inode is returned and that inode is marked not free.
+    //              Returns -1 if no free inodes are found.
+
+    TRACE_BEGIN("alloc", "findFreeInode");
+    lockExclusive(fs, &fs->alloc_lock);
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        if (fs->free_inodes[i] == 1)
+        {
+            fs->free_inodes[i] = 0;
+            releaseLock(fs, &fs->alloc_lock);
+            TRACE_END("alloc", "findFreeInode");
+            return i;
+        }
+    }
+    releaseLock(fs, &fs->alloc_lock);
+    TRACE_END("alloc", "findFreeInode");
+    return -1;
+}
+
+// Searches the directory for filename
+static int searchDirectory(struct mfs *fs, const char *filename)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *filename - the filename to look for.
+    // Output: int. Returns the index of the filename in directory_ptr[] if found.
+    //         Returns -1 if filename is not found in directory. Deleted
+    //         entries are found too, see findFile().
+
+    TRACE_BEGIN("directory", "searchDirectory");
+
+    for (int i = 0; i < NUM_FILES; i++)
+	{
+        if (strncmp(filename, fs->directory_ptr[i].filename, 64) == 0)
+		{
+            TRACE_END("directory", "searchDirectory");
+            return i;
+        }
+    }
+
+    TRACE_END("directory", "searchDirectory");
+    return -1;
+}
+
+// Returns the inode of a file that is in use.
+static int findFile(struct mfs *fs, const char *filename)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *filename - The file to look for.
+    // Output: int. The file's inode, or MFS_ENOENT.
+
+    if (filename == NULL)
+    {
+        return MFS_EINVAL;
+    }
+
+    int directory_entry = searchDirectory(fs, filename);
+
+    if (directory_entry == -1 || fs->directory_ptr[directory_entry].in_use == 0)
+    {
+        return MFS_ENOENT;
+    }
+
+    return fs->directory_ptr[directory_entry].inode;
+}
+
+// Looks up a file and locks its inode.
+static int lockFile(struct mfs *fs, const char *filename, int write)
+{
+    // Input: struct mfs *fs - The image, with image_lock held.
+    //        const char *filename - The file to look for.
+    //        int write - 1 to lock the inode exclusively, 0 to share it.
+    // Output: int. The file's inode, locked until unlockFile(), or an
+    //         error code.
+    // Description: The inode is locked before dir_lock is released, so the
+    //              file can not be deleted between the lookup and the lock.
+
+    lockShared(fs, &fs->dir_lock);
+
+    int inode_index = findFile(fs, filename);
+
+    if (inode_index >= 0)
+    {
+        if (write)
+        {
+            lockExclusive(fs, &fs->inode_locks[inode_index]);
+        }
+        else
+        {
+            lockShared(fs, &fs->inode_locks[inode_index]);
+        }
+    }
+
+    releaseLock(fs, &fs->dir_lock);
+
+    return inode_index;
+}
+
+// Releases an inode locked by lockFile().
+static void unlockFile(struct mfs *fs, int inode_index)
+{
+    releaseLock(fs, &fs->inode_locks[inode_index]);
+}
+
+// Sets up one of the locks in struct mfs.
+static void initLock(struct imageLock *lock, off_t start, off_t length)
+{
+    pthread_rwlock_init(&lock->rwlock, NULL);
+    pthread_mutex_init(&lock->mutex, NULL);
+    lock->holders = 0;
+    lock->start = start;
+    lock->length = length;
+}
+
+// Frees a lock set up by initLock().
+static void destroyLock(struct imageLock *lock)
+{
+    pthread_rwlock_destroy(&lock->rwlock);
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+// Takes a lock shared with other readers.
+static void lockShared(struct mfs *fs, struct imageLock *lock)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct imageLock *lock - One of its locks.
+    // Output: void.
+    // Description: In a shared image the first thread of this process to
+    //              take the lock also read locks its byte range of the image
+    //              file. Later threads share that fcntl lock.
+
+    pthread_rwlock_rdlock(&lock->rwlock);
+
+    if (fs->shared)
+    {
+        pthread_mutex_lock(&lock->mutex);
+        if (lock->holders++ == 0)
+        {
+            lockRange(fs->image_fd, lock->start, lock->length, F_RDLCK);
+            STAT_ADD(fs, syscalls, 1);
+        }
+        pthread_mutex_unlock(&lock->mutex);
+    }
+}
+
+// Takes a lock exclusively.
+static void lockExclusive(struct mfs *fs, struct imageLock *lock)
+{
+    pthread_rwlock_wrlock(&lock->rwlock);
+
+    if (fs->shared)
+    {
+        lockRange(fs->image_fd, lock->start, lock->length, F_WRLCK);
+        STAT_ADD(fs, syscalls, 1);
+        lock->holders = -1;
+    }
+}
+
+// Releases a lock taken by lockShared() or lockExclusive().
+static void releaseLock(struct mfs *fs, struct imageLock *lock)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct imageLock *lock - The lock.
+    // Output: void.
+    // Description: The byte range is unlocked before the rwlock, so another
+    //              thread of this process can not take the fcntl lock in
+    //              between and lose it. Releasing an exclusive lock bumps the
+    //              generation, as the holder may have changed the image.
+
+    if (fs->shared)
+    {
+        pthread_mutex_lock(&lock->mutex);
+        if (lock->holders == -1 || --lock->holders == 0)
+        {
+            if (lock->holders == -1)
+            {
+                __atomic_add_fetch(&fs->header_ptr->generation, 1, __ATOMIC_RELEASE);
+            }
+            lock->holders = 0;
+            lockRange(fs->image_fd, lock->start, lock->length, F_UNLCK);
+            STAT_ADD(fs, syscalls, 1);
+        }
+        pthread_mutex_unlock(&lock->mutex);
+    }
+
+    pthread_rwlock_unlock(&lock->rwlock);
+}
+
+// Takes or drops an fcntl lock on a byte range of the image file.
+static void lockRange(int image_fd, off_t start, off_t length, short type)
+{
+    // Input: int image_fd - The image file.
+    //        off_t start - First byte of the range.
+    //        off_t length - Bytes in the range, 0 for the rest of the file.
+    //        short type - F_RDLCK, F_WRLCK or F_UNLCK.
+    // Output: void. Waits while another process holds a conflicting lock.
+    // Description: Open file description locks are used, so closing some
+    //              other descriptor of the image does not drop them, as it
+    //              would a process's fcntl locks.
+
+    struct flock range;
+
+    memset(&range, 0, sizeof(range));
+    range.l_type = type;
+    range.l_whence = SEEK_SET;
+    range.l_start = start;
+    range.l_len = length;
+
+    while (fcntl(image_fd, F_OFD_SETLKW, &range) == -1 && errno == EINTR)
+    {
+    }
+}
+
+// Picks the directory entry a new file goes into.
+static int findFreeEntry(struct mfs *fs, int directory_entry)
+{
+    // Input: struct mfs *fs - The image.
+    //        int directory_entry - The name's existing (deleted) entry, or -1.
+    // Output: int. A directory entry that is not in use, or -1.
+    // Description: A deleted entry with the same name is reused, otherwise
+    //              the first entry not in use.
+
+    if (directory_entry != -1)
+    {
+        return directory_entry;
+    }
+
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        if (fs->directory_ptr[i].in_use == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Stores a name in a 64 byte directory or snapshot field.
+static void setName(char *dst, const char *name)
+{
+    // The field is cleared first so a shorter name never keeps the tail of
+    // the one it replaces, and always ends in a NUL.
+    memset(dst, 0, 64);
+    memcpy(dst, name, strnlen(name, MFS_NAME_MAX));
+}
+
+// Creates or replaces a file with size bytes of data.
+int mfs_insert(struct mfs *fs, const char *name, const void *data, uint32_t size, const uint8_t *key)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file to create or replace.
+    //        const void *data - The file contents.
+    //        uint32_t size - Bytes in data.
+    //        const uint8_t *key - ChaCha20 key to encrypt the file with, or NULL.
+    // Output: int. MFS_OK or an error code.
+    // Description: Data is stored in BLOCK_SIZE chunks. Replacing an existing
+    //              file writes the new contents to fresh blocks and then
+    //              swaps them in, keeping its inode; if the insert fails the
+    //              old file is left as it was. All-zero blocks are left as
+    //              holes unless a key is given, in which case every block is
+    //              encrypted as it is stored. The directory is only locked to swap the blocks
+    //              in, so inserts of different files overlap.
+
+    if (name == NULL || data == NULL)
+    {
+        return MFS_EINVAL;
+    }
+
+    // Verify name isn't too long.
+    if (strlen(name) > MFS_NAME_MAX)
+	{
+		return MFS_ENAMETOOLONG;
+	}
+
+    // Verify the file isn't too big.
+    if (size > MAX_FILE_SIZE)
+    {
+        return MFS_EFBIG;
+    }
+
+    STAT_START(start);
+    TRACE_BEGIN("lib", "mfs_insert");
+
+    lockShared(fs, &fs->image_lock);
+
+    int ret = insertFile(fs, name, data, size, key);
+
+    releaseLock(fs, &fs->image_lock);
+    TRACE_END("lib", "mfs_insert");
+
+    if (ret == MFS_OK)
+    {
+        STAT_ADD(fs, bytes_written, size);
+    }
+    STAT_TIME(fs, insert, start);
+
+    return ret;
+}
+
+// Does the work of mfs_insert() with image_lock held.
+static int insertFile(struct mfs *fs, const char *name, const void *data, uint32_t size, const uint8_t *key)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file to create or replace.
+    //        const void *data - The file contents.
+    //        uint32_t size - Bytes in data.
+    //        const uint8_t *key - ChaCha20 key to encrypt the file with, or NULL.
+    // Output: int. MFS_OK or an error code.
+    // Description: The contents are written to newly allocated blocks in a
+    //              list no one else can see. Only once every block is stored
+    //              is the list swapped into the file, so a failed insert
+    //              leaves any file of the same name as it was.
+
+    // Fail early, before any data is copied, if the file can not fit.
+    lockShared(fs, &fs->dir_lock);
+
+    int directory_entry = searchDirectory(fs, name);
+    int ret = MFS_OK;
+
+    if (size > mfs_df(fs))
+    {
+        ret = MFS_ENOSPC;
+    }
+    else if ((directory_entry == -1 || fs->directory_ptr[directory_entry].in_use == 0) &&
+             findFreeEntry(fs, directory_entry) == -1)
+    {
+        ret = MFS_ENODIR;
+    }
+
+    releaseLock(fs, &fs->dir_lock);
+
+    if (ret != MFS_OK)
+    {
+        return ret;
+    }
+
+    int32_t blocks[MAX_BLOCKS_PER_FILE];
+    uint64_t nonce = key == NULL ? 0 : randomNonce();
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        blocks[i] = -1;
+    }
+
+    ret = fillBlocks(fs, blocks, data, size, key, nonce);
+
+    if (ret == MFS_OK)
+    {
+        lockExclusive(fs, &fs->dir_lock);
+        ret = publishInsert(fs, name, size, blocks, key, nonce);
+        releaseLock(fs, &fs->dir_lock);
+    }
+
+    if (ret != MFS_OK)
+    {
+        releaseBlocks(fs, blocks, 0);
+    }
+
+    return ret;
+}
+
+// Gives a filled block list a directory entry and inode for mfs_insert().
+static int publishInsert(struct mfs *fs, const char *name, uint32_t size, int32_t *blocks,
+                         const uint8_t *key, uint64_t nonce)
+{
+    // Input: struct mfs *fs - The image, with the directory locked exclusively.
+    //        const char *name - The file to create or replace.
+    //        uint32_t size - Bytes the file holds.
+    //        int32_t *blocks - The filled block list.
+    //        const uint8_t *key - The key the blocks were encrypted with, or NULL.
+    //        uint64_t nonce - The nonce the blocks were encrypted with.
+    // Output: int. MFS_OK, or MFS_ENODIR or MFS_ENOINODE with blocks left
+    //         to the caller.
+    // Description: A file being replaced keeps its inode. Its old blocks
+    //              are released once anyone reading it has finished.
+
+    int directory_entry = searchDirectory(fs, name);
+    int rewrite = 0;
+
+    if (directory_entry != -1 && fs->directory_ptr[directory_entry].in_use)
+    {
+        rewrite = 1;
+    }
+    else
+    {
+        directory_entry = findFreeEntry(fs, directory_entry);
+    }
+
+    if (directory_entry == -1)
+    {
+        return MFS_ENODIR;
+    }
+
+    int32_t inode_index = -1;
+
+    if (rewrite == 1)
+    {
+        inode_index = fs->directory_ptr[directory_entry].inode;
+    }
+    else
+    {
+        inode_index = findFreeInode(fs);
+    }
+
+    if (inode_index == -1)
+    {
+        return MFS_ENOINODE;
+    }
+
+    lockExclusive(fs, &fs->inode_locks[inode_index]);
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    // A newly allocated inode may still hold a deleted file's block list,
+    // which is not released: those blocks are free already.
+    if (rewrite == 1)
+    {
+        truncateBlocks(fs, inode_index, 0);
+    }
+
+    memcpy(inode->blocks, blocks, sizeof(inode->blocks));
+
+    // Place the file info in the directory
+    fs->directory_ptr[directory_entry].in_use = 1;
+    fs->directory_ptr[directory_entry].inode = inode_index;
+    setName(fs->directory_ptr[directory_entry].filename, name);
+
+    // Place the file info in the inode
+    inode->file_size = size;
+    inode->in_use = 1;
+    inode->date = time(NULL);
+    inode->attribute &= ~HIDDEN;
+    inode->attribute &= ~READONLY;
+    inode->attribute &= ~ENCRYPTED;
+
+    if (key != NULL)
+    {
+        inode->nonce = nonce;
+        inode->key_check = keyCheck(key, nonce);
+        inode->attribute |= ENCRYPTED;
+    }
+
+    releaseLock(fs, &fs->inode_locks[inode_index]);
+
+    return MFS_OK;
+}
+
+// Copies a new file's contents into a block list no one else can see.
+static int fillBlocks(struct mfs *fs, int32_t *blocks, const void *data, uint32_t size,
+                      const uint8_t *key, uint64_t nonce)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t *blocks - MAX_BLOCKS_PER_FILE entries, each -1 or a
+    //                          block held by this list alone.
+    //        const void *data - The file contents.
+    //        uint32_t size - Bytes in data.
+    //        const uint8_t *key - ChaCha20 key to encrypt the file with, or NULL.
+    //        uint64_t nonce - The nonce to encrypt with.
+    // Output: int. MFS_OK, MFS_ENOSPC or MFS_EIO. On error blocks still
+    //         lists every block it holds, for the caller to release.
+    // Description: Blocks already in the list are used, the rest are
+    //              allocated. Without a key all-zero blocks are left as
+    //              holes. Blocks past the end of the file are released.
+
+    const uint8_t *source = data;
+    int block_pos = 0;
+
+    for (uint32_t offset = 0; offset < size; offset += BLOCK_SIZE, block_pos++)
+    {
+        uint32_t num_bytes = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+        uint8_t buffer[BLOCK_SIZE];
+
+        // Zero the slack after the last byte so a reused block carries no stale data.
+        memcpy(buffer, source + offset, num_bytes);
+        memset(buffer + num_bytes, 0, BLOCK_SIZE - num_bytes);
+
+        // An all-zero block of a plaintext file is left as a hole and reads
+        // back as zeros. An encrypted file stores it like any other block,
+        // so its holes do not show where its zeros are.
+        if (key == NULL && isZeroBlock(buffer))
+        {
+            if (blocks[block_pos] != -1)
+            {
+                freeBlock(fs, blocks[block_pos]);
+                blocks[block_pos] = -1;
+            }
+            continue;
+        }
+
+        if (blocks[block_pos] == -1)
+        {
+            blocks[block_pos] = findFreeBlock(fs);
+
+            if (blocks[block_pos] == -1)
+            {
+                return MFS_ENOSPC;
+            }
+        }
+
+        if (key != NULL)
+        {
+            TRACE_BEGIN("cipher", "chacha20");
+            chacha20Xor(buffer, num_bytes, key, nonce, block_pos);
+            TRACE_END("cipher", "chacha20");
+        }
+
+        uint8_t *data = getBlock(fs, blocks[block_pos]);
+
+        if (data == NULL)
+        {
+            return MFS_EIO;
+        }
+
+        memcpy(data, buffer, BLOCK_SIZE);
+
+        // Putting the block back dirty also records its checksum.
+        putBlock(fs, blocks[block_pos], 1);
+    }
+
+    releaseBlocks(fs, blocks, block_pos);
+
+    return MFS_OK;
+}
+
+struct batchJob
+{
+    struct mfs *fs;
+    struct mfs_file *files;
+    int32_t *inodes;
+    int count;
+    const uint8_t *key;
+    int next;               // Next file to fill, taken atomically
+};
+
+// Thread body for mfs_insert_batch().
+static void *batchWorker(void *arg)
+{
+    struct batchJob *job = (struct batchJob *)arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        int32_t inode_index = job->inodes[i];
+
+        if (inode_index == BATCH_REWRITE)
+        {
+            job->files[i].result = insertFile(job->fs, job->files[i].name, job->files[i].data,
+                                              job->files[i].size, job->key);
+            continue;
+        }
+
+        if (inode_index < 0)
+        {
+            continue;
+        }
+
+        // The inode is reserved but not yet in the directory, so no lock
+        // is needed to fill it.
+        struct inode *inode = &job->fs->inode_ptr[inode_index];
+
+        inode->file_size = job->files[i].size;
+        inode->date = time(NULL);
+        inode->attribute = 0;
+
+        if (job->key != NULL)
+        {
+            inode->nonce = randomNonce();
+            inode->key_check = keyCheck(job->key, inode->nonce);
+            inode->attribute |= ENCRYPTED;
+        }
+
+        job->files[i].result = fillBlocks(job->fs, inode->blocks, job->files[i].data,
+                                          job->files[i].size, job->key, inode->nonce);
+    }
+
+    return NULL;
+}
+
+// Creates or replaces many files at once.
+int mfs_insert_batch(struct mfs *fs, struct mfs_file *files, int count, const uint8_t *key)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct mfs_file *files - The files, with name, data and size
+    //                                 set. Each result is filled in.
+    //        int count - Entries in files.
+    //        const uint8_t *key - ChaCha20 key to encrypt every file with,
+    //                             or NULL.
+    // Output: int. MFS_OK if every file was stored, otherwise the first
+    //         file's error code.
+    // Description: Inodes and blocks for the whole batch are reserved in one
+    //              pass over the free maps. The files are then filled by
+    //              several threads while no one else can see them, and the
+    //              directory is updated for all of them under a single lock.
+    //              Files whose name is already in use are replaced
+    //              as mfs_insert() does, by the same threads. When a name
+    //              appears more than once only its last file is stored; the
+    //              earlier ones get MFS_OK as if they had been stored and
+    //              then replaced.
+
+    if (files == NULL || count < 0)
+    {
+        return MFS_EINVAL;
+    }
+
+    int32_t *inodes = malloc((count + 1) * sizeof(int32_t));
+
+    if (inodes == NULL)
+    {
+        return MFS_ENOMEM;
+    }
+
+    int32_t total_blocks = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        files[i].result = MFS_OK;
+        inodes[i] = -1;
+
+        if (files[i].name == NULL || files[i].data == NULL)
+        {
+            files[i].result = MFS_EINVAL;
+        }
+        else if (strlen(files[i].name) > MFS_NAME_MAX)
+        {
+            files[i].result = MFS_ENAMETOOLONG;
+        }
+        else if (files[i].size > MAX_FILE_SIZE)
+        {
+            files[i].result = MFS_EFBIG;
+        }
+    }
+
+    if (markReplaced(files, inodes, count) != MFS_OK)
+    {
+        free(inodes);
+        return MFS_ENOMEM;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (files[i].result == MFS_OK && inodes[i] == -1)
+        {
+            total_blocks += (files[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+    }
+
+    lockShared(fs, &fs->image_lock);
+
+    // Existing files keep their inode, so replacing many files does not
+    // need an inode for each of them as well.
+    lockShared(fs, &fs->dir_lock);
+    for (int i = 0; i < count; i++)
+    {
+        if (files[i].result == MFS_OK && inodes[i] == -1 && findFile(fs, files[i].name) >= 0)
+        {
+            inodes[i] = BATCH_REWRITE;
+        }
+    }
+    releaseLock(fs, &fs->dir_lock);
+
+    reserveBatch(fs, files, inodes, count);
+
+    struct batchJob job = { fs, files, inodes, count, key, 0 };
+    int threads = workerThreads(total_blocks, PARALLEL_INSERT_BLOCKS);
+    pthread_t tids[MAX_WORKER_THREADS];
+    int spawned[MAX_WORKER_THREADS] = { 0 };
+
+    // The calling thread fills files too.
+    for (int t = 1; t < threads; t++)
+    {
+        spawned[t] = pthread_create(&tids[t], NULL, batchWorker, &job) == 0;
+    }
+    batchWorker(&job);
+    for (int t = 1; t < threads; t++)
+    {
+        if (spawned[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+    }
+
+    lockExclusive(fs, &fs->dir_lock);
+    publishBatch(fs, files, inodes, count);
+    releaseLock(fs, &fs->dir_lock);
+
+    releaseLock(fs, &fs->image_lock);
+
+    free(inodes);
+
+    int ret = MFS_OK;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (files[i].result == MFS_OK)
+        {
+            STAT_ADD(fs, bytes_written, files[i].size);
+        }
+        else if (ret == MFS_OK)
+        {
+            ret = files[i].result;
+        }
+    }
+
+    return ret;
+}
+
+// Marks the files of a batch that a later file of the same name replaces.
+static int markReplaced(struct mfs_file *files, int32_t *inodes, int count)
+{
+    // Input: struct mfs_file *files - The batch.
+    //        int32_t *inodes - Set to BATCH_REPLACED for each file replaced.
+    //        int count - Entries in files.
+    // Output: int. MFS_OK or MFS_ENOMEM.
+    // Description: The files are sorted by name and then by position, so
+    //              each name's last file ends its run of equal names.
+    //              Storing only that one keeps two threads from racing to
+    //              replace the same file.
+
+    struct mfs_file **order = malloc((count + 1) * sizeof(struct mfs_file *));
+
+    if (order == NULL)
+    {
+        return MFS_ENOMEM;
+    }
+
+    int named = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (files[i].result == MFS_OK)
+        {
+            order[named++] = &files[i];
+        }
+    }
+
+    qsort(order, named, sizeof(struct mfs_file *), compareBatchFiles);
+
+    for (int i = 0; i + 1 < named; i++)
+    {
+        if (strcmp(order[i]->name, order[i + 1]->name) == 0)
+        {
+            inodes[order[i] - files] = BATCH_REPLACED;
+        }
+    }
+
+    free(order);
+
+    return MFS_OK;
+}
+
+// Orders batch files by name, then by position in the batch, for qsort().
+static int compareBatchFiles(const void *a, const void *b)
+{
+    const struct mfs_file *first = *(struct mfs_file *const *)a;
+    const struct mfs_file *second = *(struct mfs_file *const *)b;
+    int order = strcmp(first->name, second->name);
+
+    if (order != 0)
+    {
+        return order;
+    }
+
+    return first < second ? -1 : first > second;
+}
+
+// Reserves an inode and enough blocks for each file in a batch.
+static void reserveBatch(struct mfs *fs, struct mfs_file *files, int32_t *inodes, int count)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct mfs_file *files - The batch. Files that do not fit get
+    //                                 MFS_ENOINODE or MFS_ENOSPC.
+    //        int32_t *inodes - Receives each file's inode, -1 if none.
+    //                          Entries already marked are skipped.
+    //        int count - Entries in files.
+    // Output: void.
+    // Description: The allocator lock is taken once for the whole batch.
+    //              The reserved blocks are placed in the inode's block list,
+    //              so filling the file reuses them instead of allocating.
+    //              Blocks a file turns out not to need (holes) are freed as
+    //              it is filled.
+
+    int32_t next_inode = 0;
+
+    lockExclusive(fs, &fs->alloc_lock);
+
+    int32_t free_count = 0;
+
+    for (int32_t b = FIRST_DATA_BLOCK; b < NUM_BLOCKS; b++)
+    {
+        free_count += fs->free_blocks[b];
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (files[i].result != MFS_OK || inodes[i] != -1)
+        {
+            continue;
+        }
+
+        int32_t needed = (files[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        if (needed > free_count)
+        {
+            files[i].result = MFS_ENOSPC;
+            continue;
+        }
+
+        while (next_inode < NUM_FILES && fs->free_inodes[next_inode] == 0)
+        {
+            next_inode++;
+        }
+
+        if (next_inode == NUM_FILES)
+        {
+            files[i].result = MFS_ENOINODE;
+            continue;
+        }
+
+        struct inode *inode = &fs->inode_ptr[next_inode];
+
+        fs->free_inodes[next_inode] = 0;
+        inodes[i] = next_inode;
+
+        for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++)
+        {
+            inode->blocks[j] = -1;
+        }
+
+        // Next-fit from where the last allocation stopped, as in
+        // findFreeBlock().
+        int32_t block = fs->next_block;
+
+        for (int32_t j = 0; j < needed; j++)
+        {
+            while (!fs->free_blocks[block])
+            {
+                block = block + 1 < NUM_BLOCKS ? block + 1 : FIRST_DATA_BLOCK;
+                STAT_ADD(fs, blocks_scanned, 1);
+            }
+
+            fs->free_blocks[block] = 0;
+            inode->blocks[j] = block;
+            block = block + 1 < NUM_BLOCKS ? block + 1 : FIRST_DATA_BLOCK;
+        }
+
+        fs->next_block = block;
+        free_count -= needed;
+        STAT_ADD(fs, blocks_scanned, needed);
+        STAT_ADD(fs, blocks_allocated, needed);
+    }
+
+    releaseLock(fs, &fs->alloc_lock);
+}
+
+// Adds the filled files of a batch to the directory.
+static void publishBatch(struct mfs *fs, struct mfs_file *files, int32_t *inodes, int count)
+{
+    // Input: struct mfs *fs - The image, with the directory locked exclusively.
+    //        struct mfs_file *files - The batch.
+    //        int32_t *inodes - Each file's filled inode, -1 if none.
+    //        int count - Entries in files.
+    // Output: void. Files left without a directory entry get MFS_ENODIR.
+    //         Files whose fill failed are released instead of added.
+
+    for (int i = 0; i < count; i++)
+    {
+        int32_t inode_index = inodes[i];
+
+        if (inode_index < 0)
+        {
+            continue;
+        }
+
+        // A file that could not be filled gives back its inode and blocks
+        // and leaves any file of the same name in place.
+        if (files[i].result != MFS_OK)
+        {
+            releaseInode(fs, inode_index);
+            continue;
+        }
+
+        int directory_entry = searchDirectory(fs, files[i].name);
+
+        if (directory_entry != -1 && fs->directory_ptr[directory_entry].in_use)
+        {
+            // Replacing a file: wait for anyone using it, then release it.
+            int32_t old_inode = fs->directory_ptr[directory_entry].inode;
+
+            lockExclusive(fs, &fs->inode_locks[old_inode]);
+            releaseInode(fs, old_inode);
+            releaseLock(fs, &fs->inode_locks[old_inode]);
+        }
+        else
+        {
+            directory_entry = findFreeEntry(fs, directory_entry);
+        }
+
+        if (directory_entry == -1)
+        {
+            files[i].result = MFS_ENODIR;
+            releaseInode(fs, inode_index);
+            continue;
+        }
+
+        fs->inode_ptr[inode_index].in_use = 1;
+        fs->directory_ptr[directory_entry].in_use = 1;
+        fs->directory_ptr[directory_entry].inode = inode_index;
+        setName(fs->directory_ptr[directory_entry].filename, files[i].name);
+    }
+}
+
+// Frees an inode and the blocks it holds.
+static void releaseInode(struct mfs *fs, int32_t inode_index)
+{
+    truncateBlocks(fs, inode_index, 0);
+    fs->inode_ptr[inode_index].in_use = 0;
+
+    lockExclusive(fs, &fs->alloc_lock);
+    fs->free_inodes[inode_index] = 1;
+    releaseLock(fs, &fs->alloc_lock);
+}
+
+// Overwrites or extends part of a file.
+int mfs_write(struct mfs *fs, const char *name, int32_t offset, const void *data, uint32_t size)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file to modify.
+    //        int32_t offset - Byte offset to start writing at, MFS_APPEND to append.
+    //        const void *data - Bytes to write.
+    //        uint32_t size - Bytes in data.
+    // Output: int. MFS_OK or an error code.
+    // Description: Only the blocks covering [offset, offset + size) are
+    //              touched. Existing blocks are updated in place and new
+    //              blocks are allocated only when the file grows. Writing
+    //              past the end of the file leaves a hole in between.
+
+    lockShared(fs, &fs->image_lock);
+
+    int inode_index = lockFile(fs, name, 1);
+    int ret = inode_index;
+
+    if (inode_index >= 0)
+    {
+        ret = writeInode(fs, inode_index, offset, data, size);
+        unlockFile(fs, inode_index);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    if (ret == MFS_OK)
+    {
+        STAT_ADD(fs, bytes_written, size);
+    }
+
+    return ret;
+}
+
+// Does the work of mfs_write() with the inode locked.
+static int writeInode(struct mfs *fs, int inode_index, int32_t offset, const void *data, uint32_t size)
+{
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    if (inode->attribute & READONLY)
+    {
+        return MFS_EREADONLY;
+    }
+
+    if (inode->attribute & ENCRYPTED)
+    {
+        return MFS_EENCRYPTED;
+    }
+
+    if (offset == MFS_APPEND)
+    {
+        offset = inode->file_size;
+    }
+
+    if (offset < 0)
+    {
+        return MFS_EINVAL;
+    }
+
+    int64_t end = (int64_t)offset + size;
+
+    if (end > MAX_FILE_SIZE)
+    {
+        return MFS_EFBIG;
+    }
+
+    // Holes and blocks shared with a clone in the written range need a new block.
+    int32_t new_blocks = 0;
+
+    for (int pos = offset / BLOCK_SIZE; pos < (end + BLOCK_SIZE - 1) / BLOCK_SIZE; pos++)
+    {
+        int32_t block_index = inode->blocks[pos];
+
+        if (block_index == -1 || fs->block_refs[block_index] > 0)
+        {
+            new_blocks++;
+        }
+    }
+
+    if (new_blocks > 0 && new_blocks * BLOCK_SIZE > mfs_df(fs))
+    {
+        return MFS_ENOSPC;
+    }
+
+    const uint8_t *source = data;
+    int64_t position = offset;
+
+    while (position < end)
+    {
+        int block_pos = position / BLOCK_SIZE;
+        int block_offset = position % BLOCK_SIZE;
+        int num_bytes = BLOCK_SIZE - block_offset;
+
+        if (num_bytes > end - position)
+        {
+            num_bytes = end - position;
+        }
+
+        int32_t block_index = blockForWrite(fs, inode_index, block_pos);
+        uint8_t *block = block_index < 0 ? NULL : getBlock(fs, block_index);
+
+        if (block == NULL)
+        {
+            return block_index < 0 ? block_index : MFS_EIO;
+        }
+
+        memcpy(block + block_offset, source + (position - offset), num_bytes);
+        putBlock(fs, block_index, 1);
+
+        position += num_bytes;
+
+        if (position > inode->file_size)
+        {
+            inode->file_size = position;
+        }
+    }
+
+    inode->date = time(NULL);
+
+    return MFS_OK;
+}
+
+// Reads part of a file.
+int mfs_read(struct mfs *fs, const char *name, uint32_t offset, void *buf, uint32_t size, const uint8_t *key)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file to read.
+    //        uint32_t offset - First byte to read.
+    //        void *buf - Receives the bytes.
+    //        uint32_t size - Bytes to read.
+    //        const uint8_t *key - ChaCha20 key for an encrypted file, or NULL.
+    // Output: int. Bytes read, fewer than size at the end of the file, or
+    //         an error code.
+    // Description: Any number of threads can read a file at once. Writers
+    //              to the same file wait until they are done.
+
+    STAT_START(start);
+    TRACE_BEGIN("lib", "mfs_read");
+
+    lockShared(fs, &fs->image_lock);
+
+    int inode_index = lockFile(fs, name, 0);
+    int ret = inode_index;
+
+    if (inode_index >= 0)
+    {
+        ret = readInode(fs, inode_index, offset, buf, size, key);
+        unlockFile(fs, inode_index);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+    TRACE_END("lib", "mfs_read");
+
+    if (ret > 0)
+    {
+        STAT_ADD(fs, bytes_read, ret);
+    }
+    STAT_TIME(fs, read, start);
+
+    return ret;
+}
+
+// Reads [offset, offset + size) of a file into buf.
+static int readInode(struct mfs *fs, int32_t inode_index, uint32_t offset, uint8_t *buf, uint32_t size, const uint8_t *key)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The file's inode.
+    //        uint32_t offset - First byte to read.
+    //        uint8_t *buf - Receives the bytes.
+    //        uint32_t size - Bytes to read.
+    //        const uint8_t *key - ChaCha20 key, or NULL.
+    // Output: int. Bytes read or an error code.
+    // Description: Only the blocks covering the range are visited. With
+    //              verification on, every one of them is checked before any
+    //              byte is copied. With a key they are decrypted into a
+    //              scratch buffer, several threads sharing a large run.
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    if (offset > inode->file_size)
+    {
+        return MFS_EINVAL;
+    }
+
+    if (key != NULL)
+    {
+        int ret = checkKey(fs, inode_index, key);
+
+        if (ret != MFS_OK)
+        {
+            return ret;
+        }
+    }
+
+    if (size > inode->file_size - offset)
+    {
+        size = inode->file_size - offset;
+    }
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    int first_pos = offset / BLOCK_SIZE;
+    int last_pos = (offset + size - 1) / BLOCK_SIZE;
+
+    if (fs->verify_reads)
+    {
+        for (int block_pos = first_pos; block_pos <= last_pos; block_pos++)
+        {
+            int32_t block_index = inode->blocks[block_pos];
+
+            if (block_index != -1 && verifyBlock(fs, block_index) == -1)
+            {
+                return MFS_ECHECKSUM;
+            }
+        }
+    }
+
+    if (key != NULL)
+    {
+        int count = last_pos - first_pos + 1;
+        uint8_t *plain = malloc((size_t)count * BLOCK_SIZE);
+
+        if (plain == NULL)
+        {
+            return MFS_ENOMEM;
+        }
+
+        int ret = decryptBlocks(fs, inode_index, key, plain, first_pos, count);
+
+        if (ret == MFS_OK)
+        {
+            memcpy(buf, plain + offset % BLOCK_SIZE, size);
+        }
+        free(plain);
+
+        return ret == MFS_OK ? (int)size : ret;
+    }
+
+    uint32_t done = 0;
+
+    while (done < size)
+    {
+        uint32_t position = offset + done;
+        int block_pos = position / BLOCK_SIZE;
+        int block_offset = position % BLOCK_SIZE;
+        uint32_t num_bytes = BLOCK_SIZE - block_offset;
+        int32_t block_index = inode->blocks[block_pos];
+
+        if (num_bytes > size - done)
+        {
+            num_bytes = size - done;
+        }
+
+        // Holes read back as zeros.
+        if (block_index == -1)
+        {
+            memset(buf + done, 0, num_bytes);
+        }
+        else
+        {
+            uint8_t *block = getBlock(fs, block_index);
+
+            if (block == NULL)
+            {
+                return MFS_EIO;
+            }
+
+            memcpy(buf + done, block + block_offset, num_bytes);
+            putBlock(fs, block_index, 0);
+        }
+
+        done += num_bytes;
+    }
+
+    return size;
+}
+
+// Describes a file.
+int mfs_stat(struct mfs *fs, const char *name, struct mfs_stat *st)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file.
+    //        struct mfs_stat *st - Receives the file's size, date and attributes.
+    // Output: int. MFS_OK or MFS_ENOENT.
+
+    lockShared(fs, &fs->image_lock);
+
+    int inode_index = lockFile(fs, name, 0);
+
+    if (inode_index >= 0)
+    {
+        statInode(fs, inode_index, st);
+        unlockFile(fs, inode_index);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    return inode_index < 0 ? inode_index : MFS_OK;
+}
+
+// Fills in a struct mfs_stat from an inode.
+static void statInode(struct mfs *fs, int32_t inode_index, struct mfs_stat *st)
+{
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    st->size = inode->file_size;
+    st->date = inode->date;
+    st->attribute = inode->attribute;
+    st->blocks = 0;
+    st->shared = sharedBlocks(fs, inode_index);
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        if (inode->blocks[i] != -1)
+        {
+            st->blocks++;
+        }
+    }
+}
+
+// Walks the files in the directory.
+int mfs_readdir(struct mfs *fs, int *cursor, struct mfs_dirent *entry)
+{
+    // Input: struct mfs *fs - The image.
+    //        int *cursor - 0 on the first call, then left as returned.
+    //        struct mfs_dirent *entry - Receives the next file.
+    // Output: int. MFS_OK, or MFS_ENOENT once every file has been returned.
+    //         Hidden files are included, see entry->st.attribute.
+
+    int ret = MFS_ENOENT;
+
+    lockShared(fs, &fs->image_lock);
+    lockShared(fs, &fs->dir_lock);
+
+    while (*cursor >= 0 && *cursor < NUM_FILES)
+    {
+        struct directoryEntry *dir = &fs->directory_ptr[(*cursor)++];
+
+        if (!dir->in_use)
+        {
+            continue;
+        }
+
+        setName(entry->name, dir->filename);
+
+        lockShared(fs, &fs->inode_locks[dir->inode]);
+        statInode(fs, dir->inode, &entry->st);
+        releaseLock(fs, &fs->inode_locks[dir->inode]);
+
+        ret = MFS_OK;
+        break;
+    }
+
+    releaseLock(fs, &fs->dir_lock);
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Returns the data block at a position in a file, ready to be written.
+static int32_t blockForWrite(struct mfs *fs, int32_t inode_index, int block_pos)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The file's inode.
+    //        int block_pos - Position of the block within the file.
+    // Output: int32_t. Returns the data block to write, MFS_ENOSPC if the
+    //         position is out of range or the disk is full, or MFS_EIO if
+    //         the block cache could not read a block.
+    // Description: Returns the block already mapped at block_pos. If there is
+    //              none, a free block is allocated, zeroed and mapped. A block
+    //              shared with a clone is copied first (copy-on-write) and the
+    //              copy replaces it in this file's block list. The caller
+    //              holds the inode's lock exclusively.
+
+    if (block_pos < 0 || block_pos >= MAX_BLOCKS_PER_FILE)
+    {
+        return MFS_ENOSPC;
+    }
+
+    int32_t block_index = fs->inode_ptr[inode_index].blocks[block_pos];
+
+    if (block_index != -1)
+    {
+        lockExclusive(fs, &fs->alloc_lock);
+        int shared = fs->block_refs[block_index] > 0;
+        releaseLock(fs, &fs->alloc_lock);
+
+        if (!shared)
+        {
+            return block_index;
+        }
+    }
+
+    int32_t new_block = findFreeBlock(fs);
+
+    if (new_block == -1)
+    {
+        return MFS_ENOSPC;
+    }
+
+    uint8_t *data = getBlock(fs, new_block);
+    uint8_t *source = data == NULL || block_index == -1 ? NULL : getBlock(fs, block_index);
+
+    if (data == NULL || (block_index != -1 && source == NULL))
+    {
+        if (data != NULL)
+        {
+            putBlock(fs, new_block, 0);
+        }
+        freeBlock(fs, new_block);
+        return MFS_EIO;
+    }
+
+    if (block_index != -1)
+    {
+        memcpy(data, source, BLOCK_SIZE);
+        putBlock(fs, block_index, 0);
+        putBlock(fs, new_block, 1);
+
+        // Our reference is dropped only after the copy. Until then the
+        // other owners see the block as shared and copy it too rather than
+        // write it in place. If they all let go meanwhile, this frees it.
+        freeBlock(fs, block_index);
+    }
+    else
+    {
+        memset(data, 0, BLOCK_SIZE);
+        putBlock(fs, new_block, 1);
+    }
+
+    fs->inode_ptr[inode_index].blocks[block_pos] = new_block;
+
+    return new_block;
+}
+
+// Releases a file's blocks from a position to the end of its block list.
+static void truncateBlocks(struct mfs *fs, int32_t inode_index, int first_pos)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The file's inode.
+    //        int first_pos - First block position to release.
+    // Output: void.
+    // Description: Every mapped position from first_pos on becomes a hole,
+    //              leaving -1 in all entries past the end of the file.
+
+    releaseBlocks(fs, fs->inode_ptr[inode_index].blocks, first_pos);
+}
+
+// Releases the blocks in a block list from a position to its end.
+static void releaseBlocks(struct mfs *fs, int32_t *blocks, int first_pos)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t *blocks - MAX_BLOCKS_PER_FILE block indexes, -1 for none.
+    //        int first_pos - First position to release.
+    // Output: void.
+
+    for (int i = first_pos; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        if (blocks[i] != -1)
+        {
+            freeBlock(fs, blocks[i]);
+            blocks[i] = -1;
+        }
+    }
+}
+
+// Checks whether a block holds only zero bytes.
+static int isZeroBlock(const uint8_t *block)
+{
+    // Input: const uint8_t *block - BLOCK_SIZE bytes to check.
+    // Output: int. Returns 1 if every byte is zero, 0 otherwise.
+
+    uint64_t bits = 0;
+
+    for (int i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, block + i, sizeof(word));
+        bits |= word;
+    }
+
+    return bits == 0;
+}
+
+// Shrinks or extends a file.
+int mfs_truncate(struct mfs *fs, const char *name, uint32_t size)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file to resize.
+    //        uint32_t size - The new size in bytes.
+    // Output: int. MFS_OK or an error code.
+    // Description: Shrinking releases the blocks past the new end and zeroes
+    //              the rest of the last block. Extending only changes the
+    //              size, so the new range is a hole that reads as zeros.
+
+    lockShared(fs, &fs->image_lock);
+
+    int inode_index = lockFile(fs, name, 1);
+    int ret = inode_index;
+
+    if (inode_index >= 0)
+    {
+        ret = truncateInode(fs, inode_index, size);
+        unlockFile(fs, inode_index);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of mfs_truncate() with the inode locked.
+static int truncateInode(struct mfs *fs, int inode_index, uint32_t size)
+{
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    if (inode->attribute & READONLY)
+    {
+        return MFS_EREADONLY;
+    }
+
+    if (inode->attribute & ENCRYPTED)
+    {
+        return MFS_EENCRYPTED;
+    }
+
+    if (size > MAX_FILE_SIZE)
+    {
+        return MFS_EFBIG;
+    }
+
+    if (size < inode->file_size)
+    {
+        int last_pos = size / BLOCK_SIZE;
+        int tail = size % BLOCK_SIZE;
+
+        truncateBlocks(fs, inode_index, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+        // Clear the rest of the new last block so growing the file again
+        // exposes zeros rather than the old contents.
+        if (tail != 0 && inode->blocks[last_pos] != -1)
+        {
+            int32_t block_index = blockForWrite(fs, inode_index, last_pos);
+            uint8_t *block = block_index < 0 ? NULL : getBlock(fs, block_index);
+
+            if (block == NULL)
+            {
+                return block_index < 0 ? block_index : MFS_EIO;
+            }
+
+            memset(block + tail, 0, BLOCK_SIZE - tail);
+            putBlock(fs, block_index, 1);
+        }
+    }
+
+    inode->file_size = size;
+    inode->date = time(NULL);
+
+    return MFS_OK;
+}
+
+// Drops one reference to a block, freeing it when none remain.
+static void freeBlock(struct mfs *fs, int32_t block)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t block - Index of the block to release.
+    // Output: void.
+    // Description: A block shared by clones only loses one reference. The
+    //              block returns to the free block map with its last owner.
+
+    if (block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS)
+    {
+        return;
+    }
+
+    lockExclusive(fs, &fs->alloc_lock);
+
+    if (fs->block_refs[block] > 0)
+    {
+        fs->block_refs[block]--;
+    }
+    else
+    {
+        fs->free_blocks[block] = 1;
+        STAT_ADD(fs, blocks_freed, 1);
+    }
+
+    releaseLock(fs, &fs->alloc_lock);
+}
+
+// Number of data blocks a file's size spans.
+static int32_t fileBlocks(struct mfs *fs, int32_t inode_index)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The file's inode.
+    // Output: int32_t. ceil(file_size / BLOCK_SIZE).
+
+    return (fs->inode_ptr[inode_index].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Number of a file's blocks that are shared with another file.
+static int32_t sharedBlocks(struct mfs *fs, int32_t inode_index)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The file's inode.
+    // Output: int32_t. Blocks a full rewrite of the file would have to copy.
+
+    int32_t count = 0;
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        int32_t block_index = fs->inode_ptr[inode_index].blocks[i];
+
+        if (block_index == -1)
+        {
+            continue;
+        }
+
+        if (fs->block_refs[block_index] > 0)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Creates destination sharing source's data blocks.
+int mfs_clone(struct mfs *fs, const char *source, const char *destination)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *source - The file to clone.
+    //        const char *destination - Name of the new file.
+    // Output: int. MFS_OK or an error code.
+    // Description: The new inode points at the source's data blocks and each
+    //              block's reference count is raised. No data is copied until
+    //              either file is modified (see blockForWrite()).
+
+    if (destination == NULL)
+    {
+        return MFS_EINVAL;
+    }
+
+    if (strlen(destination) > MFS_NAME_MAX)
+	{
+		return MFS_ENAMETOOLONG;
+	}
+
+    lockShared(fs, &fs->image_lock);
+    lockExclusive(fs, &fs->dir_lock);
+
+    int ret = cloneFile(fs, source, destination);
+
+    releaseLock(fs, &fs->dir_lock);
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of mfs_clone() with the directory locked.
+static int cloneFile(struct mfs *fs, const char *source, const char *destination)
+{
+    int32_t source_inode = findFile(fs, source);
+
+    if (source_inode < 0)
+    {
+        return source_inode;
+    }
+
+    int directory_entry = searchDirectory(fs, destination);
+
+    if (directory_entry != -1 && fs->directory_ptr[directory_entry].in_use)
+    {
+        return MFS_EEXIST;
+    }
+
+    directory_entry = findFreeEntry(fs, directory_entry);
+
+    if (directory_entry == -1)
+    {
+        return MFS_ENODIR;
+    }
+
+    int32_t inode_index = findFreeInode(fs);
+
+    if (inode_index == -1)
+    {
+        return MFS_ENOINODE;
+    }
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    // The source is held still while its block list is copied and shared.
+    lockShared(fs, &fs->inode_locks[source_inode]);
+    memcpy(inode, &fs->inode_ptr[source_inode], sizeof(struct inode));
+    inode->date = time(NULL);
+    inode->attribute &= ~READONLY;
+
+    lockExclusive(fs, &fs->alloc_lock);
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        int32_t block_index = inode->blocks[i];
+
+        if (block_index == -1)
+        {
+            continue;
+        }
+
+        fs->block_refs[block_index]++;
+    }
+
+    releaseLock(fs, &fs->alloc_lock);
+    releaseLock(fs, &fs->inode_locks[source_inode]);
+
+    setName(fs->directory_ptr[directory_entry].filename, destination);
+    fs->directory_ptr[directory_entry].in_use = 1;
+    fs->directory_ptr[directory_entry].inode = inode_index;
+
+    return MFS_OK;
+}
+
+// Sets and clears file attributes.
+int mfs_setattr(struct mfs *fs, const char *name, uint8_t set, uint8_t clear)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file to change.
+    //        uint8_t set - MFS_READONLY and/or MFS_HIDDEN to set.
+    //        uint8_t clear - MFS_READONLY and/or MFS_HIDDEN to clear.
+    // Output: int. MFS_OK or an error code. MFS_ENCRYPTED is only changed
+    //         by mfs_encrypt() and mfs_decrypt().
+
+    if ((set | clear) & ~(READONLY | HIDDEN))
+    {
+        return MFS_EINVAL;
+    }
+
+    lockShared(fs, &fs->image_lock);
+
+    int inode_index = lockFile(fs, name, 1);
+
+    if (inode_index >= 0)
+    {
+        fs->inode_ptr[inode_index].attribute |= set;
+        fs->inode_ptr[inode_index].attribute &= ~clear;
+        unlockFile(fs, inode_index);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    return inode_index < 0 ? inode_index : MFS_OK;
+}
+
+// Deletes a file.
+int mfs_unlink(struct mfs *fs, const char *name)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file we want to delete.
+    // Output: int. MFS_OK or an error code.
+    // Description: The directory entry, inode and blocks associated with the
+    //              inode are set to free. The block list is left intact so
+    //              mfs_undelete() can reclaim it.
+
+    lockShared(fs, &fs->image_lock);
+    lockExclusive(fs, &fs->dir_lock);
+
+    int inode_index = findFile(fs, name);
+    int ret = inode_index < 0 ? inode_index : MFS_OK;
+
+    if (inode_index >= 0)
+    {
+        // Wait for anyone still reading or writing the file.
+        lockExclusive(fs, &fs->inode_locks[inode_index]);
+        ret = unlinkInode(fs, searchDirectory(fs, name), inode_index);
+        releaseLock(fs, &fs->inode_locks[inode_index]);
+    }
+
+    releaseLock(fs, &fs->dir_lock);
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of mfs_unlink() with the directory and inode locked.
+static int unlinkInode(struct mfs *fs, int directory_entry, int32_t inode_index)
+{
+	if (fs->inode_ptr[inode_index].attribute & READONLY)
+	{
+		return MFS_EREADONLY;
+	}
+
+    fs->directory_ptr[directory_entry].in_use = 0;
+	fs->inode_ptr[inode_index].in_use = 0;
+
+    lockExclusive(fs, &fs->alloc_lock);
+    fs->free_inodes[inode_index] = 1;
+    releaseLock(fs, &fs->alloc_lock);
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        int block_index = fs->inode_ptr[inode_index].blocks[i];
+
+        if (block_index == -1)
+        {
+            continue;
+        }
+
+        freeBlock(fs, block_index);
+    }
+
+    return MFS_OK;
+}
+
+// Brings back a deleted file.
+int mfs_undelete(struct mfs *fs, const char *name)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file we want to undelete.
+    // Output: int. MFS_OK or an error code.
+    // Description: The file can only come back if its inode and every one of
+    //              its blocks are still free. A block still in use was either
+    //              reallocated or is shared with a clone, and the two can not
+    //              be told apart.
+
+    if (name == NULL)
+    {
+        return MFS_EINVAL;
+    }
+
+    lockShared(fs, &fs->image_lock);
+    lockExclusive(fs, &fs->dir_lock);
+    lockExclusive(fs, &fs->alloc_lock);
+
+    int ret = undeleteFile(fs, name);
+
+    releaseLock(fs, &fs->alloc_lock);
+    releaseLock(fs, &fs->dir_lock);
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of mfs_undelete() with the directory and free maps locked.
+static int undeleteFile(struct mfs *fs, const char *name)
+{
+	int directory_entry = searchDirectory(fs, name);
+
+	if (directory_entry == -1)
+	{
+        return MFS_ENOENT;
+	}
+
+    if (fs->directory_ptr[directory_entry].in_use)
+    {
+        return MFS_ENOTDELETED;
+    }
+
+    int inode_index = fs->directory_ptr[directory_entry].inode;
+
+    if (inode_index < 0 || fs->free_inodes[inode_index] == 0)
+    {
+        return MFS_EOVERWRITTEN;
+    }
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        int block_index = fs->inode_ptr[inode_index].blocks[i];
+
+        if (block_index == -1)
+        {
+            continue;
+        }
+
+        if (fs->free_blocks[block_index] == 0)
+        {
+            return MFS_EOVERWRITTEN;
+        }
+    }
+
+    fs->directory_ptr[directory_entry].in_use = 1;
+	fs->inode_ptr[inode_index].in_use = 1;
+    fs->free_inodes[inode_index] = 0;
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        int block_index = fs->inode_ptr[inode_index].blocks[i];
+
+        if (block_index == -1)
+        {
+            continue;
+        }
+
+        fs->free_blocks[block_index] = 0;
+    }
+
+    return MFS_OK;
+}
+
+// XORs every byte of a file with a 1-byte cipher.
+int mfs_xor(struct mfs *fs, const char *name, uint8_t cipher)
+{
+    // XOR is its own inverse, so this both encrypts and decrypts.
+    return cipherFile(fs, name, NULL, cipher, 0);
+}
+
+// Encrypts a file in place with ChaCha20.
+int mfs_encrypt(struct mfs *fs, const char *name, const uint8_t *key)
+{
+    return cipherFile(fs, name, key, 0, 1);
+}
+
+// Decrypts a ChaCha20 encrypted file in place.
+int mfs_decrypt(struct mfs *fs, const char *name, const uint8_t *key)
+{
+    return cipherFile(fs, name, key, 0, 0);
+}
+
+// Applies the XOR cipher or ChaCha20 to a file's blocks in place.
+static int cipherFile(struct mfs *fs, const char *name, const uint8_t *key, uint8_t cipher, int encrypting)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file we want to encrypt/decrypt.
+    //        const uint8_t *key - The 256-bit ChaCha20 key, NULL for XOR.
+    //        uint8_t cipher - The 1-byte XOR cipher when key is NULL.
+    //        int encrypting - 1 to encrypt, 0 to decrypt.
+    // Output: int. MFS_OK or an error code.
+    // Description: Encrypting with ChaCha20 picks a fresh per-file nonce and
+    //              stores it with a key check value in the inode. Each data
+    //              block is then XORed with its own keystream, derived from
+    //              the nonce and the block's position in the file. The XOR
+    //              cipher runs the vectorized kernel over the used bytes of
+    //              each block. Either way blocks are marked dirty so the next
+    //              save writes them back.
+
+    lockShared(fs, &fs->image_lock);
+
+    int inode_index = lockFile(fs, name, 1);
+    int ret = inode_index;
+
+    if (inode_index >= 0)
+    {
+        TRACE_BEGIN("cipher", "cipherInode");
+        ret = cipherInode(fs, inode_index, key, cipher, encrypting);
+        TRACE_END("cipher", "cipherInode");
+        unlockFile(fs, inode_index);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of cipherFile() with the inode locked.
+static int cipherInode(struct mfs *fs, int inode_index, const uint8_t *key, uint8_t cipher, int encrypting)
+{
+    // Input: struct mfs *fs - The image.
+    //        int inode_index - The file, locked exclusively.
+    //        const uint8_t *key - The 256-bit ChaCha20 key, NULL for XOR.
+    //        uint8_t cipher - The 1-byte XOR cipher when key is NULL.
+    //        int encrypting - 1 to encrypt, 0 to decrypt.
+    // Output: int. MFS_OK or an error code, with the file unchanged.
+    // Description: Every block is made the file's own before any is
+    //              changed: shared blocks are copied and, when encrypting,
+    //              holes get a block. Both ciphers are their own inverse, so
+    //              if a block can not be read part way through, the blocks
+    //              already done are put back by running the cipher over them
+    //              again. The nonce, key check and ENCRYPTED flag are only
+    //              changed once every block is done.
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+    int fill_holes = key != NULL && encrypting;
+    uint64_t nonce = inode->nonce;
+
+    if (key != NULL && encrypting)
+    {
+        if (inode->attribute & ENCRYPTED)
+        {
+            return MFS_EENCRYPTED;
+        }
+
+        nonce = randomNonce();
+    }
+    else if (key != NULL)
+    {
+        int ret = checkKey(fs, inode_index, key);
+
+        if (ret != MFS_OK)
+        {
+            return ret;
+        }
+    }
+
+    // Blocks shared with a clone are copied before they are changed, and
+    // encrypting a file gives each of its holes a block.
+    int32_t num_blocks = fileBlocks(fs, inode_index);
+    int32_t needed = sharedBlocks(fs, inode_index);
+
+    for (int i = 0; fill_holes && i < num_blocks; i++)
+    {
+        needed += inode->blocks[i] == -1;
+    }
+
+    if (needed * BLOCK_SIZE > mfs_df(fs))
+    {
+        return MFS_ENOSPC;
+    }
+
+    // The copies hold the same bytes and a new block reads as zeros like
+    // the hole it replaces, so stopping here leaves the contents as they were.
+    for (int block_pos = 0; block_pos < num_blocks; block_pos++)
+    {
+        // Holes read back as zeros and stay holes, except that encrypting
+        // stores them like any other block so the ciphertext does not show
+        // where the file's zeros are.
+        if (inode->blocks[block_pos] == -1 && !fill_holes)
+        {
+            continue;
+        }
+
+        int32_t block_index = blockForWrite(fs, inode_index, block_pos);
+
+        if (block_index < 0)
+        {
+            return block_index;
+        }
+    }
+
+    int done = cipherBlocks(fs, inode_index, key, nonce, cipher, num_blocks);
+
+    if (done < num_blocks)
+    {
+        cipherBlocks(fs, inode_index, key, nonce, cipher, done);
+        return MFS_EIO;
+    }
+
+    if (key != NULL && encrypting)
+    {
+        inode->nonce = nonce;
+        inode->key_check = keyCheck(key, nonce);
+        inode->attribute |= ENCRYPTED;
+    }
+    else if (key != NULL)
+    {
+        inode->attribute &= ~ENCRYPTED;
+    }
+
+    return MFS_OK;
+}
+
+// Runs the XOR cipher or ChaCha20 over the first blocks of a file.
+static int cipherBlocks(struct mfs *fs, int inode_index, const uint8_t *key, uint64_t nonce,
+                        uint8_t cipher, int count)
+{
+    // Input: struct mfs *fs - The image.
+    //        int inode_index - The file, locked exclusively, with no
+    //                          shared blocks among the first count.
+    //        const uint8_t *key - The ChaCha20 key, NULL for XOR.
+    //        uint64_t nonce - The ChaCha20 nonce.
+    //        uint8_t cipher - The 1-byte XOR cipher when key is NULL.
+    //        int count - Block positions to cover.
+    // Output: int. count, or the position of the first block that could
+    //         not be read. The blocks before it are done.
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    for (int block_pos = 0; block_pos < count; block_pos++)
+    {
+        int32_t block_index = inode->blocks[block_pos];
+
+        if (block_index == -1)
+        {
+            continue;
+        }
+
+        uint32_t offset = block_pos * BLOCK_SIZE;
+        int num_bytes = inode->file_size - offset < BLOCK_SIZE ? inode->file_size - offset : BLOCK_SIZE;
+        uint8_t *block = getBlock(fs, block_index);
+
+        if (block == NULL)
+        {
+            return block_pos;
+        }
+
+        if (key != NULL)
+        {
+            chacha20Xor(block, num_bytes, key, nonce, block_pos);
+        }
+        else
+        {
+            xorBuffer(block, num_bytes, cipher);
+        }
+        putBlock(fs, block_index, 1);
+    }
+
+    return count;
+}
+
+// Searches the snapshot table for name.
+static int searchSnapshot(struct mfs *fs, const char *name)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The snapshot name to look for.
+    // Output: int. Returns the index in snapshot_ptr[], -1 if not found.
+
+    if (name == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if (fs->snapshot_ptr[i].in_use && strncmp(fs->snapshot_ptr[i].name, name, 64) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Adds or drops one reference on every block of every live file.
+static void pinFiles(struct mfs *fs, struct directoryEntry *directory, struct inode *inodes, int pin)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct directoryEntry *directory - Directory to walk.
+    //        struct inode *inodes - The inode table that goes with it.
+    //        int pin - 1 to add a reference, 0 to release one.
+    // Output: void.
+    // Description: Used to make a snapshot share the live files' blocks and
+    //              to give them back when a snapshot or live view goes away.
+
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        int32_t inode_index = directory[i].inode;
+
+        if (!directory[i].in_use || inode_index < 0 || inode_index >= NUM_FILES)
+        {
+            continue;
+        }
+
+        for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++)
+        {
+            int32_t block_index = inodes[inode_index].blocks[j];
+
+            if (block_index == -1)
+            {
+                continue;
+            }
+
+            if (pin)
+            {
+                fs->block_refs[block_index]++;
+            }
+            else
+            {
+                freeBlock(fs, block_index);
+            }
+        }
+    }
+}
+
+// Records a read-only view of the directory and inodes.
+int mfs_snapshot(struct mfs *fs, const char *snap)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *snap - Name for the new snapshot.
+    // Output: int. MFS_OK or an error code.
+    // Description: The metadata blocks are copied into newly allocated data
+    //              blocks and every block used by a live file gains a
+    //              reference. No file data is copied, so the cost depends on
+    //              the size of the metadata only.
+
+    if (snap == NULL)
+    {
+        return MFS_EINVAL;
+    }
+
+    if (strlen(snap) > MFS_NAME_MAX)
+    {
+        return MFS_ENAMETOOLONG;
+    }
+
+    lockExclusive(fs, &fs->image_lock);
+
+    int ret = takeSnapshot(fs, snap);
+
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of mfs_snapshot() with the image locked.
+static int takeSnapshot(struct mfs *fs, const char *snap)
+{
+    if (searchSnapshot(fs, snap) != -1)
+    {
+        return MFS_EEXIST;
+    }
+
+    int index = -1;
+
+    for (int i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if (!fs->snapshot_ptr[i].in_use)
+        {
+            index = i;
+            break;
+        }
+    }
+
+    if (index == -1)
+    {
+        return MFS_ESNAPFULL;
+    }
+
+    if (SNAPSHOT_META_BLOCKS * BLOCK_SIZE > mfs_df(fs))
+    {
+        return MFS_ENOSPC;
+    }
+
+    struct snapshot *snapshot = &fs->snapshot_ptr[index];
+
+    for (int i = 0; i < SNAPSHOT_META_BLOCKS; i++)
+    {
+        int32_t block_index = findFreeBlock(fs);
+        uint8_t *data = getBlock(fs, block_index);
+
+        if (data == NULL)
+        {
+            freeBlock(fs, block_index);
+            while (--i >= 0)
+            {
+                freeBlock(fs, snapshot->blocks[i]);
+            }
+            return MFS_EIO;
+        }
+
+        memcpy(data, fs->data_blocks[i], BLOCK_SIZE);
+        putBlock(fs, block_index, 1);
+        snapshot->blocks[i] = block_index;
+    }
+
+    pinFiles(fs, fs->directory_ptr, fs->inode_ptr, 1);
+
+    setName(snapshot->name, snap);
+    snapshot->date = time(NULL);
+    snapshot->in_use = 1;
+
+    return MFS_OK;
+}
+
+// Drops a snapshot.
+int mfs_snapshot_delete(struct mfs *fs, const char *snap)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *snap - The snapshot to drop.
+    // Output: int. MFS_OK or an error code.
+    // Description: Releases the references the snapshot holds on file blocks
+    //              and frees the blocks holding its metadata copy.
+
+    lockExclusive(fs, &fs->image_lock);
+
+    int ret = dropSnapshot(fs, snap);
+
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of mfs_snapshot_delete() with the image locked.
+static int dropSnapshot(struct mfs *fs, const char *snap)
+{
+    int index = searchSnapshot(fs, snap);
+
+    if (index == -1)
+    {
+        return MFS_ENOSNAP;
+    }
+
+    uint8_t *meta;
+    int ret = loadSnapshot(fs, index, &meta);
+
+    if (ret != MFS_OK)
+    {
+        return ret;
+    }
+
+    pinFiles(fs, (struct directoryEntry *)(meta + DIRECTORY_BLOCK * BLOCK_SIZE),
+             (struct inode *)(meta + INODE_BLOCK * BLOCK_SIZE), 0);
+    free(meta);
+
+    for (int i = 0; i < SNAPSHOT_META_BLOCKS; i++)
+    {
+        freeBlock(fs, fs->snapshot_ptr[index].blocks[i]);
+    }
+
+    memset(&fs->snapshot_ptr[index], 0, sizeof(struct snapshot));
+
+    return MFS_OK;
+}
+
+// Walks the snapshot table.
+int mfs_snapshot_next(struct mfs *fs, int *cursor, struct mfs_snapinfo *info)
+{
+    // Input: struct mfs *fs - The image.
+    //        int *cursor - 0 on the first call, then left as returned.
+    //        struct mfs_snapinfo *info - Receives the next snapshot.
+    // Output: int. MFS_OK, or MFS_ENOSNAP once every snapshot has been returned.
+
+    int ret = MFS_ENOSNAP;
+
+    lockShared(fs, &fs->image_lock);
+
+    while (*cursor >= 0 && *cursor < MAX_SNAPSHOTS)
+    {
+        struct snapshot *snapshot = &fs->snapshot_ptr[(*cursor)++];
+
+        if (!snapshot->in_use)
+        {
+            continue;
+        }
+
+        setName(info->name, snapshot->name);
+        info->date = snapshot->date;
+
+        ret = MFS_OK;
+        break;
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Returns the directory and inodes to a snapshot's state.
+int mfs_rollback(struct mfs *fs, const char *snap)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *snap - The snapshot to return to.
+    // Output: int. MFS_OK or MFS_ENOSNAP.
+    // Description: Live files release their blocks, the metadata copy is
+    //              restored, and the restored files take a reference on their
+    //              blocks (which the snapshot kept allocated). The snapshot
+    //              itself is kept and can be rolled back to again.
+
+    lockExclusive(fs, &fs->image_lock);
+
+    int ret = rollbackSnapshot(fs, snap);
+
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Does the work of mfs_rollback() with the image locked.
+static int rollbackSnapshot(struct mfs *fs, const char *snap)
+{
+    int index = searchSnapshot(fs, snap);
+
+    if (index == -1)
+    {
+        return MFS_ENOSNAP;
+    }
+
+    // Read the whole copy first, so a block that can not be read leaves
+    // the live metadata as it was.
+    uint8_t *meta;
+    int ret = loadSnapshot(fs, index, &meta);
+
+    if (ret != MFS_OK)
+    {
+        return ret;
+    }
+
+    pinFiles(fs, fs->directory_ptr, fs->inode_ptr, 0);
+
+    // The header is part of the copy but must not go back in time.
+    struct imageHeader header = *fs->header_ptr;
+
+    memcpy(fs->data_blocks[0], meta, SNAPSHOT_META_BLOCKS * BLOCK_SIZE);
+    free(meta);
+
+    *fs->header_ptr = header;
+
+    // Deleted entries in the snapshot point at blocks it never held a
+    // reference on, so they can not be undeleted after a rollback.
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        if (!fs->directory_ptr[i].in_use)
+        {
+            memset(fs->directory_ptr[i].filename, 0, 64);
+            fs->directory_ptr[i].inode = -1;
+        }
+    }
+
+    pinFiles(fs, fs->directory_ptr, fs->inode_ptr, 1);
+
+    return MFS_OK;
+}
+
+// Reads a snapshot's metadata copy into memory.
+static int loadSnapshot(struct mfs *fs, int index, uint8_t **meta)
+{
+    // Input: struct mfs *fs - The image.
+    //        int index - Index in snapshot_ptr[].
+    //        uint8_t **meta - Receives SNAPSHOT_META_BLOCKS blocks laid out
+    //                         like the start of the image, freed by the caller.
+    // Output: int. MFS_OK, MFS_ENOMEM, or MFS_EIO if the block cache could
+    //         not read a block.
+
+    *meta = malloc(SNAPSHOT_META_BLOCKS * BLOCK_SIZE);
+
+    if (*meta == NULL)
+    {
+        return MFS_ENOMEM;
+    }
+
+    for (int i = 0; i < SNAPSHOT_META_BLOCKS; i++)
+    {
+        uint8_t *data = getBlock(fs, fs->snapshot_ptr[index].blocks[i]);
+
+        if (data == NULL)
+        {
+            free(*meta);
+            *meta = NULL;
+            return MFS_EIO;
+        }
+
+        memcpy(*meta + (size_t)i * BLOCK_SIZE, data, BLOCK_SIZE);
+        putBlock(fs, fs->snapshot_ptr[index].blocks[i], 0);
+    }
+
+    return MFS_OK;
+}
+
+// Points the directory and inode table at a snapshot's metadata copy.
+static int enterSnapshot(struct mfs *fs, const char *snap, uint8_t **meta)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *snap - The snapshot to view.
+    //        uint8_t **meta - Receives the metadata copy, for leaveSnapshot().
+    // Output: int. MFS_OK or an error code.
+    // Description: Until leaveSnapshot() lookups and reads see the files as
+    //              they were when the snapshot was taken. The data blocks
+    //              they read are pinned by the snapshot.
+
+    int index = searchSnapshot(fs, snap);
+
+    if (index == -1)
+    {
+        return MFS_ENOSNAP;
+    }
+
+    int ret = loadSnapshot(fs, index, meta);
+
+    if (ret != MFS_OK)
+    {
+        return ret;
+    }
+
+    fs->directory_ptr = (struct directoryEntry *)(*meta + DIRECTORY_BLOCK * BLOCK_SIZE);
+    fs->inode_ptr = (struct inode *)(*meta + INODE_BLOCK * BLOCK_SIZE);
+
+    return MFS_OK;
+}
+
+// Returns to the live directory and inode table.
+static void leaveSnapshot(struct mfs *fs, uint8_t *meta)
+{
+    fs->directory_ptr = (struct directoryEntry *)&fs->data_blocks[DIRECTORY_BLOCK][0];
+    fs->inode_ptr = (struct inode *)&fs->data_blocks[INODE_BLOCK][0];
+    free(meta);
+}
+
+// Describes a file as it was when a snapshot was taken.
+int mfs_snapshot_stat(struct mfs *fs, const char *snap, const char *name, struct mfs_stat *st)
+{
+    // Input: As mfs_stat(), plus const char *snap - The snapshot to look in.
+    // Output: int. MFS_OK or an error code.
+    // Description: The live directory is swapped out while the snapshot is
+    //              viewed, so the image is locked exclusively.
+
+    uint8_t *meta;
+
+    lockExclusive(fs, &fs->image_lock);
+
+    int ret = enterSnapshot(fs, snap, &meta);
+
+    if (ret == MFS_OK)
+    {
+        ret = findFile(fs, name);
+
+        if (ret >= 0)
+        {
+            statInode(fs, ret, st);
+            ret = MFS_OK;
+        }
+
+        leaveSnapshot(fs, meta);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    return ret;
+}
+
+// Reads part of a file as it was when a snapshot was taken.
+int mfs_snapshot_read(struct mfs *fs, const char *snap, const char *name, uint32_t offset, void *buf, uint32_t size)
+{
+    // Input: As mfs_read(), plus const char *snap - The snapshot to read from.
+    // Output: int. Bytes read or an error code.
+
+    uint8_t *meta;
+
+    lockExclusive(fs, &fs->image_lock);
+
+    int ret = enterSnapshot(fs, snap, &meta);
+
+    if (ret == MFS_OK)
+    {
+        ret = findFile(fs, name);
+
+        if (ret >= 0)
+        {
+            ret = readInode(fs, ret, offset, buf, size, NULL);
+        }
+
+        leaveSnapshot(fs, meta);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    if (ret > 0)
+    {
+        STAT_ADD(fs, bytes_read, ret);
+    }
+
+    return ret;
+}
+
+// Returns a block's data, pinned until the matching putBlock().
+static uint8_t *getBlock(struct mfs *fs, int32_t block)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t block - Index of the block.
+    // Output: uint8_t *. BLOCK_SIZE bytes that may be read and written, or
+    //         NULL if the block cache could not read the block or spill a
+    //         dirty one to make room for it. Nothing is pinned then.
+    // Description: With the whole image resident this is just the block's
+    //              row in data_blocks. With a cache the block is loaded on
+    //              a miss and can not be evicted until it is put back.
+
+    if (fs->block_cache == NULL || block < FIRST_DATA_BLOCK)
+    {
+        return fs->data_blocks[block];
+    }
+
+    return cacheGet(fs->block_cache, block);
+}
+
+// Releases a block returned by getBlock().
+static void putBlock(struct mfs *fs, int32_t block, int dirty)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t block - The block passed to getBlock().
+    //        int dirty - 1 if the block was modified.
+    // Output: void.
+    // Description: A modified block is marked for write back and its CRC32C
+    //              is recomputed before it is unpinned.
+
+    if (dirty)
+    {
+        if (fs->block_cache == NULL || block < FIRST_DATA_BLOCK)
+        {
+            fs->block_crcs[block] = crc32c(fs->data_blocks[block], BLOCK_SIZE);
+            fs->dirty_blocks[block] = 1;
+        }
+        else
+        {
+            // The caller still holds the pin, so the frame can not move.
+            fs->block_crcs[block] = crc32c(cachePeek(fs->block_cache, block), BLOCK_SIZE);
+        }
+    }
+
+    if (fs->block_cache != NULL && block >= FIRST_DATA_BLOCK)
+    {
+        cachePut(fs->block_cache, block, dirty);
+    }
+}
+
+// Reports the image memory and the block cache's size and hit rate.
+int mfs_cache_stats(struct mfs *fs, struct mfs_cache_stats *stats)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct mfs_cache_stats *stats - Receives the counters, the
+    //                                        cache ones all zero when the
+    //                                        image is resident.
+    // Output: int. MFS_OK.
+
+    memset(stats, 0, sizeof(*stats));
+
+    stats->memory_bytes = fs->image_bytes;
+    stats->pages = fs->pages;
+
+    if (fs->block_cache == NULL)
+    {
+        return MFS_OK;
+    }
+
+    stats->capacity = fs->block_cache->capacity;
+    stats->hits = fs->block_cache->hits;
+    stats->misses = fs->block_cache->misses;
+    stats->writebacks = fs->block_cache->writebacks;
+    stats->io_errors = fs->block_cache->io_errors;
+
+    return MFS_OK;
+}
+
+// Copies the statistics of an image.
+int mfs_stats(struct mfs *fs, struct mfs_stats *stats)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct mfs_stats *stats - Receives the counters and histograms
+    //                                  since the image was opened or reset.
+    // Output: int. MFS_OK.
+    // Description: Every field is a uint64_t, so they are copied one at a
+    //              time while other threads may still be adding to them.
+
+    const uint64_t *src = (const uint64_t *)&fs->stats;
+    uint64_t *dst = (uint64_t *)stats;
+
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+    {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+
+    return MFS_OK;
+}
+
+// Zeroes the statistics of an image.
+void mfs_stats_reset(struct mfs *fs)
+{
+    uint64_t *counters = (uint64_t *)&fs->stats;
+
+    for (size_t i = 0; i < sizeof(fs->stats) / sizeof(uint64_t); i++)
+    {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Adds a latency to a histogram.
+void mfs_hist_record(struct mfs_histogram *hist, uint64_t ns)
+{
+    // Input: struct mfs_histogram *hist - The histogram.
+    //        uint64_t ns - The latency.
+    // Output: void.
+    // Description: Values below 2^MFS_HIST_SUB_BITS have a bucket each.
+    //              Above that each power of two is split into
+    //              2^MFS_HIST_SUB_BITS buckets by the bits after the leading
+    //              one. Safe to call from several threads.
+
+    int bucket = (int)ns;
+
+    if (ns >= (1 << MFS_HIST_SUB_BITS))
+    {
+        int log = 63 - __builtin_clzll(ns);
+
+        bucket = ((log - MFS_HIST_SUB_BITS + 1) << MFS_HIST_SUB_BITS) +
+                 (int)((ns >> (log - MFS_HIST_SUB_BITS)) & ((1 << MFS_HIST_SUB_BITS) - 1));
+
+        if (bucket >= MFS_HIST_BUCKETS)
+        {
+            bucket = MFS_HIST_BUCKETS - 1;
+        }
+    }
+
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+// Latency below which a given percentage of a histogram falls.
+uint64_t mfs_hist_percentile(const struct mfs_histogram *hist, double percent)
+{
+    // Input: const struct mfs_histogram *hist - The histogram.
+    //        double percent - 0 to 100.
+    // Output: uint64_t. The upper end of the bucket holding that latency,
+    //         at most the largest latency recorded. 0 if it is empty.
+
+    uint64_t rank = (uint64_t)(hist->count * percent / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (int bucket = 0; bucket < MFS_HIST_BUCKETS; bucket++)
+    {
+        seen += hist->buckets[bucket];
+
+        if (seen < rank)
+        {
+            continue;
+        }
+
+        if (bucket < (1 << MFS_HIST_SUB_BITS))
+        {
+            return bucket;
+        }
+
+        int shift = (bucket >> MFS_HIST_SUB_BITS) - 1;
+        uint64_t upper = ((uint64_t)((bucket & ((1 << MFS_HIST_SUB_BITS) - 1)) + (1 << MFS_HIST_SUB_BITS) + 1) << shift) - 1;
+
+        return upper < hist->max_ns ? upper : hist->max_ns;
+    }
+
+    return hist->max_ns;
+}
+
+// Turns tracing on or off for every thread.
+int mfs_trace_enable(int on)
+{
+    // Input: int on - 1 to record events, 0 to stop.
+    // Output: int. MFS_OK, or MFS_EINVAL if tracing was not compiled in.
+    // Description: Events already recorded are kept either way.
+
+    if (!MFS_STATS)
+    {
+        return MFS_EINVAL;
+    }
+
+    traceEnable(on);
+    return MFS_OK;
+}
+
+// Records the start of a phase on the calling thread.
+void mfs_trace_begin(const char *category, const char *name)
+{
+    TRACE_BEGIN(category, name);
+}
+
+// Records the end of the phase begun last on the calling thread.
+void mfs_trace_end(const char *category, const char *name)
+{
+    TRACE_END(category, name);
+}
+
+// Returns how many events mfs_trace_dump() would write.
+uint64_t mfs_trace_count()
+{
+    return traceCount();
+}
+
+// Writes the recorded events as Chrome trace event JSON.
+int mfs_trace_dump(const char *path)
+{
+    return traceDump(path) == 0 ? MFS_OK : MFS_EIO;
+}
+
+// Drops the recorded events.
+void mfs_trace_clear()
+{
+    traceClear();
+}
+
+// Checks a block against its stored checksum.
+static int verifyBlock(struct mfs *fs, int32_t block)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t block - Index of the block to check.
+    // Output: int. Returns 0 if the block matches its CRC32C, -1 otherwise
+    //         or if it can not be read.
+
+    uint8_t *data = block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS ? NULL : getBlock(fs, block);
+
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t crc = crc32c(data, BLOCK_SIZE);
+    putBlock(fs, block, 0);
+
+    return crc == fs->block_crcs[block] ? 0 : -1;
+}
+
+struct scrubJob
+{
+    struct mfs *fs;
+    int32_t first_block;
+    int32_t last_block;
+    int32_t checked;
+    int32_t errors;
+    int32_t bad_blocks[MFS_SCRUB_REPORTED];   // First few mismatches found by this thread
+};
+
+// Thread body for mfs_scrub().
+static void *scrubWorker(void *arg)
+{
+    struct scrubJob *job = (struct scrubJob *)arg;
+
+    for (int32_t block = job->first_block; block < job->last_block; block++)
+    {
+        if (job->fs->free_blocks[block])
+        {
+            continue;
+        }
+
+        if (verifyBlock(job->fs, block) == -1)
+        {
+            if (job->errors < MFS_SCRUB_REPORTED)
+            {
+                job->bad_blocks[job->errors] = block;
+            }
+            job->errors++;
+        }
+        job->checked++;
+    }
+
+    return NULL;
+}
+
+// Checks every allocated block against its checksum.
+int mfs_scrub(struct mfs *fs, struct mfs_scrub *report)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct mfs_scrub *report - Receives the counts, the first
+    //                                   MFS_SCRUB_REPORTED bad blocks with
+    //                                   the file owning each, and timing.
+    // Output: int. MFS_OK, or MFS_ECHECKSUM if any block failed.
+    // Description: The data region is split into one contiguous range per
+    //              thread and every allocated block is checked against its
+    //              stored CRC32C.
+
+    int threads = workerThreads(NUM_BLOCKS - FIRST_DATA_BLOCK, 1);
+    struct scrubJob jobs[MAX_WORKER_THREADS];
+    pthread_t tids[MAX_WORKER_THREADS];
+    int spawned[MAX_WORKER_THREADS] = { 0 };
+    int32_t per_thread = (NUM_BLOCKS - FIRST_DATA_BLOCK + threads - 1) / threads;
+
+    memset(report, 0, sizeof(*report));
+    report->threads = threads;
+
+    // Blocks being written would fail their check half way through.
+    lockExclusive(fs, &fs->image_lock);
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int t = 0; t < threads; t++)
+    {
+        memset(&jobs[t], 0, sizeof(jobs[t]));
+        jobs[t].fs = fs;
+        jobs[t].first_block = FIRST_DATA_BLOCK + t * per_thread;
+        jobs[t].last_block = jobs[t].first_block + per_thread;
+        if (jobs[t].last_block > NUM_BLOCKS)
+        {
+            jobs[t].last_block = NUM_BLOCKS;
+        }
+
+        // The first range runs on the calling thread.
+        if (t > 0 && pthread_create(&tids[t], NULL, scrubWorker, &jobs[t]) == 0)
+        {
+            spawned[t] = 1;
+        }
+        else
+        {
+            scrubWorker(&jobs[t]);
+        }
+    }
+
+    for (int t = 0; t < threads; t++)
+    {
+        if (spawned[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+
+        report->checked += jobs[t].checked;
+        report->errors += jobs[t].errors;
+
+        for (int i = 0; i < jobs[t].errors && i < MFS_SCRUB_REPORTED &&
+             report->reported < MFS_SCRUB_REPORTED; i++)
+        {
+            int32_t block = jobs[t].bad_blocks[i];
+            int r = report->reported++;
+
+            report->bad_blocks[r] = block;
+
+            for (int d = 0; d < NUM_FILES; d++)
+            {
+                int32_t inode_index = fs->directory_ptr[d].inode;
+
+                if (!fs->directory_ptr[d].in_use || inode_index < 0)
+                {
+                    continue;
+                }
+
+                int num_blocks = fileBlocks(fs, inode_index);
+                for (int b = 0; b < num_blocks && b < MAX_BLOCKS_PER_FILE; b++)
+                {
+                    if (fs->inode_ptr[inode_index].blocks[b] == block)
+                    {
+                        setName(report->owners[r], fs->directory_ptr[d].filename);
+                    }
+                }
+            }
+        }
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    return report->errors ? MFS_ECHECKSUM : MFS_OK;
+}
+
+// Structures fsck cross-checks: the live directory and inode table, then
+// the copy of each in every snapshot.
+#define FSCK_TABLES (MAX_SNAPSHOTS + 1)
+
+struct fsckJob
+{
+    struct mfs *fs;
+    int repair;
+    int tables;
+    struct directoryEntry *directories[FSCK_TABLES];
+    struct inode *inode_tables[FSCK_TABLES];
+    const char *names[FSCK_TABLES];         // "" for the live image, else the snapshot
+    uint64_t (*named)[NUM_FILES / 64];      // Bitmap per table of inodes an entry names
+    uint16_t *owners;                       // Files and snapshots owning each block
+    int32_t first;                          // Inode or block range of this thread
+    int32_t last;
+    struct mfs_fsck report;                 // What this thread found
+};
+
+// Counts a problem and describes the first few.
+static void fsckProblem(struct fsckJob *job, int32_t *counter, int repaired, const char *format, ...)
+{
+    // Input: struct fsckJob *job - The thread that found it.
+    //        int32_t *counter - The count in job->report for its kind.
+    //        int repaired - 1 if it was fixed.
+    //        const char *format - printf format of the description.
+    // Output: void.
+
+    (*counter)++;
+    job->report.problems++;
+    job->report.repaired += repaired;
+
+    if (job->report.reported < MFS_FSCK_REPORTED)
+    {
+        va_list args;
+
+        va_start(args, format);
+        vsnprintf(job->report.messages[job->report.reported++], sizeof(job->report.messages[0]), format, args);
+        va_end(args);
+    }
+}
+
+// Checks every directory of the image and marks the inodes they name.
+static void fsckDirectories(struct fsckJob *job)
+{
+    // Input: struct fsckJob *job - The whole image, on the calling thread.
+    // Output: void.
+    // Description: An entry in use must name an inode that no other entry
+    //              names, and no other entry may have its name. Repairs only
+    //              touch the live directory: a bad entry becomes a deleted
+    //              one, and the inode it named is freed later if nothing
+    //              else names it. Snapshot metadata blocks are owned here.
+
+    struct mfs *fs = job->fs;
+
+    for (int t = 0; t < job->tables; t++)
+    {
+        struct directoryEntry *directory = job->directories[t];
+        int repair = job->repair && t == 0;
+
+        for (int d = 0; d < NUM_FILES; d++)
+        {
+            if (!directory[d].in_use)
+            {
+                continue;
+            }
+
+            int32_t inode_index = directory[d].inode;
+            const char *problem = NULL;
+
+            if (inode_index < 0 || inode_index >= NUM_FILES)
+            {
+                problem = "names no inode";
+            }
+            else if (job->named[t][inode_index / 64] & (1ULL << (inode_index % 64)))
+            {
+                problem = "names an inode another entry names";
+            }
+            else
+            {
+                for (int e = 0; e < d; e++)
+                {
+                    if (directory[e].in_use && strncmp(directory[e].filename, directory[d].filename, 64) == 0)
+                    {
+                        problem = "repeats the name of another entry";
+                        break;
+                    }
+                }
+            }
+
+            if (problem != NULL)
+            {
+                fsckProblem(job, &job->report.bad_entries, repair, "%s%sEntry %d (%.40s) %s",
+                            job->names[t], job->names[t][0] ? ": " : "", d, directory[d].filename, problem);
+
+                if (repair)
+                {
+                    directory[d].in_use = 0;
+                    directory[d].inode = -1;
+                }
+                continue;
+            }
+
+            job->named[t][inode_index / 64] |= 1ULL << (inode_index % 64);
+
+            if (t == 0)
+            {
+                job->report.files++;
+            }
+        }
+    }
+
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        if (!fs->snapshot_ptr[s].in_use)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < SNAPSHOT_META_BLOCKS; i++)
+        {
+            int32_t block = fs->snapshot_ptr[s].blocks[i];
+
+            if (block >= FIRST_DATA_BLOCK && block < NUM_BLOCKS)
+            {
+                job->owners[block]++;
+            }
+        }
+    }
+}
+
+// Thread body for mfs_fsck(): checks a range of inodes in every table and
+// counts the owners of the blocks they list.
+static void *fsckInodeWorker(void *arg)
+{
+    struct fsckJob *job = (struct fsckJob *)arg;
+    struct mfs *fs = job->fs;
+
+    for (int t = 0; t < job->tables; t++)
+    {
+        const char *snap = job->names[t];
+        const char *sep = snap[0] ? ": " : "";
+        int repair = job->repair && t == 0;
+
+        for (int32_t i = job->first; i < job->last; i++)
+        {
+            struct inode *inode = &job->inode_tables[t][i];
+            int named = (job->named[t][i / 64] >> (i % 64)) & 1;
+
+            // Only the live free inode map exists. An inode no entry names
+            // is free, though a deleted file may still list its blocks.
+            if (t == 0 && (inode->in_use != named || fs->free_inodes[i] != !named))
+            {
+                fsckProblem(job, &job->report.bad_inodes, repair, "Inode %d is %s but %s", i,
+                            named ? "named by an entry" : "named by no entry",
+                            inode->in_use != named ? (named ? "not in use" : "in use") :
+                            (named ? "marked free" : "not marked free"));
+
+                if (repair)
+                {
+                    inode->in_use = named;
+                    fs->free_inodes[i] = !named;
+                }
+            }
+
+            if (!named)
+            {
+                continue;
+            }
+
+            if (inode->file_size > MAX_FILE_SIZE)
+            {
+                fsckProblem(job, &job->report.bad_block_lists, repair, "%s%sInode %d is %u bytes, more than a file holds",
+                            snap, sep, i, inode->file_size);
+
+                if (repair)
+                {
+                    inode->file_size = MAX_FILE_SIZE;
+                }
+            }
+
+            int32_t size_blocks = (inode->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            int outside = 0;
+            int past_end = 0;
+
+            for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++)
+            {
+                int32_t block = inode->blocks[j];
+
+                if (block == -1)
+                {
+                    continue;
+                }
+
+                // A bad entry is left out of the owner counts either way,
+                // so the block maps are checked against what repair leaves.
+                if (block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS || j >= size_blocks)
+                {
+                    if (block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS)
+                    {
+                        outside++;
+                    }
+                    else
+                    {
+                        past_end++;
+                    }
+
+                    if (repair)
+                    {
+                        inode->blocks[j] = -1;
+                    }
+                    continue;
+                }
+
+                __atomic_fetch_add(&job->owners[block], 1, __ATOMIC_RELAXED);
+            }
+
+            if (outside)
+            {
+                fsckProblem(job, &job->report.bad_block_lists, repair, "%s%sInode %d lists %d blocks outside the data region",
+                            snap, sep, i, outside);
+            }
+            if (past_end)
+            {
+                fsckProblem(job, &job->report.bad_block_lists, repair, "%s%sInode %d lists %d blocks past its %u bytes",
+                            snap, sep, i, past_end, inode->file_size);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Thread body for mfs_fsck(): checks a range of blocks against their owners.
+static void *fsckBlockWorker(void *arg)
+{
+    struct fsckJob *job = (struct fsckJob *)arg;
+    struct mfs *fs = job->fs;
+    int repair = job->repair;
+
+    for (int32_t block = job->first; block < job->last; block++)
+    {
+        int owners = job->owners[block];
+        int refs = owners ? owners - 1 : 0;
+
+        if (owners == 0 && !fs->free_blocks[block])
+        {
+            fsckProblem(job, &job->report.leaked_blocks, repair, "Block %d is allocated but nothing owns it", block);
+        }
+        else if (owners > 0 && fs->free_blocks[block])
+        {
+            fsckProblem(job, &job->report.lost_blocks, repair, "Block %d has %d owners but is marked free", block, owners);
+        }
+
+        if (fs->block_refs[block] < refs)
+        {
+            fsckProblem(job, &job->report.double_allocated, repair, "Block %d has %d owners but %d references",
+                        block, owners, fs->block_refs[block] + 1);
+        }
+        else if (fs->block_refs[block] > refs)
+        {
+            fsckProblem(job, &job->report.extra_refs, repair, "Block %d has %d owners but %d references",
+                        block, owners, fs->block_refs[block] + 1);
+        }
+
+        if (repair)
+        {
+            fs->free_blocks[block] = owners == 0;
+            fs->block_refs[block] = refs;
+        }
+
+        job->report.blocks += owners > 0;
+    }
+
+    return NULL;
+}
+
+// Runs one pass of fsck over [0, items) split between threads.
+static void fsckPass(struct fsckJob *jobs, int threads, int32_t first, int32_t items, void *(*worker)(void *))
+{
+    pthread_t tids[MAX_WORKER_THREADS];
+    int spawned[MAX_WORKER_THREADS] = { 0 };
+    int32_t per_thread = (items + threads - 1) / threads;
+
+    for (int t = 0; t < threads; t++)
+    {
+        jobs[t].first = first + t * per_thread < first + items ? first + t * per_thread : first + items;
+        jobs[t].last = jobs[t].first + per_thread < first + items ? jobs[t].first + per_thread : first + items;
+
+        // The first range runs on the calling thread.
+        if (t > 0 && pthread_create(&tids[t], NULL, worker, &jobs[t]) == 0)
+        {
+            spawned[t] = 1;
+        }
+        else
+        {
+            worker(&jobs[t]);
+        }
+    }
+
+    for (int t = 0; t < threads; t++)
+    {
+        if (spawned[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+    }
+}
+
+// Checks that the directory, inodes, free maps and block references agree.
+int mfs_fsck(struct mfs *fs, int repair, struct mfs_fsck *report)
+{
+    // Input: struct mfs *fs - The image.
+    //        int repair - 1 to fix what is found.
+    //        struct mfs_fsck *report - Receives the counts, a description
+    //                                  of the first MFS_FSCK_REPORTED
+    //                                  problems, and timing.
+    // Output: int. MFS_OK, MFS_ECORRUPT if problems are left, or MFS_ENOMEM.
+    // Description: The directories are checked first and mark the inodes
+    //              they name in a bitmap per table. Threads then check a
+    //              range of inodes each, counting how many files and
+    //              snapshots own every block, and finally a range of blocks
+    //              each against the free block map and block_refs[]. A block
+    //              with n owners must be allocated with n - 1 references, and
+    //              one with none must be free. Repairs make the live image
+    //              agree with its directory. Snapshots are only reported, as
+    //              they are never changed, but the blocks they own are kept.
+
+    struct fsckJob jobs[MAX_WORKER_THREADS];
+    uint64_t named[FSCK_TABLES][NUM_FILES / 64];
+    uint8_t *meta[FSCK_TABLES] = { NULL };
+    uint16_t *owners = calloc(NUM_BLOCKS, sizeof(uint16_t));
+    int threads = workerThreads(NUM_BLOCKS - FIRST_DATA_BLOCK, 1);
+    int ret = MFS_OK;
+
+    memset(report, 0, sizeof(*report));
+    memset(named, 0, sizeof(named));
+
+    if (owners == NULL)
+    {
+        return MFS_ENOMEM;
+    }
+
+    lockExclusive(fs, &fs->image_lock);
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(&jobs[0], 0, sizeof(jobs[0]));
+    jobs[0].fs = fs;
+    jobs[0].repair = repair;
+    jobs[0].named = named;
+    jobs[0].owners = owners;
+    jobs[0].directories[0] = fs->directory_ptr;
+    jobs[0].inode_tables[0] = fs->inode_ptr;
+    jobs[0].names[0] = "";
+    jobs[0].tables = 1;
+
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        if (!fs->snapshot_ptr[s].in_use)
+        {
+            continue;
+        }
+
+        int bad = 0;
+
+        for (int i = 0; i < SNAPSHOT_META_BLOCKS; i++)
+        {
+            int32_t block = fs->snapshot_ptr[s].blocks[i];
+            bad += block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS;
+        }
+
+        if (bad)
+        {
+            fsckProblem(&jobs[0], &jobs[0].report.bad_block_lists, 0, "%.40s: %d metadata blocks are outside the data region",
+                        fs->snapshot_ptr[s].name, bad);
+            continue;
+        }
+
+        int t = jobs[0].tables;
+
+        ret = loadSnapshot(fs, s, &meta[t]);
+
+        if (ret != MFS_OK)
+        {
+            break;
+        }
+
+        jobs[0].directories[t] = (struct directoryEntry *)(meta[t] + DIRECTORY_BLOCK * BLOCK_SIZE);
+        jobs[0].inode_tables[t] = (struct inode *)(meta[t] + INODE_BLOCK * BLOCK_SIZE);
+        jobs[0].names[t] = fs->snapshot_ptr[s].name;
+        jobs[0].tables++;
+    }
+
+    if (ret == MFS_OK)
+    {
+        fsckDirectories(&jobs[0]);
+
+        // The jobs start with what the directory pass found in jobs[0].
+        for (int t = 1; t < threads; t++)
+        {
+            jobs[t] = jobs[0];
+            memset(&jobs[t].report, 0, sizeof(jobs[t].report));
+        }
+
+        fsckPass(jobs, threads, 0, NUM_FILES, fsckInodeWorker);
+        fsckPass(jobs, threads, FIRST_DATA_BLOCK, NUM_BLOCKS - FIRST_DATA_BLOCK, fsckBlockWorker);
+
+        for (int t = 0; t < threads; t++)
+        {
+            struct mfs_fsck *found = &jobs[t].report;
+
+            report->files += found->files;
+            report->blocks += found->blocks;
+            report->bad_entries += found->bad_entries;
+            report->bad_inodes += found->bad_inodes;
+            report->bad_block_lists += found->bad_block_lists;
+            report->leaked_blocks += found->leaked_blocks;
+            report->lost_blocks += found->lost_blocks;
+            report->double_allocated += found->double_allocated;
+            report->extra_refs += found->extra_refs;
+            report->problems += found->problems;
+            report->repaired += found->repaired;
+
+            for (int i = 0; i < found->reported && report->reported < MFS_FSCK_REPORTED; i++)
+            {
+                memcpy(report->messages[report->reported++], found->messages[i], sizeof(found->messages[i]));
+            }
+        }
+
+        if (report->problems > report->repaired)
+        {
+            ret = MFS_ECORRUPT;
+        }
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report->threads = threads;
+    report->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (int t = 0; t < FSCK_TABLES; t++)
+    {
+        free(meta[t]);
+    }
+    free(owners);
+
+    return ret;
+}
+
+// Measures how a file's blocks are laid out. Called with the inode locked.
+static void fragInode(struct mfs *fs, int32_t inode_index, struct mfs_fragfile *info)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The file's inode.
+    //        struct mfs_fragfile *info - Receives the counts.
+    // Output: void.
+    // Description: A run is a stretch of the file whose blocks follow each
+    //              other in the image, so it can be read in one sweep. A
+    //              hole does not end a run when the blocks on either side
+    //              of it are adjacent.
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+    int32_t last = -2;
+
+    memset(info, 0, sizeof(*info));
+
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+        int32_t block = inode->blocks[i];
+
+        if (block == -1)
+        {
+            continue;
+        }
+
+        if (block != last + 1)
+        {
+            info->runs++;
+        }
+        info->blocks++;
+        last = block;
+    }
+
+    int32_t size_blocks = fileBlocks(fs, inode_index);
+
+    if (size_blocks > 0 && inode->blocks[size_blocks - 1] != -1)
+    {
+        info->slack = size_blocks * BLOCK_SIZE - inode->file_size;
+    }
+}
+
+// Reports how fragmented the files and the free space of an image are.
+int mfs_frag(struct mfs *fs, struct mfs_frag *report)
+{
+    // Input: struct mfs *fs - The image.
+    //        struct mfs_frag *report - Receives the counts.
+    // Output: int. MFS_OK.
+    // Description: Every file is measured with fragInode(), then the free
+    //              block map is walked once to find the free runs.
+
+    memset(report, 0, sizeof(*report));
+
+    lockShared(fs, &fs->image_lock);
+    lockShared(fs, &fs->dir_lock);
+
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        struct directoryEntry *dir = &fs->directory_ptr[i];
+
+        if (!dir->in_use)
+        {
+            report->entries_deleted += dir->filename[0] != 0;
+            continue;
+        }
+
+        struct mfs_fragfile info;
+
+        lockShared(fs, &fs->inode_locks[dir->inode]);
+        fragInode(fs, dir->inode, &info);
+        releaseLock(fs, &fs->inode_locks[dir->inode]);
+
+        report->files++;
+        report->entries_used++;
+        report->file_blocks += info.blocks;
+        report->runs += info.runs;
+        report->fragmented_files += info.runs > 1;
+        report->slack += info.slack;
+    }
+
+    releaseLock(fs, &fs->dir_lock);
+
+    lockShared(fs, &fs->alloc_lock);
+
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        report->inodes_used += !fs->free_inodes[i];
+    }
+
+    report->data_blocks = NUM_BLOCKS - FIRST_DATA_BLOCK;
+
+    for (int32_t block = FIRST_DATA_BLOCK; block < NUM_BLOCKS; )
+    {
+        if (!fs->free_blocks[block])
+        {
+            block++;
+            continue;
+        }
+
+        int32_t run = block;
+
+        while (run < NUM_BLOCKS && fs->free_blocks[run])
+        {
+            run++;
+        }
+
+        int32_t length = run - block;
+        int bucket = 31 - __builtin_clz(length);
+
+        report->free_blocks += length;
+        report->free_runs++;
+        report->free_run_sizes[bucket < MFS_FRAG_BUCKETS ? bucket : MFS_FRAG_BUCKETS - 1]++;
+        if (length > report->largest_free_run)
+        {
+            report->largest_free_run = length;
+        }
+
+        block = run;
+    }
+
+    releaseLock(fs, &fs->alloc_lock);
+    releaseLock(fs, &fs->image_lock);
+
+    return MFS_OK;
+}
+
+// Reports how fragmented one file is.
+int mfs_frag_file(struct mfs *fs, const char *name, struct mfs_fragfile *info)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file.
+    //        struct mfs_fragfile *info - Receives its blocks, runs and slack.
+    // Output: int. MFS_OK or MFS_ENOENT.
+
+    lockShared(fs, &fs->image_lock);
+
+    int inode_index = lockFile(fs, name, 0);
+
+    if (inode_index >= 0)
+    {
+        fragInode(fs, inode_index, info);
+        unlockFile(fs, inode_index);
+    }
+
+    releaseLock(fs, &fs->image_lock);
+
+    return inode_index < 0 ? inode_index : MFS_OK;
+}
+
+// Blocks defrag moves before it lets other calls in.
+#define DEFRAG_BATCH 256
+
+// Marks a block in the owner map that defrag must leave where it is.
+#define DEFRAG_FIXED -2
+
+// Finds which file owns each block, for defrag.
+static void defragOwners(struct mfs *fs, int32_t *owners)
+{
+    // Input: struct mfs *fs - The image, with image_lock held exclusively.
+    //        int32_t *owners - Receives, for each of NUM_BLOCKS blocks,
+    //                          inode * MAX_BLOCKS_PER_FILE + position, -1
+    //                          if no file lists it, or DEFRAG_FIXED.
+    // Output: void.
+    // Description: Blocks shared by clones or snapshots are fixed, since
+    //              moving one would mean finding every copy of the block
+    //              list, and snapshots are never changed. Snapshot metadata
+    //              and blocks only a snapshot owns are allocated with no
+    //              owner here, so they are fixed too.
+
+    memset(owners, 0xff, NUM_BLOCKS * sizeof(int32_t));
+
+    for (int d = 0; d < NUM_FILES; d++)
+    {
+        if (!fs->directory_ptr[d].in_use)
+        {
+            continue;
+        }
+
+        int32_t inode_index = fs->directory_ptr[d].inode;
+
+        for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+        {
+            int32_t block = fs->inode_ptr[inode_index].blocks[i];
+
+            if (block == -1)
+            {
+                continue;
+            }
+
+            owners[block] = fs->block_refs[block] ? DEFRAG_FIXED : inode_index * MAX_BLOCKS_PER_FILE + i;
+        }
+    }
+}
+
+// Moves a block to a free block and points its owner at the copy.
+static int moveBlock(struct mfs *fs, int32_t *owners, int32_t from, int32_t to)
+{
+    // Input: struct mfs *fs - The image, with image_lock held exclusively.
+    //        int32_t *owners - The owner map, updated for both blocks.
+    //        int32_t from - A block a single file owns.
+    //        int32_t to - A free block.
+    // Output: int. MFS_OK, or MFS_EIO if the block cache could not read
+    //         either block, leaving both where they were.
+
+    int32_t owner = owners[from];
+    uint8_t *data = getBlock(fs, to);
+    uint8_t *source = data == NULL ? NULL : getBlock(fs, from);
+
+    if (source == NULL)
+    {
+        if (data != NULL)
+        {
+            putBlock(fs, to, 0);
+        }
+        return MFS_EIO;
+    }
+
+    memcpy(data, source, BLOCK_SIZE);
+    putBlock(fs, to, 1);
+    putBlock(fs, from, 0);
+
+    fs->inode_ptr[owner / MAX_BLOCKS_PER_FILE].blocks[owner % MAX_BLOCKS_PER_FILE] = to;
+    fs->free_blocks[to] = 0;
+    fs->free_blocks[from] = 1;
+    owners[to] = owner;
+    owners[from] = -1;
+
+    return MFS_OK;
+}
+
+// Places one file's blocks in order from progress->dest.
+static int defragFile(struct mfs *fs, int32_t *owners, int32_t inode_index, int whole_image,
+                      struct mfs_defrag *progress, int *batch, double deadline)
+{
+    // Input: struct mfs *fs - The image, with image_lock held exclusively.
+    //        int32_t *owners - The owner map.
+    //        int32_t inode_index - The file.
+    //        int whole_image - 1 when compacting the image, which leaves
+    //                          blocks already below progress->dest alone.
+    //        struct mfs_defrag *progress - position and dest say where to
+    //                                      continue, and are moved on.
+    //        int *batch - Moves left before the lock is given up.
+    //        double deadline - CLOCK_MONOTONIC seconds to stop at, or 0.
+    // Output: int. 1 when the file is done, 0 to stop for now,
+    //         MFS_ENOSPC if there is no free block to move one out of the
+    //         way, or MFS_EIO if the block cache could not read a block.
+    // Description: A block at dest that belongs to another file, or to a
+    //              later position of this one, is moved out of the way to
+    //              the highest free block. Fixed blocks stay, and dest
+    //              steps over them.
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    for (; progress->position < MAX_BLOCKS_PER_FILE; progress->position++)
+    {
+        int32_t block = inode->blocks[progress->position];
+
+        if (block == -1 || owners[block] == DEFRAG_FIXED)
+        {
+            continue;
+        }
+
+        while (progress->dest < NUM_BLOCKS && progress->dest != block &&
+               !fs->free_blocks[progress->dest] && owners[progress->dest] < 0)
+        {
+            progress->dest++;
+        }
+
+        if (progress->dest >= NUM_BLOCKS || (whole_image && block < progress->dest))
+        {
+            continue;
+        }
+
+        if (block == progress->dest)
+        {
+            progress->dest++;
+            continue;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (*batch <= 0 ||
+            (progress->max_blocks && progress->moved >= progress->max_blocks) ||
+            (deadline && now.tv_sec + now.tv_nsec / 1e9 >= deadline) ||
+            (progress->interrupt != NULL && *progress->interrupt))
+        {
+            return 0;
+        }
+
+        if (!fs->free_blocks[progress->dest])
+        {
+            int32_t spare = NUM_BLOCKS - 1;
+
+            while (spare > progress->dest && !fs->free_blocks[spare])
+            {
+                spare--;
+            }
+
+            if (spare <= progress->dest)
+            {
+                return MFS_ENOSPC;
+            }
+
+            if (moveBlock(fs, owners, progress->dest, spare) != MFS_OK)
+            {
+                return MFS_EIO;
+            }
+            progress->evicted++;
+            progress->moved++;
+            (*batch)--;
+        }
+
+        if (moveBlock(fs, owners, block, progress->dest) != MFS_OK)
+        {
+            return MFS_EIO;
+        }
+        progress->moved++;
+        progress->dest++;
+        (*batch)--;
+    }
+
+    return 1;
+}
+
+// Finds the first free run of at least length blocks.
+static int32_t findFreeRun(struct mfs *fs, int32_t length)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t length - Blocks wanted.
+    // Output: int32_t. The first block of the run, or -1 if there is none.
+
+    int32_t start = FIRST_DATA_BLOCK;
+
+    for (int32_t block = FIRST_DATA_BLOCK; block < NUM_BLOCKS; block++)
+    {
+        if (!fs->free_blocks[block])
+        {
+            start = block + 1;
+        }
+        else if (block - start + 1 >= length)
+        {
+            return start;
+        }
+    }
+
+    return -1;
+}
+
+// Moves files' blocks into contiguous runs.
+int mfs_defrag(struct mfs *fs, const char *name, struct mfs_defrag *progress)
+{
+    // Input: struct mfs *fs - The image.
+    //        const char *name - The file to defragment, or NULL to compact
+    //                           the whole image.
+    //        struct mfs_defrag *progress - Zeroed to start, apart from the
+    //                                      budget and interrupt fields, and
+    //                                      passed back unchanged to resume.
+    // Output: int. MFS_OK, with progress->done set once finished, or an
+    //         error code.
+    // Description: Compacting the image goes through the directory in
+    //              order and lays each file's blocks out from the start of
+    //              the data region, moving whatever is in the way to the
+    //              end. Defragmenting one file moves it into the first free
+    //              run that holds it. Either way each block is copied, then
+    //              the inode and free block map are updated, so the image is
+    //              consistent after every move. The image is locked for
+    //              DEFRAG_BATCH moves at a time and other calls run in
+    //              between. The call returns early once max_blocks blocks
+    //              are moved, max_seconds pass or *interrupt is set.
+
+    if (progress->done)
+    {
+        return MFS_OK;
+    }
+
+    int32_t *owners = malloc(NUM_BLOCKS * sizeof(int32_t));
+
+    if (owners == NULL)
+    {
+        return MFS_ENOMEM;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    double deadline = progress->max_seconds > 0 ? start.tv_sec + start.tv_nsec / 1e9 + progress->max_seconds : 0;
+    int ret = MFS_OK;
+
+    progress->moved = 0;
+    progress->evicted = 0;
+
+    while (!progress->done && ret == MFS_OK)
+    {
+        int batch = DEFRAG_BATCH;
+        int finished = 1;
+
+        lockExclusive(fs, &fs->image_lock);
+        TRACE_BEGIN("io", "defrag");
+        defragOwners(fs, owners);
+
+        if (name != NULL)
+        {
+            int32_t inode_index = findFile(fs, name);
+
+            if (inode_index < 0)
+            {
+                ret = inode_index;
+            }
+            else if (progress->dest == 0)
+            {
+                struct mfs_fragfile info;
+                int32_t movable = 0;
+
+                fragInode(fs, inode_index, &info);
+
+                // Fixed blocks stay where they are, so only the rest need room.
+                for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+                {
+                    int32_t block = fs->inode_ptr[inode_index].blocks[i];
+                    movable += block != -1 && owners[block] != DEFRAG_FIXED;
+                }
+
+                if (info.runs <= 1)
+                {
+                    finished = 1;
+                }
+                else if ((progress->dest = findFreeRun(fs, movable)) == -1)
+                {
+                    progress->dest = 0;
+                    ret = MFS_ENOSPC;
+                }
+            }
+
+            if (ret == MFS_OK && progress->dest != 0)
+            {
+                finished = defragFile(fs, owners, inode_index, 0, progress, &batch, deadline);
+            }
+        }
+        else
+        {
+            if (progress->dest == 0)
+            {
+                progress->dest = FIRST_DATA_BLOCK;
+            }
+
+            for (; progress->entry < NUM_FILES; progress->entry++, progress->position = 0)
+            {
+                if (!fs->directory_ptr[progress->entry].in_use)
+                {
+                    continue;
+                }
+
+                finished = defragFile(fs, owners, fs->directory_ptr[progress->entry].inode, 1,
+                                      progress, &batch, deadline);
+
+                if (finished != 1)
+                {
+                    break;
+                }
+            }
+        }
+
+        TRACE_END("io", "defrag");
+        releaseLock(fs, &fs->image_lock);
+
+        if (finished < 0)
+        {
+            ret = finished;
+        }
+        else if (finished == 1 && ret == MFS_OK)
+        {
+            progress->done = 1;
+        }
+        else if (batch > 0)
+        {
+            // Stopped by the budget or an interrupt rather than the batch.
+            break;
+        }
+    }
+
+    free(owners);
+
+    return ret;
+}
+
+// Picks a thread count for a parallel pass.
+static int workerThreads(int items, int threshold)
+{
+    // Input: int items - Amount of work, in blocks.
+    //        int threshold - Below this much work a single thread is used.
+    // Output: int. Online CPUs, clamped to [1, MAX_WORKER_THREADS].
+
+    if (items < threshold)
+    {
+        return 1;
+    }
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads > MAX_WORKER_THREADS)
+    {
+        threads = MAX_WORKER_THREADS;
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    return threads;
+}
+
+// Verifies a key against an encrypted file.
+static int checkKey(struct mfs *fs, int32_t inode_index, const uint8_t *key)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The file's inode.
+    //        const uint8_t *key - The 256-bit ChaCha20 key to check.
+    // Output: int. MFS_OK if key decrypts the file, MFS_ENOTENCRYPTED or
+    //         MFS_EKEY otherwise.
+    // Description: Compares the key check value stored at encryption time
+    //              with one derived from key.
+
+    struct inode *inode = &fs->inode_ptr[inode_index];
+
+    if (!(inode->attribute & ENCRYPTED))
+    {
+        return MFS_ENOTENCRYPTED;
+    }
+
+    if (keyCheck(key, inode->nonce) != inode->key_check)
+    {
+        return MFS_EKEY;
+    }
+
+    return MFS_OK;
+}
+
+struct decryptJob
+{
+    struct mfs *fs;
+    int32_t inode_index;
+    const uint8_t *key;
+    uint8_t *buffer;
+    int first_pos;
+    int count;
+    int ret;                // MFS_OK, or MFS_EIO if a block could not be read
+};
+
+// Thread body for decryptBlocks().
+static void *decryptWorker(void *arg)
+{
+    struct decryptJob *job = (struct decryptJob *)arg;
+    struct inode *inode = &job->fs->inode_ptr[job->inode_index];
+
+    TRACE_BEGIN("cipher", "decryptBlocks");
+
+    for (int i = 0; i < job->count; i++)
+    {
+        int block_pos = job->first_pos + i;
+        uint8_t *out = job->buffer + (size_t)i * BLOCK_SIZE;
+
+        // Holes were never encrypted and read back as zeros.
+        if (inode->blocks[block_pos] == -1)
+        {
+            memset(out, 0, BLOCK_SIZE);
+            continue;
+        }
+
+        uint8_t *data = getBlock(job->fs, inode->blocks[block_pos]);
+
+        if (data == NULL)
+        {
+            job->ret = MFS_EIO;
+            break;
+        }
+
+        memcpy(out, data, BLOCK_SIZE);
+        putBlock(job->fs, inode->blocks[block_pos], 0);
+        chacha20Xor(out, BLOCK_SIZE, job->key, inode->nonce, block_pos);
+    }
+
+    TRACE_END("cipher", "decryptBlocks");
+
+    return NULL;
+}
+
+// Copies and decrypts a run of a file's blocks into buffer.
+static int decryptBlocks(struct mfs *fs, int32_t inode_index, const uint8_t *key, uint8_t *buffer, int first_pos, int count)
+{
+    // Input: struct mfs *fs - The image.
+    //        int32_t inode_index - The encrypted file's inode.
+    //        const uint8_t *key - The 256-bit ChaCha20 key.
+    //        uint8_t *buffer - Receives count * BLOCK_SIZE plaintext bytes.
+    //        int first_pos - Position in the file of the first block.
+    //        int count - Number of blocks to decrypt.
+    // Output: int. MFS_OK, or MFS_EIO if the block cache could not read a block.
+    // Description: Blocks are independent in counter mode, so large runs are
+    //              split into contiguous ranges and decrypted by up to
+    //              MAX_WORKER_THREADS threads, one range per thread.
+
+    int threads = workerThreads(count, PARALLEL_DECRYPT_BLOCKS);
+
+    struct decryptJob jobs[MAX_WORKER_THREADS];
+    pthread_t tids[MAX_WORKER_THREADS];
+    int spawned[MAX_WORKER_THREADS] = { 0 };
+    int per_thread = (count + threads - 1) / threads;
+    int started = 0;
+
+    for (int t = 0; t < threads; t++)
+    {
+        int first = t * per_thread;
+        int n = count - first < per_thread ? count - first : per_thread;
+
+        if (n <= 0)
+        {
+            break;
+        }
+
+        jobs[t].fs = fs;
+        jobs[t].inode_index = inode_index;
+        jobs[t].key = key;
+        jobs[t].buffer = buffer + (size_t)first * BLOCK_SIZE;
+        jobs[t].first_pos = first_pos + first;
+        jobs[t].count = n;
+        jobs[t].ret = MFS_OK;
+
+        // The first range runs on the calling thread.
+        if (t > 0 && pthread_create(&tids[t], NULL, decryptWorker, &jobs[t]) == 0)
+        {
+            spawned[t] = 1;
+        }
+        else
+        {
+            decryptWorker(&jobs[t]);
+        }
+        started++;
+    }
+
+    for (int t = 1; t < started; t++)
+    {
+        if (spawned[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+    }
+
+    int ret = MFS_OK;
+
+    for (int t = 0; t < started; t++)
+    {
+        if (jobs[t].ret != MFS_OK)
+        {
+            ret = jobs[t].ret;
+        }
+    }
+
+    return ret;
+}
+
+// Derives the value stored in inode.key_check.
+static uint64_t keyCheck(const uint8_t *key, uint64_t nonce)
+{
+    // Input: const uint8_t *key - The 256-bit ChaCha20 key.
+    //        uint64_t nonce - The file's nonce.
+    // Output: uint64_t. The first 8 keystream bytes at KEY_CHECK_BLOCK.
+
+    uint64_t check = 0;
+    chacha20Xor((uint8_t *)&check, sizeof(check), key, nonce, KEY_CHECK_BLOCK);
+    return check;
+}
+
+#if MFS_STATS
+// Monotonic time in nanoseconds, for the statistics.
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+// Generates a per-file nonce.
+static uint64_t randomNonce()
+{
+    // Input: None.
+    // Output: uint64_t. 8 bytes from /dev/urandom, or a time based value
+    //         if /dev/urandom can not be read.
+
+    uint64_t nonce = 0;
+    FILE *fp = fopen("/dev/urandom", "rb");
+
+    if (fp == NULL || fread(&nonce, sizeof(nonce), 1, fp) != 1)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        nonce = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+    }
+
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+
+    return nonce;
+}
+
+// Describes an error code.
+const char *mfs_strerror(int err)
+{
+    switch (err)
+    {
+        case MFS_OK:            return "Success";
+        case MFS_ENOENT:        return "File not found in directory";
+        case MFS_EEXIST:        return "File already exists";
+        case MFS_ENOSPC:        return "Not enough free disk space";
+        case MFS_ENOINODE:      return "Can not find a free inode";
+        case MFS_ENODIR:        return "Could not find a free directory entry";
+        case MFS_EFBIG:         return "File is too large";
+        case MFS_ENAMETOOLONG:  return "Only supports names of up to 63 characters";
+        case MFS_EINVAL:        return "Invalid argument";
+        case MFS_EREADONLY:     return "The file is marked read-only";
+        case MFS_EENCRYPTED:    return "The file is encrypted";
+        case MFS_ENOTENCRYPTED: return "File is not encrypted";
+        case MFS_EKEY:          return "Invalid key";
+        case MFS_ECHECKSUM:     return "Checksum mismatch";
+        case MFS_EIO:           return "Could not read or write the disk image";
+        case MFS_ETRUNCATED:    return "Disk image is truncated";
+        case MFS_ENOMEM:        return "Out of memory";
+        case MFS_ENOTDELETED:   return "File is not deleted";
+        case MFS_EOVERWRITTEN:  return "File data has been overwritten";
+        case MFS_ENOSNAP:       return "Snapshot not found";
+        case MFS_ESNAPFULL:     return "Snapshot table is full";
+        case MFS_ESTALE:        return "Image was changed by another process";
+        case MFS_ECORRUPT:      return "Image is inconsistent";
+    }
+
+    return "Unknown error";
+}
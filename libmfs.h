@@ -0,0 +1,284 @@
+#ifndef LIBMFS_H
+#define LIBMFS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// libmfs: the filesystem image behind the mfs shell, usable in-process.
+//
+// Every call takes the handle returned by mfs_create() or mfs_open(). Calls
+// that can fail return MFS_OK (0) or one of the negative MFS_E* codes below;
+// mfs_strerror() turns a code into a message. Nothing is printed.
+//
+// A handle may be used from several threads at once, except mfs_close().
+// Several processes may work on one image at once if each opens it with
+// MFS_SHARED.
+//
+// Every image has the same geometry: 65536 blocks of MFS_BLOCK_SIZE bytes,
+// 64 MiB. Opening an image with a block cache limits how much of it is held
+// in memory; it does not allow images larger than that. Larger images need
+// the geometry stored in the image header, see Limitations in README.md.
+
+#define MFS_BLOCK_SIZE 1024
+#define MFS_MAX_FILE_SIZE 1048576
+#define MFS_MAX_FILES 256
+#define MFS_NAME_MAX 63             // Longest file or snapshot name
+#define MFS_KEY_SIZE 32             // ChaCha20 key bytes
+#define MFS_MIN_CACHE_BLOCKS 64     // Smallest cache mfs_open() accepts
+#define MFS_SHARED -1               // mfs_open() cache_blocks: map the image shared
+
+// Pages for the memory of images created or opened later, see
+// mfs_set_hugepages(). Huge pages cut TLB misses when whole-image passes
+// such as scrub and fsck sweep 64 MiB.
+#define MFS_PAGES_SMALL 0           // Base pages, 4 KiB on x86
+#define MFS_PAGES_TRANSPARENT 1     // Transparent huge pages, the default
+#define MFS_PAGES_EXPLICIT 2        // Reserved huge pages, else transparent ones
+
+// File attributes, see mfs_setattr().
+#define MFS_READONLY 0x01
+#define MFS_HIDDEN 0x02
+#define MFS_ENCRYPTED 0x04
+
+// Statistics are compiled in unless MFS_STATS is defined as 0 when building
+// the library, as make STATS=0 does. Without them mfs_stats() reports zeros.
+#ifndef MFS_STATS
+#define MFS_STATS 1
+#endif
+
+// Offset for mfs_write() that appends to the end of the file.
+#define MFS_APPEND -1
+
+// Error codes.
+#define MFS_OK 0
+#define MFS_ENOENT -1           // File not found
+#define MFS_EEXIST -2           // Name already in use
+#define MFS_ENOSPC -3           // Not enough free blocks
+#define MFS_ENOINODE -4         // No free inode
+#define MFS_ENODIR -5           // No free directory entry
+#define MFS_EFBIG -6            // Larger than MFS_MAX_FILE_SIZE
+#define MFS_ENAMETOOLONG -7     // Longer than MFS_NAME_MAX
+#define MFS_EINVAL -8           // Bad offset, size or argument
+#define MFS_EREADONLY -9        // File is marked read-only
+#define MFS_EENCRYPTED -10      // Operation not possible on an encrypted file
+#define MFS_ENOTENCRYPTED -11   // File is not encrypted
+#define MFS_EKEY -12            // Wrong key for the file
+#define MFS_ECHECKSUM -13       // A block failed its CRC32C check
+#define MFS_EIO -14             // Image file could not be read or written
+#define MFS_ETRUNCATED -15      // Image file is shorter than the image
+#define MFS_ENOMEM -16          // Out of memory
+#define MFS_ENOTDELETED -17     // undelete of a file that is not deleted
+#define MFS_EOVERWRITTEN -18    // undelete of a file whose blocks were reused
+#define MFS_ENOSNAP -19         // Snapshot not found
+#define MFS_ESNAPFULL -20       // Snapshot table is full
+#define MFS_ESTALE -21          // Image was changed by another process
+#define MFS_ECORRUPT -22        // fsck found problems it did not repair
+
+struct mfs;
+
+struct mfs_stat
+{
+    uint32_t size;          // Bytes
+    time_t date;            // Last modification
+    uint8_t attribute;      // MFS_READONLY | MFS_HIDDEN | MFS_ENCRYPTED
+    int32_t blocks;         // Data blocks mapped, holes excluded
+    int32_t shared;         // Of those, blocks shared with a clone or snapshot
+};
+
+struct mfs_dirent
+{
+    char name[MFS_NAME_MAX + 1];
+    struct mfs_stat st;
+};
+
+struct mfs_snapinfo
+{
+    char name[MFS_NAME_MAX + 1];
+    time_t date;
+};
+
+// One file of an mfs_insert_batch().
+struct mfs_file
+{
+    const char *name;
+    const void *data;
+    uint32_t size;
+    int result;             // Set to MFS_OK or an error code
+};
+
+#define MFS_SCRUB_REPORTED 16
+
+struct mfs_scrub
+{
+    int32_t checked;        // Allocated blocks checked
+    int32_t errors;         // Blocks that failed their checksum
+    int threads;
+    double seconds;
+    int32_t reported;       // Entries used in bad_blocks[] and owners[]
+    int32_t bad_blocks[MFS_SCRUB_REPORTED];
+    char owners[MFS_SCRUB_REPORTED][MFS_NAME_MAX + 1];   // "" if unowned
+};
+
+#define MFS_FSCK_REPORTED 16
+
+// What mfs_fsck() found. Each count is of problems, repaired or not.
+struct mfs_fsck
+{
+    int32_t files;              // Files in the directory
+    int32_t blocks;             // Data blocks owned by files and snapshots
+    int32_t bad_entries;        // Entries naming a bad or already named inode, or a name twice
+    int32_t bad_inodes;         // Inodes whose use disagrees with the directory or free inode map
+    int32_t bad_block_lists;    // Block lists with blocks outside the data region or past the size
+    int32_t leaked_blocks;      // Allocated blocks nothing owns
+    int32_t lost_blocks;        // Owned blocks marked free
+    int32_t double_allocated;   // Blocks with more owners than references
+    int32_t extra_refs;         // Blocks with more references than owners
+    int32_t problems;
+    int32_t repaired;
+    int threads;
+    double seconds;
+    int32_t reported;           // Entries used in messages[]
+    char messages[MFS_FSCK_REPORTED][96];
+};
+
+// Free runs are counted in MFS_FRAG_BUCKETS buckets by size: 1 block,
+// 2-3, 4-7 and so on up to the whole data region.
+#define MFS_FRAG_BUCKETS 17
+
+// Layout of one file, see mfs_frag_file().
+struct mfs_fragfile
+{
+    int32_t blocks;             // Blocks the file lists, holes not counted
+    int32_t runs;               // Runs of physically consecutive blocks
+    uint32_t slack;             // Unused bytes at the end of the last block
+};
+
+// Layout of the whole image, see mfs_frag().
+struct mfs_frag
+{
+    int32_t files;
+    int32_t file_blocks;        // Blocks the files list, shared ones once per file
+    int32_t runs;               // Runs over every file
+    int32_t fragmented_files;   // Files in more than one run
+    uint64_t slack;             // Unused bytes at the end of last blocks
+    int32_t data_blocks;        // Blocks in the data region
+    int32_t free_blocks;
+    int32_t free_runs;
+    int32_t largest_free_run;
+    int32_t free_run_sizes[MFS_FRAG_BUCKETS];   // Free runs by size bucket
+    int32_t inodes_used;
+    int32_t entries_used;       // Directory entries naming a file
+    int32_t entries_deleted;    // Entries still holding a deleted file's name
+};
+
+// Where a defrag got to and what it may do, see mfs_defrag(). Zero it to
+// start, set the limits and pass it back unchanged to carry on.
+struct mfs_defrag
+{
+    int32_t entry;              // Directory entry to continue at
+    int32_t position;           // Block position in that file
+    int32_t dest;               // Next block of the compacted region, 0 to start
+    int32_t max_blocks;         // Moves allowed per call, 0 for no limit
+    double max_seconds;         // Time allowed per call, 0 for no limit
+    const volatile int *interrupt;  // Stops the call when nonzero, may be NULL
+    int32_t moved;              // Blocks moved by the last call
+    int32_t evicted;            // Of those, blocks moved out of the way
+    int done;
+};
+
+struct mfs_cache_stats
+{
+    int capacity;           // 0 when the whole image is resident
+    uint64_t memory_bytes;  // Image memory allocated or mapped
+    int pages;              // MFS_PAGES_* the memory was allocated with
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;    // Dirty blocks evicted to the spill file
+    uint64_t io_errors;
+};
+
+// Log-linear latency histogram: 8 buckets per power of two nanoseconds, so
+// a percentile is within 12.5% of the true value. Times past 2^40 ns (18
+// minutes) go in the last bucket.
+#define MFS_HIST_SUB_BITS 3
+#define MFS_HIST_BUCKETS ((40 - MFS_HIST_SUB_BITS + 2) << MFS_HIST_SUB_BITS)
+
+struct mfs_histogram
+{
+    uint64_t count;
+    uint64_t max_ns;
+    uint64_t buckets[MFS_HIST_BUCKETS];
+};
+
+// Counters for one open image since it was opened or last reset.
+struct mfs_stats
+{
+    uint64_t bytes_written;     // File data inserted or written
+    uint64_t bytes_read;        // File data read
+    uint64_t blocks_allocated;
+    uint64_t blocks_freed;
+    uint64_t blocks_scanned;    // Free map entries looked at to allocate blocks
+    uint64_t syscalls;          // Reads, writes, syncs and locks on the image file
+    struct mfs_histogram insert;
+    struct mfs_histogram read;
+    struct mfs_histogram save;
+    struct mfs_histogram open;
+};
+
+// Images.
+int mfs_create(const char *path, struct mfs **fs);
+int mfs_open(const char *path, int cache_blocks, struct mfs **fs);
+int mfs_save(struct mfs *fs);
+void mfs_close(struct mfs *fs);
+uint32_t mfs_df(struct mfs *fs);
+void mfs_set_verify(struct mfs *fs, int on);
+int mfs_set_hugepages(int mode);
+
+// Files.
+int mfs_insert(struct mfs *fs, const char *name, const void *data, uint32_t size, const uint8_t *key);
+int mfs_insert_batch(struct mfs *fs, struct mfs_file *files, int count, const uint8_t *key);
+int mfs_write(struct mfs *fs, const char *name, int32_t offset, const void *data, uint32_t size);
+int mfs_read(struct mfs *fs, const char *name, uint32_t offset, void *buf, uint32_t size, const uint8_t *key);
+int mfs_stat(struct mfs *fs, const char *name, struct mfs_stat *st);
+int mfs_readdir(struct mfs *fs, int *cursor, struct mfs_dirent *entry);
+int mfs_truncate(struct mfs *fs, const char *name, uint32_t size);
+int mfs_clone(struct mfs *fs, const char *source, const char *destination);
+int mfs_unlink(struct mfs *fs, const char *name);
+int mfs_undelete(struct mfs *fs, const char *name);
+int mfs_setattr(struct mfs *fs, const char *name, uint8_t set, uint8_t clear);
+int mfs_xor(struct mfs *fs, const char *name, uint8_t cipher);
+int mfs_encrypt(struct mfs *fs, const char *name, const uint8_t *key);
+int mfs_decrypt(struct mfs *fs, const char *name, const uint8_t *key);
+
+// Snapshots.
+int mfs_snapshot(struct mfs *fs, const char *snap);
+int mfs_snapshot_delete(struct mfs *fs, const char *snap);
+int mfs_snapshot_next(struct mfs *fs, int *cursor, struct mfs_snapinfo *info);
+int mfs_snapshot_stat(struct mfs *fs, const char *snap, const char *name, struct mfs_stat *st);
+int mfs_snapshot_read(struct mfs *fs, const char *snap, const char *name, uint32_t offset, void *buf, uint32_t size);
+int mfs_rollback(struct mfs *fs, const char *snap);
+
+// Integrity and statistics.
+int mfs_scrub(struct mfs *fs, struct mfs_scrub *report);
+int mfs_fsck(struct mfs *fs, int repair, struct mfs_fsck *report);
+int mfs_frag(struct mfs *fs, struct mfs_frag *report);
+int mfs_frag_file(struct mfs *fs, const char *name, struct mfs_fragfile *info);
+int mfs_defrag(struct mfs *fs, const char *name, struct mfs_defrag *progress);
+int mfs_cache_stats(struct mfs *fs, struct mfs_cache_stats *stats);
+int mfs_stats(struct mfs *fs, struct mfs_stats *stats);
+void mfs_stats_reset(struct mfs *fs);
+void mfs_hist_record(struct mfs_histogram *hist, uint64_t ns);
+uint64_t mfs_hist_percentile(const struct mfs_histogram *hist, double percent);
+
+// Tracing. Begin and end events of the library's phases, and any the caller
+// adds, are kept per thread and written as Chrome trace event JSON. Names
+// are not copied, so pass strings that live as long as the process.
+int mfs_trace_enable(int on);
+void mfs_trace_begin(const char *category, const char *name);
+void mfs_trace_end(const char *category, const char *name);
+uint64_t mfs_trace_count();
+int mfs_trace_dump(const char *path);
+void mfs_trace_clear();
+
+const char *mfs_strerror(int err);
+
+#endif
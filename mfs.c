@@ -12,48 +12,34 @@
 #include <signal.h>
 #include <stdint.h>
 #include <time.h>
-
-#define NUM_BLOCKS 65536
-#define BLOCK_SIZE 1024
-#define MAX_BLOCKS_PER_FILE 1024
-#define MAX_FILE_SIZE 1048576
-#define NUM_FILES  256
-
-#define FIRST_DATA_BLOCK 1001 //790 1001
-
-#define READONLY 0x01
-#define HIDDEN 0x02
-
-uint8_t data_blocks[NUM_BLOCKS][BLOCK_SIZE];
-
-uint8_t *free_blocks;
-uint8_t *free_inodes;
-
-// directory
-struct directoryEntry
-{
-    char filename[64];
-    short in_use;
-    int32_t inode;
-};
-
-struct directoryEntry *directory_ptr;
-
-// inode
-struct inode
-{
-    int32_t blocks[MAX_BLOCKS_PER_FILE];
-    short in_use;
-    uint32_t file_size;
-    time_t date;
-    uint8_t attribute;
-};
-
-struct inode *inode_ptr;
-
-FILE *disk_image;       // disk image file pointer
-char image_name[64];    // disk image filename
-uint8_t image_open;
+#include <glob.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <getopt.h>
+#include <ftw.h>
+
+#include "libmfs.h"
+#include "serve.h"
+#include "record.h"
+
+// The shell is a client of libmfs. It parses commands, moves data between
+// host files and the image, and prints what the library returns.
+
+struct mfs *fs;         // The open image, NULL if none
+uint8_t verify_reads;   // Set by the verify command, applied to every image opened
+int page_mode = MFS_PAGES_TRANSPARENT;  // Set by the hugepages command for images opened later
+int defer_save;         // Batch mode -d: savefs only marks the image to be saved
+int save_pending;       // A deferred savefs has not been done yet
+
+// A defrag stopped by its budget or ^C carries on where it left off when
+// run again on the same file, or the whole image, of the same open image.
+struct mfs_defrag defrag_progress;
+char defrag_name[MFS_NAME_MAX + 1];     // Empty for the whole image
+int defrag_resume;
+volatile sig_atomic_t defrag_interrupted;
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
                                 // so we need to define what delimits our tokens.
@@ -62,46 +48,211 @@ uint8_t image_open;
 
 #define MAX_COMMAND_SIZE 255    // The maximum command-line size
 
-#define MAX_NUM_ARGUMENTS 5     // Mav shell only supports four arguments
+#define MAX_NUM_ARGUMENTS 32    // Command plus up to 31 arguments, so insert
+                                // can take many files at once
 
 #define MAX_HISTORY_SIZE 15 // The maximum history size
 
 #define MAX_PID_SIZE 15 // The maximum pids size
 
+#define HOST_IO_THREADS 16      // Threads reading or writing host files for a
+                                // bulk insert or retrieve. They wait on the
+                                // disk rather than the CPU, so this is not
+                                // tied to the CPU count.
+
+#define WRITE_CHUNK (256 * 1024)    // Bytes per iovec when writing host files
+
+// A filesystem command: its name and the function that runs it from the
+// command line's tokens.
+struct command
+{
+    const char *name;
+    void (*run)(char **token, int token_count);
+};
+
 int updateHistory(char history[][MAX_COMMAND_SIZE], int history_index, char *command_string);
 int updatePids(int pids[MAX_PID_SIZE], int pids_index, int pid);
 void trim(char *str);
-
-void init();
-int32_t findFreeBlock();
-int32_t findFreeInode();
-uint32_t df();
-uint32_t searchDirectory(char *filename);
+int tokenize(char *line, char **token);
+const struct command *findCommand(char *name);
+void runCommand(const struct command *command, char **token, int token_count);
+int keyToken(const struct command *command, char **token, int token_count);
+int runBatch(FILE *script, int defer);
+int runReplay(FILE *log, int paced);
+char *replayArgument(char *token);
+int removeScratch(const char *path, const struct stat *sb, int type, struct FTW *ftw);
+void flushSave();
+void cmdCreatefs(char **token, int token_count);
+void cmdSavefs(char **token, int token_count);
+void cmdOpen(char **token, int token_count);
+void cmdClose(char **token, int token_count);
+void cmdList(char **token, int token_count);
+void cmdDf(char **token, int token_count);
+void cmdInsert(char **token, int token_count);
+void cmdWrite(char **token, int token_count);
+void cmdAppend(char **token, int token_count);
+void cmdTruncate(char **token, int token_count);
+void cmdClone(char **token, int token_count);
+void cmdSnapshot(char **token, int token_count);
+void cmdSnapshots(char **token, int token_count);
+void cmdRollback(char **token, int token_count);
+void cmdAttrib(char **token, int token_count);
+void cmdDelete(char **token, int token_count);
+void cmdUndelete(char **token, int token_count);
+void cmdRead(char **token, int token_count);
+void cmdRetrieve(char **token, int token_count);
+void cmdEncrypt(char **token, int token_count);
+void cmdDecrypt(char **token, int token_count);
+void cmdVerify(char **token, int token_count);
+void cmdCache(char **token, int token_count);
+void cmdHugepages(char **token, int token_count);
+void cmdScrub(char **token, int token_count);
+void cmdFsck(char **token, int token_count);
+void cmdFrag(char **token, int token_count);
+void cmdDefrag(char **token, int token_count);
+void cmdStats(char **token, int token_count);
+void cmdTrace(char **token, int token_count);
+
+int report(char *command, int err);
 void createfs(char *filename);
 void savefs();
-void openfs(char *filename);
+void openfs(char *filename, int cache_blocks);
 void closefs();
 void list(char *attrib1, char *attrib2);
-void insert(char *filename);
-void XOR_insert(char *filename);
+void insert(char *filename, uint8_t *key);
+void insertMany(char **args, int count, int manifest, uint8_t *key);
 void attrib(char *attribute, char *filename);
-void delete(char *filename);
-void undelete(char *filename);
-void readFile(char *filename, int start, int num_bytes);
-void retrieve(char *filename, char *new_filename);
-void readFileRetrieve(char *filename, int directory_entry);
-void encrypt(char *filename, char cipher);
-void decrypt(char *filename, char cipher);
+void writeFile(char *command, char *filename, int offset, char *hostfile);
+uint8_t *readHostFile(char *command, char *hostfile, uint32_t *size);
+uint8_t *loadHostFile(char *hostfile, uint32_t *size, const char **error);
+void *hostReadWorker(void *arg);
+int addPath(char ***paths, int count, char *path);
+void freePaths(char **paths, int count);
+void truncateFile(char *filename, int size);
+void listSnapshots();
+void readFile(char *filename, int start, int num_bytes, uint8_t *key);
+void retrieve(char *snapshot, char *filename, char *new_filename, uint8_t *key);
+void retrieveAll(char *directory, char *pattern);
+void *hostWriteWorker(void *arg);
+int writeHostFile(char *path, uint8_t *data, uint32_t size);
+int hostPath(char *path, size_t size, char *directory, char *name);
+void cacheStats();
+void printStats();
+void printLatency(const char *name, const struct mfs_histogram *hist);
+char *formatNs(uint64_t ns, char *buf);
+void scrub();
+void fsck(int repair);
+void frag(char *filename);
+void defrag(char *filename, int max_blocks, double max_seconds);
+void onDefragInterrupt(int sig);
+int hex_to_key(char *hex, uint8_t *key);
 uint8_t hex_to_byte(char *hex);
 
-int main() 
+int main(int argc, char *argv[])
 {
-    init();
+    // mfs -f <script> and mfs -b run commands from a file or stdin without
+    // a prompt. -d with either defers savefs to the end of the script.
+    // mfs --serve <socket> [-c blocks | --shared] <image> serves the image
+    // to local clients until interrupted. --record <log> logs the commands
+    // run, and mfs --replay <log> [--paced] runs them again.
+    static const struct option long_options[] =
+    {
+        { "serve", required_argument, NULL, 's' },
+        { "shared", no_argument, NULL, 'S' },
+        { "record", required_argument, NULL, 'r' },
+        { "replay", required_argument, NULL, 'R' },
+        { "paced", no_argument, NULL, 'p' },
+        { NULL, 0, NULL, 0 }
+    };
+    FILE *script = NULL;
+    FILE *replay_log = NULL;
+    int paced = 0;
+    char *socket_path = NULL;
+    int cache_blocks = 0;
+    int defer = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "f:bdc:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'S':
+                cache_blocks = MFS_SHARED;
+                break;
+            case 'c':
+                cache_blocks = atoi(optarg);
+                if (cache_blocks < MFS_MIN_CACHE_BLOCKS)
+                {
+                    printf("mfs: Cache size must be at least %d blocks.\n", MFS_MIN_CACHE_BLOCKS);
+                    return 1;
+                }
+                break;
+            case 'f':
+                script = fopen(optarg, "r");
+                if (script == NULL)
+                {
+                    printf("mfs: Can not open %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                script = stdin;
+                break;
+            case 'd':
+                defer = 1;
+                break;
+            case 'r':
+                if (recordOpen(optarg) == -1)
+                {
+                    printf("mfs: Can not create %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                replay_log = fopen(optarg, "r");
+                if (replay_log == NULL)
+                {
+                    printf("mfs: Can not open %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                paced = 1;
+                break;
+            default:
+                printf("Usage: mfs [-f script | -b] [-d] [--record log]\n"
+                       "       mfs --replay <log> [--paced] [--record log]\n"
+                       "       mfs --serve <socket> [-c blocks | --shared] <image>\n");
+                return 1;
+        }
+    }
+
+    if (socket_path != NULL)
+    {
+        if (optind >= argc)
+        {
+            printf("mfs: No image specified.\n");
+            return 1;
+        }
+
+        return serve(socket_path, argv[optind], cache_blocks);
+    }
+
+    if (replay_log != NULL)
+    {
+        return runReplay(replay_log, paced);
+    }
+
+    if (script != NULL)
+    {
+        return runBatch(script, defer);
+    }
 
     char *command_string = (char*) malloc(MAX_COMMAND_SIZE);
 
-    disk_image = NULL;
-    
     char history[MAX_HISTORY_SIZE][MAX_COMMAND_SIZE] = { 0 };
     int history_index = 0;
 
@@ -157,37 +308,15 @@ int main()
         }
 
         /* Parse input */
-        char *token[MAX_NUM_ARGUMENTS];
-
-        for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
-        {
-            token[i] = NULL;
-        }
-
-        int token_count = 0;                                 
-                                                            
-        // Pointer to point to the token
-        // parsed by strsep
-        char *argument_ptr = NULL;                                         
-                                                            
-        char *working_string = strdup(command_string);                
+        // The tokens point into line, a copy of the command, so history
+        // keeps the command as typed and nothing is allocated.
+        char line[MAX_COMMAND_SIZE];
+        char *token[MAX_NUM_ARGUMENTS + 1];
 
-        // we are going to move the working_string pointer so
-        // keep track of its original value so we can deallocate
-        // the correct amount at the end
-        char *head_ptr = working_string;
+        strcpy(line, command_string);
 
-        // Tokenize the input strings with whitespace used as the delimiter
-        while ( ( (argument_ptr = strsep(&working_string, WHITESPACE ) ) != NULL) && 
-                (token_count < MAX_NUM_ARGUMENTS))
-        {
-            token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
-            if (strlen(token[token_count]) == 0)
-            {
-                token[token_count] = NULL;
-            }
-            token_count++;
-        }
+        int token_count = tokenize(line, token);
+        const struct command *command;
 
         // Continue if user inputs enters a blank line.
         if (token[0] == NULL)
@@ -246,287 +375,10 @@ int main()
             }
         }
 
-        // If "createfs" command is invoked.
-        else if (strcmp("createfs", token[0]) == 0)
-        {
-            if (token[1] == NULL)
-            {
-                printf("createfs: No filename specified.\n");
-                continue;
-            }
-            
-            createfs(token[1]);
-        }
-
-        // If "savefs" command is invoked.
-        else if (strcmp("savefs", token[0]) == 0)
-        {
-            savefs();
-        }
-
-        // If "open" command is invoked.
-        else if (strcmp("open", token[0]) == 0)
-        {
-            if (token[1] == NULL)
-            {
-                printf("open: No filename specified.\n");
-                continue;
-            }
-            
-            openfs(token[1]);
-        }
-
-        // If "close" command is invoked.
-        else if (strcmp("close", token[0]) == 0)
-        {
-            closefs();
-        }
-
-        // If "list" command is invoked.
-        else if (strcmp("list", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("list: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] != NULL && token[2] != NULL)
-            {
-                if (strcmp(token[1], "-h") == 0 || strcmp(token[1], "-a") == 0)
-                {
-                    if (strcmp(token[2], "-h") == 0 || strcmp(token[2], "-a") == 0)
-                    {
-                        list(token[1], token[2]);
-                    }
-                    else
-                    {
-                        printf("list: Invalid parameter.\n");
-                        continue;
-                    }
-                }
-                else
-                {
-                    printf("list: Invalid parameter.\n");
-                    continue;
-                }
-            }
-            else if (token[1] != NULL)
-            {
-                if (strcmp(token[1], "-h") == 0 || strcmp(token[1], "-a") == 0)
-                {
-                    list(token[1], token[2]);
-                }
-                else
-                {
-                    printf("list: Invalid parameter.\n");
-                    continue;
-                }
-            }
-            else
-            {
-                list(token[1], token[2]);
-            }
-        }
-
-        // If "df" command is invoked.
-        else if (strcmp("df", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("df: Disk image is not open.\n");
-                continue;
-            }
-            
-            printf("%d bytes free.\n", df());
-        }
-
-        // If "insert" command is invoked.
-        else if (strcmp("insert", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("insert: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("insert: No filename specified.\n");
-                continue;
-            }
-            
-            insert(token[1]);
-        }
-
-        // If "attrib" command is invoked.
-        else if (strcmp("attrib", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("attrib: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("attrib: No attribute specified.\n");
-                continue;
-            }
-
-            if (token[2] == NULL)
-            {
-                printf("attrib: No filename specified.\n");
-                continue;
-            }
-
-            attrib(token[1], token[2]);
-        }
-
-        // If "delete" command is invoked.
-        else if (strcmp("delete", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("delete: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("delete: No filename specified.\n");
-                continue;
-            }
-
-            delete(token[1]);
-        }
-
-        // If "undelete" command is invoked.
-        else if (strcmp("undelete", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("undelete: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("undelete: No filename specified.\n");
-                continue;
-            }
-
-            undelete(token[1]);
-        }
-
-        // If "read" command is invoked.
-        else if (strcmp("read", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("read: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("read: No filename specified.\n");
-                continue;
-            }
-            else if (token[2] == NULL)
-            {
-                printf("read: No starting byte specified.\n");
-                continue;
-            }
-            else if (token[3] == NULL)
-            {
-                printf("read: No number of bytes specified.\n");
-                continue;
-            }
-
-            readFile(token[1], atoi(token[2]), atoi(token[3]));
-        }
-
-        // If "retrieve" command is invoked.
-        else if (strcmp("retrieve", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("retrieve: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("retrieve: No filename specified.\n");
-                continue;
-            }
-
-            retrieve(token[1], token[2]);
-        }
-
-        // If "encrypt" command is invoked.
-        else if (strcmp("encrypt", token[0]) == 0)
-        {
-            if (image_open == 0)
-            {
-                printf("encrypt: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("encrypt: No filename specified.\n");
-                continue;
-            }
-
-            if (token[2] == NULL)
-            {
-                printf("encrypt: No cipher specified.\n");
-                continue;
-            }
-
-            uint8_t hex = hex_to_byte(token[2]);
-
-            if (hex == -1)
-            {
-                printf("encrypt: Invalid cipher.\n");
-                continue;
-            }
-
-            encrypt(token[1], hex);
-        }
-
-        // If "decrypt" command is invoked.
-        else if (strcmp("decrypt", token[0]) == 0)
+        // Filesystem commands.
+        else if ((command = findCommand(token[0])) != NULL)
         {
-            if (image_open == 0)
-            {
-                printf("decrypt: Disk image is not open.\n");
-                continue;
-            }
-
-            if (token[1] == NULL)
-            {
-                printf("decrypt: No filename specified.\n");
-                continue;
-            }
-
-            if (token[2] == NULL)
-            {
-                printf("decrypt: No cipher specified.\n");
-                continue;
-            }
-            
-            uint8_t hex = hex_to_byte(token[2]);
-
-            if (hex == -1)
-            {
-                printf("decrypt: Invalid cipher.\n");
-                continue;
-            }
-
-            decrypt(token[1], hex);
+            runCommand(command, token, token_count);
         }
 
         // Fork calls for UNIX commands.
@@ -570,16 +422,6 @@ int main()
             }
         }
 
-        // Cleanup allocated memory
-        for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
-        {
-            if (token[i] != NULL)
-            {
-                free(token[i]);
-            }
-        }
-
-        free(head_ptr);
     }
 
     free(command_string);
@@ -587,1300 +429,2783 @@ int main()
     return 0;
 }
 
-// Updates history array with 15 most recent commands.
-int updateHistory(char history[][MAX_COMMAND_SIZE], int history_index, char *command_string)
+// Splits a command line into tokens in place.
+int tokenize(char *line, char **token)
 {
-    // If history is full, pop first command and push new command.
-    // Reorder history array.
-    if (history_index == MAX_HISTORY_SIZE)
-    {  
-        for (int i = 0; i < MAX_HISTORY_SIZE - 1; i++)
+    // Input: char *line - The command. Whitespace in it is overwritten.
+    //        char **token - Receives up to MAX_NUM_ARGUMENTS tokens, then NULL
+    //                       in every entry up to MAX_NUM_ARGUMENTS.
+    // Output: int. Number of tokens.
+    // Description: Runs of whitespace separate tokens, so there are no empty
+    //              tokens. The tokens point into line and nothing is
+    //              allocated. Words past MAX_NUM_ARGUMENTS are ignored.
+
+    int token_count = 0;
+    char *c = line;
+
+    while (token_count < MAX_NUM_ARGUMENTS)
+    {
+        c += strspn(c, WHITESPACE);
+
+        if (*c == '\0')
         {
-            strcpy(history[i], history[i+1]);
+            break;
+        }
+
+        token[token_count++] = c;
+        c += strcspn(c, WHITESPACE);
+
+        if (*c != '\0')
+        {
+            *c++ = '\0';
         }
-        strcpy(history[MAX_HISTORY_SIZE-1], command_string);
     }
 
-    // If history is not full, add new command to history and increase history_index.
-    else
+    for (int i = token_count; i <= MAX_NUM_ARGUMENTS; i++)
     {
-        strcpy(history[history_index], command_string);
-        history_index++;
+        token[i] = NULL;
     }
 
-    return history_index;
+    return token_count;
 }
 
-// Updates pids array with 15 most recent PID commands.
-int updatePids(int pids[MAX_PID_SIZE], int pids_index, int pid)
+// Commands that work on the filesystem, sorted by name for findCommand().
+const struct command commands[] =
 {
-    // If pids is full, pop first PID and push new PID.
-    // Reorder pid array.
-    if (pids_index == MAX_PID_SIZE)
-    {
-        for (int i = 0; i < MAX_PID_SIZE - 1; i++)
+    { "append", cmdAppend },
+    { "attrib", cmdAttrib },
+    { "cache", cmdCache },
+    { "clone", cmdClone },
+    { "close", cmdClose },
+    { "createfs", cmdCreatefs },
+    { "decrypt", cmdDecrypt },
+    { "defrag", cmdDefrag },
+    { "delete", cmdDelete },
+    { "df", cmdDf },
+    { "encrypt", cmdEncrypt },
+    { "frag", cmdFrag },
+    { "fsck", cmdFsck },
+    { "hugepages", cmdHugepages },
+    { "insert", cmdInsert },
+    { "list", cmdList },
+    { "open", cmdOpen },
+    { "read", cmdRead },
+    { "retrieve", cmdRetrieve },
+    { "rollback", cmdRollback },
+    { "savefs", cmdSavefs },
+    { "scrub", cmdScrub },
+    { "snapshot", cmdSnapshot },
+    { "snapshots", cmdSnapshots },
+    { "stats", cmdStats },
+    { "trace", cmdTrace },
+    { "truncate", cmdTruncate },
+    { "undelete", cmdUndelete },
+    { "verify", cmdVerify },
+    { "write", cmdWrite },
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+// Latency of each command in commands[], for the stats command.
+struct mfs_histogram command_latency[NUM_COMMANDS];
+
+// Looks up a filesystem command by name.
+const struct command *findCommand(char *name)
+{
+    // Input: char *name - The first token of a command line.
+    // Output: const struct command *. The command, or NULL if there is none.
+    // Description: Binary search of commands[].
+
+    int low = 0;
+    int high = NUM_COMMANDS - 1;
+
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(name, commands[mid].name);
+
+        if (cmp == 0)
         {
-            pids[i] = pids[i+1];
+            return &commands[mid];
+        }
+        if (cmp < 0)
+        {
+            high = mid - 1;
+        }
+        else
+        {
+            low = mid + 1;
         }
-        pids[MAX_PID_SIZE-1] = pid;
     }
 
-    // If pids is not full, add new PID to history and increase pids_index.
-    else
+    return NULL;
+}
+
+// Runs a filesystem command, timing it for the stats and trace commands
+// and for --record.
+void runCommand(const struct command *command, char **token, int token_count)
+{
+    if (!MFS_STATS && !recording)
     {
-        pids[pids_index] = pid;
-        pids_index++;
+        command->run(token, token_count);
+        return;
     }
 
-    return pids_index++;
-}
+    struct timespec start, end;
 
-// Trim newline character.
-void trim(char *str)
-{
-    int l = strlen(str);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#if MFS_STATS
+    mfs_trace_begin("command", command->name);
+#endif
+    command->run(token, token_count);
+#if MFS_STATS
+    mfs_trace_end("command", command->name);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    if (str[l-1] == '\n')
+    uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+    if (MFS_STATS)
     {
-        str[l-1] = 0;
+        mfs_hist_record(&command_latency[command - commands], ns);
     }
-}
-
-// Initializes values.
-void init()
-{
-    // Input: None
-    // Output: Void. Initializes values related to file system.
-    // Description: Zeros out data of file system related values.
-    directory_ptr = (struct directoryEntry *)&data_blocks[0][0];
-    inode_ptr = (struct inode *)&data_blocks[20][0];
-    free_blocks = (uint8_t *)&data_blocks[1000][0]; //277 1000
-    free_inodes = (uint8_t *)&data_blocks[19][0];
- 
-    memset(image_name, 0, 64);
-    image_open = 0;
 
-	for (int i = 0; i < NUM_FILES; i++)
-	{
-        memset(directory_ptr[i].filename, 0, 64);
-		directory_ptr[i].in_use = 0;
-        directory_ptr[i].inode = -1;
-        free_inodes[i] = 1;
+    if (recording)
+    {
+        // Keys are logged as RECORD_KEY, never as given.
+        int key_token = keyToken(command, token, token_count);
+        char *key = key_token == -1 ? NULL : token[key_token];
 
-        for (int j = 0; j < NUM_BLOCKS; j++)
+        if (key != NULL)
         {
-            inode_ptr[i].blocks[j] = -1;
-            inode_ptr[i].in_use = 0;
-            inode_ptr[i].file_size = 0;
-            inode_ptr[i].date = -1;
-            inode_ptr[i].attribute = 0;
-            inode_ptr[i].attribute &= ~HIDDEN;
-            inode_ptr[i].attribute &= ~READONLY;
+            token[key_token] = RECORD_KEY;
         }
-	}
 
-    for (int i = 0; i < NUM_BLOCKS; i++)
-    {
-        free_blocks[i] = 1;
+        recordCommand(&start, ns, token, token_count);
+
+        if (key != NULL)
+        {
+            token[key_token] = key;
+        }
     }
 }
 
-// Finds free block in free_blocks[] array.
-int32_t findFreeBlock()
+// Finds the ChaCha20 key in a command line.
+int keyToken(const struct command *command, char **token, int token_count)
 {
-    // Input: None
-    // Output: int32_t. Returns free block.
-    // Description: Loops through free_blocks[] up till NUM_BLOCKS. If a free block is found,
-    //              index of block plus 1001 is returnd and that block is marked not free.
-    //              Returns -1 if no free blocks are found.
+    // Input: const struct command *command - The command.
+    //        char **token - The command line's tokens.
+    //        int token_count - Entries in token.
+    // Output: int. The index of the key's token, or -1 if there is none.
+    // Description: Keys are given as insert -e <key>, read <file> <start>
+    //              <bytes> <key>, retrieve -k <key>, and encrypt or decrypt
+    //              <file> <key> with a 64 digit key. A 1-byte XOR cipher
+    //              is not treated as a key.
+
+    if (strcmp(command->name, "insert") == 0 && token_count > 2 && strcmp(token[1], "-e") == 0)
+    {
+        return 2;
+    }
 
-    for (int i = 0; i < NUM_BLOCKS; i++)
+    if (strcmp(command->name, "retrieve") == 0 && token_count > 2 && strcmp(token[1], "-k") == 0)
     {
-        if (free_blocks[i])
-        {
-            // free_blocks[i + 790] = 0;
-            free_blocks[i + 1001] = 0;
-            return i + 1001; //790 1001 1065
-        }
+        return 2;
     }
-    return -1;
-}
 
-// Finds free inode in free_inodes[] array
-int32_t findFreeInode()
-{
-    // Input: None
-    // Output: int32_t. Returns free inode.
-    // Description: Loops through free_inodes[] up till NUM_FILESS. If a free inode is found,
-    //              index of free inode is returnd and that inode is marked not free.
-    //              Returns -1 if no free inodes are found.
+    if (strcmp(command->name, "read") == 0 && token_count > 4)
+    {
+        return 4;
+    }
 
-    for (int i = 0; i < NUM_FILES; i++)
+    if ((strcmp(command->name, "encrypt") == 0 || strcmp(command->name, "decrypt") == 0) &&
+        token_count > 2 && strlen(token[2]) == 2 * MFS_KEY_SIZE)
     {
-        if (free_inodes[i] == 1)
-        {
-            free_inodes[i] = 0;
-            return i;
-        }
+        return 2;
     }
+
     return -1;
 }
-// Finds free inode block in inode_ptr[inode].blocks[] array
-int32_t findFreeInodeBlock(int32_t inode)
-{
-    // Input: int32_t inode - directory[directory_entry].inode
-    // Output: int32_t. Returns free inode block.
-    // Description: Loops through inode_ptr[inode].blocks[] up till MAX_BLOCKS_PER_FILE.
-    //              If a free inode block is found,
-    //              index of inode block is returned.
-    //              Returns -1 if no free inode blocks are found.
 
-    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+// Runs commands from a script without a prompt.
+int runBatch(FILE *script, int defer)
+{
+    // Input: FILE *script - The commands, one per line.
+    //        int defer - 1 to save the image once at the end rather than at
+    //                    every savefs.
+    // Output: int. The exit status, 1 if a line was too long, otherwise 0.
+    // Description: Blank lines and lines starting with # are skipped. Only
+    //              the filesystem commands, cd and quit/exit are run; there
+    //              is no history and host programs are not started. A
+    //              deferred save also happens before close or createfs
+    //              replaces the image.
+
+    char line[MAX_COMMAND_SIZE];
+    char *token[MAX_NUM_ARGUMENTS + 1];
+    int status = 0;
+    int line_number = 0;
+
+    defer_save = defer;
+
+    while (fgets(line, sizeof(line), script) != NULL)
     {
-        if (inode_ptr[inode].blocks[i] == -1)
+        line_number++;
+
+        // A line that did not fit is reported and the rest of it skipped.
+        if (strchr(line, '\n') == NULL && !feof(script))
+        {
+            printf("mfs: Line %d is too long.\n", line_number);
+            status = 1;
+
+            int c;
+            while ((c = fgetc(script)) != EOF && c != '\n');
+            continue;
+        }
+
+        int token_count = tokenize(line, token);
+
+        if (token_count == 0 || token[0][0] == '#')
+        {
+            continue;
+        }
+
+        if (strcmp("quit", token[0]) == 0 || strcmp("exit", token[0]) == 0)
+        {
+            break;
+        }
+
+        const struct command *command = findCommand(token[0]);
+
+        if (command != NULL)
+        {
+            runCommand(command, token, token_count);
+        }
+        else if (strcmp("cd", token[0]) == 0)
+        {
+            if (token[1] == NULL || chdir(token[1]) == -1)
+            {
+                printf("%s: Directory not found.\n", token[1] ? token[1] : "cd");
+            }
+        }
+        else
         {
-            return i;
+            printf("%s: Command not found.\n", token[0]);
         }
     }
-    return -1;
+
+    flushSave();
+
+    if (script != stdin)
+    {
+        fclose(script);
+    }
+
+    return status;
 }
 
-// The df command.
-uint32_t df()
+// Runs the commands in a log made by --record against a fresh image.
+int runReplay(FILE *log, int paced)
 {
-    // Input: None.
-    // Output: uint32_t. Returns the amount of free space in the file system in bytes.
-    // Description: Loops through free_blocks[] starting at FIRST_DATA_BLOCK 
-    //              and ends at NUM_BLOCKS. int count is increased for every
-    //              free block found.
-    //              Returns count * BLOCK_SIZE.
+    // Input: FILE *log - The log.
+    //        int paced - 1 to start each command when it started in the
+    //                    recorded session, 0 to run them back to back.
+    // Output: int. The exit status, 1 if the log is malformed or the
+    //         scratch directory can not be made, otherwise 0.
+    // Description: The commands run in a new scratch directory under /tmp,
+    //              removed afterwards, so images and retrieved files land
+    //              there and the recorded ones are never touched. cd is
+    //              skipped, and arguments that lead out of the directory
+    //              are cut down to their last component. Opening an image
+    //              that does not exist there opens a new empty one. Host
+    //              files are generated from the sizes in the log. Prints
+    //              each command's recorded and replayed latency at the end.
+
+    char scratch[] = "/tmp/mfs-replay-XXXXXX";
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(scratch) == NULL || chdir(scratch) == -1)
+    {
+        printf("mfs: Can not make a scratch directory.\n");
+        fclose(log);
+        return 1;
+    }
 
-    int count = 0;
-    
-    for (int i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
+    struct mfs_histogram *recorded = calloc(NUM_COMMANDS, sizeof(struct mfs_histogram));
+    struct mfs_histogram *replayed = calloc(NUM_COMMANDS, sizeof(struct mfs_histogram));
+    char line[PATH_MAX + 64];
+    char *token[MAX_NUM_ARGUMENTS + 1];
+    int status = recorded == NULL || replayed == NULL;
+    int line_number = 0;
+    int commands_run = 0;
+    double session = 0;
+    uint64_t host_bytes = 0;
+    struct timespec begin, start, end;
+
+    replaying = 1;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    while (status == 0 && fgets(line, sizeof(line), log) != NULL)
     {
-        if (free_blocks[i])
+        line_number++;
+        trim(line);
+
+        if (line[0] == '\0' || line[0] == '#')
         {
-            count++;
+            continue;
         }
-    }
 
-    return count * BLOCK_SIZE;
-}
+        unsigned size, crc;
+        int used = 0;
 
-// Searches the directory for filename
-uint32_t searchDirectory(char *filename)
-{
-    // Input: char *filename - the filename to look for.
-    // Output: uint32_t. Returns the index of the filename in directory_ptr[] if found.
-    //         Returns -1 if filename is not found in directory.
-    // Description: Loops through directory_ptr[] starting at 0 
-    //              and ends at NUM_FILES. If filename == directory_ptr[i].filename,
-    //              index of filename is returned.
-    //              Returns -1 if filename is not found in directory.
+        if (line[0] == '+')
+        {
+            if (sscanf(line, "+ %u %x %n", &size, &crc, &used) < 2 || used == 0 ||
+                replayExpect(replayArgument(line + used), size, crc) == -1)
+            {
+                status = 1;
+            }
+            continue;
+        }
 
-    int ret = -1;
+        double offset, seconds;
 
-    for (int i = 0; i < NUM_FILES; i++) 
-	{
-		if (directory_ptr[i].filename == NULL)
-		{
-			continue;
-		}	
-        else if (strcmp(filename, directory_ptr[i].filename) == 0) 
-		{
-            return i;
+        if (sscanf(line, "%lf %lf %n", &offset, &seconds, &used) < 2 || used == 0)
+        {
+            status = 1;
+            continue;
         }
-    }
 
-    return ret;	
-}	
+        int token_count = tokenize(line + used, token);
+        const struct command *command = token_count > 0 ? findCommand(token[0]) : NULL;
 
-// The createfs command.
-void createfs(char *filename)
-{
-    // Input: char *filename - the name of the file system.
-    // Output: void. Creates the file system.
-    // Description: Initializes the file system in the disk_image.
+        if (command == NULL)
+        {
+            replayClear();
+            continue;
+        }
 
-    if (strlen(filename) > 64)
-	{
-		printf("createfs: Only supports filenames of up to 64 characters.\n");
-		return;
-	}
-	
-	disk_image = fopen(filename, "w");
-    strncpy(image_name, filename, strlen(filename));
+        for (int i = 1; i < token_count; i++)
+        {
+            token[i] = replayArgument(token[i]);
+        }
 
-    memset(data_blocks, 0, NUM_BLOCKS * BLOCK_SIZE);
-    image_open = 1;
+        if (strcmp(token[0], "open") == 0 && token_count > 1 && access(token[token_count - 1], F_OK) == -1)
+        {
+            struct mfs *empty;
 
-    for (int i = 0; i < NUM_FILES; i++)
-	{
-        memset(directory_ptr[i].filename, 0, 64);
-		directory_ptr[i].in_use = 0;
-        directory_ptr[i].inode = -1;
-        free_inodes[i] = 1;
+            if (mfs_create(token[token_count - 1], &empty) == MFS_OK)
+            {
+                mfs_save(empty);
+                mfs_close(empty);
+            }
+        }
 
-        for (int j = 0; j < NUM_BLOCKS; j++)
+        if (paced)
         {
-            inode_ptr[i].blocks[j] = -1;
-            inode_ptr[i].in_use = 0;
-            inode_ptr[i].file_size = 0;
-            inode_ptr[i].date = -1;
-            inode_ptr[i].attribute = 0;
-            inode_ptr[i].attribute &= ~HIDDEN;
-            inode_ptr[i].attribute &= ~READONLY;
+            struct timespec due = begin;
+
+            due.tv_sec += (time_t)offset;
+            due.tv_nsec += (long)((offset - (time_t)offset) * 1e9);
+            if (due.tv_nsec >= 1000000000)
+            {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
         }
-	}
 
-    for (int i = 0; i < NUM_BLOCKS; i++)
-    {
-        free_blocks[i] = 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        runCommand(command, token, token_count);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        mfs_hist_record(&recorded[command - commands], (uint64_t)(seconds * 1e9));
+        mfs_hist_record(&replayed[command - commands],
+                        (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+
+        host_bytes += replayClear();
+        commands_run++;
+        session = offset + seconds;
     }
 
-    fclose(disk_image);
-}
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    replaying = 0;
+    replayClear();
 
-// The savefs command.
-void savefs()
-{
-    // Input: None.
-    // Output: void. Saves the file system.
-    // Description: If image is open and not NULL, the data_blocks are
-    //              written to the disK_image.
+    if (fs != NULL)
+    {
+        mfs_close(fs);
+        fs = NULL;
+    }
 
-    if (image_open == 0)
+    if (chdir(cwd) == -1 || nftw(scratch, removeScratch, 16, FTW_DEPTH | FTW_PHYS) == -1)
     {
-        printf("savefs: Disk image is not open.\n");
-        return;
+        printf("mfs: Can not remove %s.\n", scratch);
     }
 
-    disk_image = fopen(image_name, "w");
+    if (status != 0)
+    {
+        printf("mfs: Line %d of the log is not valid.\n", line_number);
+    }
 
-	if (disk_image == NULL)
-	{
-		printf("savefs: Disk image filename not found.\n");
-        return;
-	}
+    double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    printf("\nReplayed %d commands in %.3f s (recorded %.3f s), %.1f commands/s, %.2f MB/s of host file data.\n",
+           commands_run, elapsed, session, elapsed > 0 ? commands_run / elapsed : 0.0,
+           elapsed > 0 ? host_bytes / elapsed / 1e6 : 0.0);
+    printf("%-16s %8s %12s %12s %12s %12s\n", "command", "count", "recorded p50", "p99", "replayed p50", "p99");
+
+    for (int i = 0; i < (int)NUM_COMMANDS && recorded != NULL && replayed != NULL; i++)
+    {
+        char p50[16], p99[16], r50[16], r99[16];
+
+        if (replayed[i].count == 0)
+        {
+            continue;
+        }
 
-	fwrite(&data_blocks[0][0], BLOCK_SIZE, NUM_BLOCKS, disk_image);
+        printf("%-16s %8llu %12s %12s %12s %12s\n", commands[i].name, (unsigned long long)replayed[i].count,
+               formatNs(mfs_hist_percentile(&recorded[i], 50), p50),
+               formatNs(mfs_hist_percentile(&recorded[i], 99), p99),
+               formatNs(mfs_hist_percentile(&replayed[i], 50), r50),
+               formatNs(mfs_hist_percentile(&replayed[i], 99), r99));
+    }
 
-    memset(image_name, 0, 64);
+    free(recorded);
+    free(replayed);
+    fclose(log);
 
-	fclose(disk_image);	
+    return status;
 }
 
-// The openfs command.
-void openfs(char *filename)
+// Keeps a replayed command's argument inside the scratch directory.
+char *replayArgument(char *token)
 {
-    // Input: char *filename - name of the file system to open.
-    // Output: void. Opens the file system.
-    // Description: If image is not open and not NULL, image_name is copied from
-    //              filename and the disk_image reads the data from data_blocks.
-    //              Image is set to open.
+    // Input: char *token - An argument from the log.
+    // Output: char *. token, or its last path component if it is absolute
+    //         or goes up a directory.
 
-    disk_image = fopen(filename, "r");
+    if (token[0] != '/' && strstr(token, "..") == NULL)
+    {
+        return token;
+    }
 
-    if (disk_image == NULL)
-	{
-		printf("open: Disk image filename not found.\n");
-		return;
-	}
+    char *last = strrchr(token, '/');
 
-    if (image_open == 1)
+    if (last != NULL)
     {
-        printf("open: Disk image is already open.\n");
-		return;
+        token = last + 1;
     }
 
-    strncpy(image_name, filename, strlen(filename));
+    return token[0] == '\0' || strcmp(token, "..") == 0 ? "." : token;
+}
 
-    fread(&data_blocks[0][0], BLOCK_SIZE, NUM_BLOCKS, disk_image);
-    image_open = 1;
+// nftw() callback removing the replay scratch directory.
+int removeScratch(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    return remove(path);
 }
 
-// The closefs command.
-void closefs()
+// Saves the image if a deferred savefs is waiting.
+void flushSave()
 {
-    // Input: None.
-    // Output: void. Closes the file system.
-    // Description: If image is open and not NULL, disk_image is closed,
-    //              image is set to closed, and image_name is zeroed out.
+    if (save_pending)
+    {
+        save_pending = 0;
+        savefs();
+    }
+}
 
-    if (image_open == 0)
+// Runs the createfs command from its tokens.
+void cmdCreatefs(char **token, int token_count)
+{
+    if (token[1] == NULL)
     {
-        printf("close: Disk image is not open.\n");
+        printf("createfs: No filename specified.\n");
         return;
     }
 
-    if (disk_image == NULL)
-	{
-		printf("close: Disk image filename not found.\n");
-		return;
-	}
+    flushSave();
+    createfs(token[1]);
+}
 
-    fclose(disk_image);
-    image_open = 0;
+// Runs the savefs command from its tokens.
+void cmdSavefs(char **token, int token_count)
+{
+    if (defer_save && fs != NULL)
+    {
+        save_pending = 1;
+        return;
+    }
 
-    memset(image_name, 0, 64);
+    savefs();
 }
 
-// The list command.
-void list(char *attrib1, char *attrib2)
+// Runs the open command from its tokens.
+void cmdOpen(char **token, int token_count)
 {
-    // Input: char *attrib1 - First attribute.
-    //        char *attrib2 - Second attribute.
-    // Output: void. Lists the file system.
-    // Description: Loops through the files within the file system.
-    //              If an attribute is '-h', hidden files are displayed.
-    //              If an attribute is '-a', attributes are displayed
-    //              as an 8 bit value.
+    if (token[1] == NULL)
+    {
+        printf("open: No filename specified.\n");
+        return;
+    }
 
-    int not_found = 1;
+    if (fs != NULL)
+    {
+        printf("open: Disk image is already open.\n");
+        return;
+    }
 
-    for (int i = 0; i < NUM_FILES; i++)
+    // open -c <blocks> <filename> keeps at most <blocks> data blocks in memory.
+    if (strcmp(token[1], "-c") == 0)
     {
-        int32_t inode_index = directory_ptr[i].inode;
+        if (token[2] == NULL || atoi(token[2]) < MFS_MIN_CACHE_BLOCKS)
+        {
+            printf("open: Cache size must be at least %d blocks.\n", MFS_MIN_CACHE_BLOCKS);
+            return;
+        }
 
-        if (directory_ptr[i].in_use)
+        if (token[3] == NULL)
         {
-            if (attrib1 == NULL && attrib2 == NULL)
-            {
-                if (!(inode_ptr[inode_index].attribute & HIDDEN))
-                {
-                    not_found = 0;
-                    char filename[65];
-                    memset(filename, 0, 65);
-                    strncpy(filename, directory_ptr[i].filename, strlen(directory_ptr[i].filename));
-
-                    char *date = ctime(&inode_ptr[inode_index].date);
-                    trim(date);
-                    
-                    printf("%d %s %s\n", inode_ptr[inode_index].file_size, date, filename);
-                }
-            }
-            else if (attrib1 != NULL && strcmp(attrib1, "-h") == 0)
-            {
-                if (attrib2 != NULL && strcmp(attrib2, "-a") == 0)
-                {
-                    not_found = 0;
-                    char filename[65];
-                    memset(filename, 0, 65);
-                    strncpy(filename, directory_ptr[i].filename, strlen(directory_ptr[i].filename));
-
-                    char *date = ctime(&inode_ptr[inode_index].date);
-                    trim(date);
-                    
-                    printf("%d %s %s ", 
-                    inode_ptr[inode_index].file_size, date, filename);
-
-                    // Print the value of the attribute as an 8 bit binary value
-                    printf("%d%d%d%d%d%d%d%d\n",
-                    (inode_ptr[inode_index].attribute >> 7) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 6) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 5) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 4) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 3) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 2) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 1) & 0x01,
-                     inode_ptr[inode_index].attribute & 0x01);
-                }
-                else
-                {
-                    not_found = 0;
-                    char filename[65];
-                    memset(filename, 0, 65);
-                    strncpy(filename, directory_ptr[i].filename, strlen(directory_ptr[i].filename));
-
-                    char *date = ctime(&inode_ptr[inode_index].date);
-                    trim(date);
-                    
-                    printf("%d %s %s\n", inode_ptr[inode_index].file_size, date, filename);
-                }
-            }
-            else if (attrib1 != NULL && strcmp(attrib1, "-a") == 0)
-            {
-                if (attrib2 != NULL && strcmp(attrib2, "-h") == 0)
-                {
-                    not_found = 0;
-                    char filename[65];
-                    memset(filename, 0, 65);
-                    strncpy(filename, directory_ptr[i].filename, strlen(directory_ptr[i].filename));
-
-                    char *date = ctime(&inode_ptr[inode_index].date);
-                    trim(date);
-                    
-                    printf("%d %s %s ", 
-                    inode_ptr[inode_index].file_size, date, filename);
-
-                    // Print the value of the attribute as an 8 bit binary value
-                    printf("%d%d%d%d%d%d%d%d\n",
-                    (inode_ptr[inode_index].attribute >> 7) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 6) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 5) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 4) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 3) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 2) & 0x01,
-                    (inode_ptr[inode_index].attribute >> 1) & 0x01,
-                     inode_ptr[inode_index].attribute & 0x01);
-                }
-                else
-                {
-                    if (!(inode_ptr[inode_index].attribute & HIDDEN))
-                    {
-                        not_found = 0;
-                        char filename[65];
-                        memset(filename, 0, 65);
-                        strncpy(filename, directory_ptr[i].filename, strlen(directory_ptr[i].filename));
-
-                        char *date = ctime(&inode_ptr[inode_index].date);
-                        trim(date);
-                        
-                        printf("%d %s %s ", 
-                        inode_ptr[inode_index].file_size, date, filename);
-
-                        // Print the value of the attribute as an 8 bit binary value
-                        printf("%d%d%d%d%d%d%d%d\n",
-                        (inode_ptr[inode_index].attribute >> 7) & 0x01,
-                        (inode_ptr[inode_index].attribute >> 6) & 0x01,
-                        (inode_ptr[inode_index].attribute >> 5) & 0x01,
-                        (inode_ptr[inode_index].attribute >> 4) & 0x01,
-                        (inode_ptr[inode_index].attribute >> 3) & 0x01,
-                        (inode_ptr[inode_index].attribute >> 2) & 0x01,
-                        (inode_ptr[inode_index].attribute >> 1) & 0x01,
-                        inode_ptr[inode_index].attribute & 0x01);
-                    }
-                }
-            }
+            printf("open: No filename specified.\n");
+            return;
         }
+
+        openfs(token[3], atoi(token[2]));
+        return;
     }
-    
-    if (not_found)
+
+    // open -s <filename> maps the image shared with other mfs processes.
+    if (strcmp(token[1], "-s") == 0)
     {
-        printf("list: No files found.\n");
+        if (token[2] == NULL)
+        {
+            printf("open: No filename specified.\n");
+            return;
+        }
+
+        openfs(token[2], MFS_SHARED);
+        return;
     }
+
+    openfs(token[1], 0);
 }
 
-// The insert command.
-void insert(char *filename)
+// Runs the close command from its tokens.
+void cmdClose(char **token, int token_count)
 {
-    // Input: char *filename - The file to put into the file system.
-    // Output: void. Inserts filename into the file system.
-    // Description: After checking if the file exists, the input read-only
-    //              file is open. Data is copied and stored into 
-    //              the file system in BLOCK_SIZE chunks
+    flushSave();
+    closefs();
+}
 
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
+// Runs the list command from its tokens.
+void cmdList(char **token, int token_count)
+{
+    if (fs == NULL)
     {
-        printf("insert: Filename is NULL\n");
+        printf("list: Disk image is not open.\n");
         return;
     }
 
-    // Verify name isn't too long.
-    if (strlen(filename) > 64)
-	{
-		printf("insert: Only supports filenames of up to 64 characters.\n");
-		return;
-	}
-
-    // Verify the file exists.
-    struct stat buf;
-    int ret = stat(filename, &buf);
+    if (token[1] != NULL && token[2] != NULL)
+    {
+        if (strcmp(token[1], "-h") == 0 || strcmp(token[1], "-a") == 0)
+        {
+            if (strcmp(token[2], "-h") == 0 || strcmp(token[2], "-a") == 0)
+            {
+                list(token[1], token[2]);
+            }
+            else
+            {
+                printf("list: Invalid parameter.\n");
+                return;
+            }
+        }
+        else
+        {
+            printf("list: Invalid parameter.\n");
+            return;
+        }
+    }
+    else if (token[1] != NULL)
+    {
+        if (strcmp(token[1], "-h") == 0 || strcmp(token[1], "-a") == 0)
+        {
+            list(token[1], token[2]);
+        }
+        else
+        {
+            printf("list: Invalid parameter.\n");
+            return;
+        }
+    }
+    else
+    {
+        list(token[1], token[2]);
+    }
+}
+
+// Runs the df command from its tokens.
+void cmdDf(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("df: Disk image is not open.\n");
+        return;
+    }
+
+    printf("%d bytes free.\n", mfs_df(fs));
+}
+
+// Runs the insert command from its tokens.
+void cmdInsert(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("insert: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("insert: No filename specified.\n");
+        return;
+    }
+
+    // insert -e <key> <filename> encrypts the blocks as they are copied in.
+    uint8_t key[MFS_KEY_SIZE];
+    uint8_t *insert_key = NULL;
+    int first = 1;
+
+    if (strcmp(token[1], "-e") == 0)
+    {
+        if (token[2] == NULL || hex_to_key(token[2], key) == -1)
+        {
+            printf("insert: Invalid key.\n");
+            return;
+        }
+
+        if (token[3] == NULL)
+        {
+            printf("insert: No filename specified.\n");
+            return;
+        }
+
+        insert_key = key;
+        first = 3;
+    }
+
+    // insert -m <manifest> inserts the files listed one per line.
+    if (strcmp(token[first], "-m") == 0)
+    {
+        if (token[first + 1] == NULL)
+        {
+            printf("insert: No manifest specified.\n");
+            return;
+        }
+
+        insertMany(&token[first + 1], 1, 1, insert_key);
+        return;
+    }
+
+    // Several files or a glob pattern are inserted as one batch.
+    if (token_count > first + 1 || strpbrk(token[first], "*?[") != NULL)
+    {
+        insertMany(&token[first], token_count - first, 0, insert_key);
+        return;
+    }
+
+    insert(token[first], insert_key);
+}
+
+// Runs the write command from its tokens.
+void cmdWrite(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("write: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("write: No filename specified.\n");
+        return;
+    }
+    else if (token[2] == NULL)
+    {
+        printf("write: No offset specified.\n");
+        return;
+    }
+    else if (token[3] == NULL)
+    {
+        printf("write: No host file specified.\n");
+        return;
+    }
+
+    writeFile("write", token[1], atoi(token[2]), token[3]);
+}
+
+// Runs the append command from its tokens.
+void cmdAppend(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("append: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("append: No filename specified.\n");
+        return;
+    }
+    else if (token[2] == NULL)
+    {
+        printf("append: No host file specified.\n");
+        return;
+    }
+
+    writeFile("append", token[1], -1, token[2]);
+}
+
+// Runs the truncate command from its tokens.
+void cmdTruncate(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("truncate: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("truncate: No filename specified.\n");
+        return;
+    }
+    else if (token[2] == NULL)
+    {
+        printf("truncate: No size specified.\n");
+        return;
+    }
+
+    truncateFile(token[1], atoi(token[2]));
+}
+
+// Runs the clone command from its tokens.
+void cmdClone(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("clone: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("clone: No source filename specified.\n");
+        return;
+    }
+    else if (token[2] == NULL)
+    {
+        printf("clone: No destination filename specified.\n");
+        return;
+    }
+
+    report("clone", mfs_clone(fs, token[1], token[2]));
+}
+
+// Runs the snapshot command from its tokens.
+void cmdSnapshot(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("snapshot: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("snapshot: No snapshot name specified.\n");
+        return;
+    }
+
+    // snapshot -d <name> drops a snapshot and releases its blocks.
+    if (strcmp(token[1], "-d") == 0)
+    {
+        if (token[2] == NULL)
+        {
+            printf("snapshot: No snapshot name specified.\n");
+            return;
+        }
+
+        report("snapshot", mfs_snapshot_delete(fs, token[2]));
+        return;
+    }
+
+    report("snapshot", mfs_snapshot(fs, token[1]));
+}
+
+// Runs the snapshots command from its tokens.
+void cmdSnapshots(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("snapshots: Disk image is not open.\n");
+        return;
+    }
+
+    listSnapshots();
+}
+
+// Runs the rollback command from its tokens.
+void cmdRollback(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("rollback: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("rollback: No snapshot name specified.\n");
+        return;
+    }
+
+    report("rollback", mfs_rollback(fs, token[1]));
+}
+
+// Runs the attrib command from its tokens.
+void cmdAttrib(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("attrib: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("attrib: No attribute specified.\n");
+        return;
+    }
+
+    if (token[2] == NULL)
+    {
+        printf("attrib: No filename specified.\n");
+        return;
+    }
+
+    attrib(token[1], token[2]);
+}
+
+// Runs the delete command from its tokens.
+void cmdDelete(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("delete: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("delete: No filename specified.\n");
+        return;
+    }
+
+    report("delete", mfs_unlink(fs, token[1]));
+}
+
+// Runs the undelete command from its tokens.
+void cmdUndelete(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("undelete: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("undelete: No filename specified.\n");
+        return;
+    }
+
+    report("undelete", mfs_undelete(fs, token[1]));
+}
+
+// Runs the read command from its tokens.
+void cmdRead(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("read: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("read: No filename specified.\n");
+        return;
+    }
+    else if (token[2] == NULL)
+    {
+        printf("read: No starting byte specified.\n");
+        return;
+    }
+    else if (token[3] == NULL)
+    {
+        printf("read: No number of bytes specified.\n");
+        return;
+    }
+
+    if (token[4] != NULL)
+    {
+        uint8_t key[MFS_KEY_SIZE];
+
+        if (hex_to_key(token[4], key) == -1)
+        {
+            printf("read: Invalid key.\n");
+            return;
+        }
+
+        readFile(token[1], atoi(token[2]), atoi(token[3]), key);
+        return;
+    }
+
+    readFile(token[1], atoi(token[2]), atoi(token[3]), NULL);
+}
+
+// Runs the retrieve command from its tokens.
+void cmdRetrieve(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("retrieve: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("retrieve: No filename specified.\n");
+        return;
+    }
+
+    // retrieve -s <snapshot> <filename> [newfilename] copies out a file
+    // as it was when the snapshot was taken.
+    if (strcmp(token[1], "-s") == 0)
+    {
+        if (token[2] == NULL)
+        {
+            printf("retrieve: No snapshot name specified.\n");
+            return;
+        }
+
+        if (token[3] == NULL)
+        {
+            printf("retrieve: No filename specified.\n");
+            return;
+        }
+
+        retrieve(token[2], token[3], token[4], NULL);
+        return;
+    }
+
+    // retrieve -k <key> <filename> [newfilename] decrypts while copying out.
+    if (strcmp(token[1], "-k") == 0)
+    {
+        uint8_t key[MFS_KEY_SIZE];
+
+        if (token[2] == NULL || hex_to_key(token[2], key) == -1)
+        {
+            printf("retrieve: Invalid key.\n");
+            return;
+        }
+
+        if (token[3] == NULL)
+        {
+            printf("retrieve: No filename specified.\n");
+            return;
+        }
+
+        retrieve(NULL, token[3], token[4], key);
+        return;
+    }
+
+    // retrieve -a <directory> [pattern] copies out every file, or
+    // those matching the glob pattern, into directory.
+    if (strcmp(token[1], "-a") == 0)
+    {
+        if (token[2] == NULL)
+        {
+            printf("retrieve: No directory specified.\n");
+            return;
+        }
+
+        retrieveAll(token[2], token[3]);
+        return;
+    }
+
+    retrieve(NULL, token[1], token[2], NULL);
+}
+
+// Runs the encrypt command from its tokens.
+void cmdEncrypt(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("encrypt: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("encrypt: No filename specified.\n");
+        return;
+    }
+
+    if (token[2] == NULL)
+    {
+        printf("encrypt: No cipher specified.\n");
+        return;
+    }
+
+    // A 256-bit key selects ChaCha20, anything else the 1-byte XOR cipher.
+    if (strlen(token[2]) == 2 * MFS_KEY_SIZE)
+    {
+        uint8_t key[MFS_KEY_SIZE];
+
+        if (hex_to_key(token[2], key) == -1)
+        {
+            printf("encrypt: Invalid cipher.\n");
+            return;
+        }
+
+        report("encrypt", mfs_encrypt(fs, token[1], key));
+        return;
+    }
+
+    uint8_t hex = hex_to_byte(token[2]);
+
+    if (hex == -1)
+    {
+        printf("encrypt: Invalid cipher.\n");
+        return;
+    }
+
+    report("encrypt", mfs_xor(fs, token[1], hex));
+}
+
+// Runs the decrypt command from its tokens.
+void cmdDecrypt(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("decrypt: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] == NULL)
+    {
+        printf("decrypt: No filename specified.\n");
+        return;
+    }
+
+    if (token[2] == NULL)
+    {
+        printf("decrypt: No cipher specified.\n");
+        return;
+    }
+
+    // A 256-bit key selects ChaCha20, anything else the 1-byte XOR cipher.
+    if (strlen(token[2]) == 2 * MFS_KEY_SIZE)
+    {
+        uint8_t key[MFS_KEY_SIZE];
+
+        if (hex_to_key(token[2], key) == -1)
+        {
+            printf("decrypt: Invalid cipher.\n");
+            return;
+        }
+
+        report("decrypt", mfs_decrypt(fs, token[1], key));
+        return;
+    }
+
+    uint8_t hex = hex_to_byte(token[2]);
+
+    if (hex == -1)
+    {
+        printf("decrypt: Invalid cipher.\n");
+        return;
+    }
+
+    report("decrypt", mfs_xor(fs, token[1], hex));
+}
+
+// Runs the verify command from its tokens.
+void cmdVerify(char **token, int token_count)
+{
+    if (token[1] != NULL && strcmp(token[1], "on") == 0)
+    {
+        verify_reads = 1;
+    }
+    else if (token[1] != NULL && strcmp(token[1], "off") == 0)
+    {
+        verify_reads = 0;
+    }
+    else if (token[1] != NULL)
+    {
+        printf("verify: Invalid parameter.\n");
+        return;
+    }
+
+    if (fs != NULL)
+    {
+        mfs_set_verify(fs, verify_reads);
+    }
+
+    printf("verify: Checksum verification on read is %s.\n", verify_reads ? "on" : "off");
+}
+
+// Runs the hugepages command from its tokens.
+void cmdHugepages(char **token, int token_count)
+{
+    static const char *modes[] = { "off", "on", "explicit" };
+
+    if (token[1] != NULL)
+    {
+        int mode = 0;
+
+        while (mode < 3 && strcmp(token[1], modes[mode]) != 0)
+        {
+            mode++;
+        }
+
+        if (mode == 3)
+        {
+            printf("hugepages: Invalid parameter.\n");
+            return;
+        }
+
+        page_mode = mode;
+        mfs_set_hugepages(page_mode);
+    }
+
+    printf("hugepages: Huge pages are %s for images opened or created from now on.\n",
+           page_mode == MFS_PAGES_SMALL ? "off" : page_mode == MFS_PAGES_TRANSPARENT ?
+           "on (transparent)" : "on (explicit, else transparent)");
+}
+
+// Runs the cache command from its tokens.
+void cmdCache(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("cache: Disk image is not open.\n");
+        return;
+    }
+
+    cacheStats();
+}
+
+// Runs the scrub command from its tokens.
+void cmdScrub(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("scrub: Disk image is not open.\n");
+        return;
+    }
+
+    scrub();
+}
+
+// Runs the fsck command from its tokens.
+void cmdFsck(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("fsck: Disk image is not open.\n");
+        return;
+    }
+
+    if (token[1] != NULL && strcmp(token[1], "-r") != 0)
+    {
+        printf("fsck: invalid option -- '%s'\n", token[1]);
+        return;
+    }
+
+    fsck(token[1] != NULL);
+}
+
+// Runs the frag command from its tokens.
+void cmdFrag(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("frag: Disk image is not open.\n");
+        return;
+    }
+
+    frag(token[1]);
+}
+
+// Runs the defrag command from its tokens.
+void cmdDefrag(char **token, int token_count)
+{
+    if (fs == NULL)
+    {
+        printf("defrag: Disk image is not open.\n");
+        return;
+    }
+
+    // defrag [-b blocks] [-t seconds] [filename]
+    char *filename = NULL;
+    int max_blocks = 0;
+    double max_seconds = 0;
+
+    for (int i = 1; i < token_count && token[i] != NULL; i++)
+    {
+        if (strcmp(token[i], "-b") == 0 || strcmp(token[i], "-t") == 0)
+        {
+            if (token[i + 1] == NULL || atof(token[i + 1]) <= 0)
+            {
+                printf("defrag: Invalid parameter.\n");
+                return;
+            }
+
+            if (token[i][1] == 'b')
+            {
+                max_blocks = atoi(token[i + 1]);
+            }
+            else
+            {
+                max_seconds = atof(token[i + 1]);
+            }
+            i++;
+        }
+        else if (filename == NULL && token[i][0] != '-')
+        {
+            filename = token[i];
+        }
+        else
+        {
+            printf("defrag: invalid option -- '%s'\n", token[i]);
+            return;
+        }
+    }
+
+    defrag(filename, max_blocks, max_seconds);
+}
+
+// Runs the stats command from its tokens.
+void cmdStats(char **token, int token_count)
+{
+    if (!MFS_STATS)
+    {
+        printf("stats: Statistics were not compiled in.\n");
+        return;
+    }
+
+    // stats reset starts every count and histogram again.
+    if (token[1] != NULL && strcmp(token[1], "reset") == 0)
+    {
+        memset(command_latency, 0, sizeof(command_latency));
+        if (fs != NULL)
+        {
+            mfs_stats_reset(fs);
+        }
+        return;
+    }
+
+    if (token[1] != NULL)
+    {
+        printf("stats: invalid option -- '%s'\n", token[1]);
+        return;
+    }
+
+    printStats();
+}
+
+// Runs the trace command from its tokens.
+void cmdTrace(char **token, int token_count)
+{
+    if (token[1] != NULL && (strcmp(token[1], "on") == 0 || strcmp(token[1], "off") == 0))
+    {
+        if (mfs_trace_enable(strcmp(token[1], "on") == 0) != MFS_OK)
+        {
+            printf("trace: Tracing was not compiled in.\n");
+            return;
+        }
+        printf("trace: Tracing is %s.\n", token[1]);
+    }
+    else if (token[1] != NULL && strcmp(token[1], "clear") == 0)
+    {
+        mfs_trace_clear();
+    }
+    else if (token[1] != NULL && strcmp(token[1], "dump") == 0)
+    {
+        if (token[2] == NULL)
+        {
+            printf("trace: No file given.\n");
+            return;
+        }
+
+        uint64_t events = mfs_trace_count();
+
+        if (mfs_trace_dump(token[2]) != MFS_OK)
+        {
+            printf("trace: Can not write %s.\n", token[2]);
+            return;
+        }
+        printf("trace: %llu events written to %s.\n", (unsigned long long)events, token[2]);
+    }
+    else if (token[1] != NULL)
+    {
+        printf("trace: Invalid parameter.\n");
+    }
+    else
+    {
+        printf("trace: %llu events recorded.\n", (unsigned long long)mfs_trace_count());
+    }
+}
+
+// Updates history array with 15 most recent commands.
+int updateHistory(char history[][MAX_COMMAND_SIZE], int history_index, char *command_string)
+{
+    // If history is full, pop first command and push new command.
+    // Reorder history array.
+    if (history_index == MAX_HISTORY_SIZE)
+    {  
+        for (int i = 0; i < MAX_HISTORY_SIZE - 1; i++)
+        {
+            strcpy(history[i], history[i+1]);
+        }
+        strcpy(history[MAX_HISTORY_SIZE-1], command_string);
+    }
+
+    // If history is not full, add new command to history and increase history_index.
+    else
+    {
+        strcpy(history[history_index], command_string);
+        history_index++;
+    }
+
+    return history_index;
+}
+
+// Updates pids array with 15 most recent PID commands.
+int updatePids(int pids[MAX_PID_SIZE], int pids_index, int pid)
+{
+    // If pids is full, pop first PID and push new PID.
+    // Reorder pid array.
+    if (pids_index == MAX_PID_SIZE)
+    {
+        for (int i = 0; i < MAX_PID_SIZE - 1; i++)
+        {
+            pids[i] = pids[i+1];
+        }
+        pids[MAX_PID_SIZE-1] = pid;
+    }
+
+    // If pids is not full, add new PID to history and increase pids_index.
+    else
+    {
+        pids[pids_index] = pid;
+        pids_index++;
+    }
+
+    return pids_index++;
+}
+
+// Trim newline character.
+void trim(char *str)
+{
+    int l = strlen(str);
+
+    if (str[l-1] == '\n')
+    {
+        str[l-1] = 0;
+    }
+}
+
+// Prints a libmfs error for a command.
+int report(char *command, int err)
+{
+    // Input: char *command - Command name used to prefix the message.
+    //        int err - Value returned by a libmfs call.
+    // Output: int. err, so calls can be checked in place.
+
+    if (err < 0)
+    {
+        printf("%s: %s.\n", command, mfs_strerror(err));
+    }
+
+    return err;
+}
+
+// The createfs command.
+void createfs(char *filename)
+{
+    // Input: char *filename - the name of the file system.
+    // Output: void. Creates the file system.
+    // Description: Any open image is closed without saving, as before, and
+    //              a new empty image takes its place.
+
+    if (strlen(filename) > MFS_NAME_MAX)
+	{
+		printf("createfs: Only supports filenames of up to %d characters.\n", MFS_NAME_MAX);
+		return;
+	}
+
+    if (fs != NULL)
+    {
+        mfs_close(fs);
+        fs = NULL;
+    }
+
+    defrag_resume = 0;
+
+    if (report("createfs", mfs_create(filename, &fs)) == MFS_OK)
+    {
+        mfs_set_verify(fs, verify_reads);
+    }
+}
+
+// The savefs command.
+void savefs()
+{
+    // Input: None.
+    // Output: void. Saves the file system.
+
+    if (fs == NULL)
+    {
+        printf("savefs: Disk image is not open.\n");
+        return;
+    }
+
+    report("savefs", mfs_save(fs));
+}
+
+// The openfs command.
+void openfs(char *filename, int cache_blocks)
+{
+    // Input: char *filename - name of the file system to open.
+    //        int cache_blocks - Data blocks to keep in memory, 0 to load
+    //                           the whole image, or MFS_SHARED.
+    // Output: void. Opens the file system.
+
+    int err = mfs_open(filename, cache_blocks, &fs);
+
+    defrag_resume = 0;
+
+    if (err == MFS_ENOENT)
+    {
+        printf("open: Disk image filename not found.\n");
+        return;
+    }
+
+    if (report("open", err) == MFS_OK)
+    {
+        mfs_set_verify(fs, verify_reads);
+    }
+}
+
+// The closefs command.
+void closefs()
+{
+    // Input: None.
+    // Output: void. Closes the file system without saving it.
+
+    if (fs == NULL)
+    {
+        printf("close: Disk image is not open.\n");
+        return;
+    }
+
+    mfs_close(fs);
+    fs = NULL;
+    defrag_resume = 0;
+}
+
+// The list command.
+void list(char *attrib1, char *attrib2)
+{
+    // Input: char *attrib1 - First attribute.
+    //        char *attrib2 - Second attribute.
+    // Output: void. Lists the file system.
+    // Description: Loops through the files within the file system.
+    //              If an attribute is '-h', hidden files are displayed.
+    //              If an attribute is '-a', attributes are displayed
+    //              as an 8 bit value.
+
+    int show_hidden = 0;
+    int show_attributes = 0;
+
+    if ((attrib1 != NULL && strcmp(attrib1, "-h") == 0) || (attrib2 != NULL && strcmp(attrib2, "-h") == 0))
+    {
+        show_hidden = 1;
+    }
+
+    if ((attrib1 != NULL && strcmp(attrib1, "-a") == 0) || (attrib2 != NULL && strcmp(attrib2, "-a") == 0))
+    {
+        show_attributes = 1;
+    }
+
+    int not_found = 1;
+    int cursor = 0;
+    struct mfs_dirent entry;
+
+    while (mfs_readdir(fs, &cursor, &entry) == MFS_OK)
+    {
+        uint8_t attribute = entry.st.attribute;
+
+        if ((attribute & MFS_HIDDEN) && !show_hidden)
+        {
+            continue;
+        }
+
+        not_found = 0;
+
+        char *date = ctime(&entry.st.date);
+        trim(date);
+
+        if (!show_attributes)
+        {
+            printf("%d %s %s\n", entry.st.size, date, entry.name);
+            continue;
+        }
+
+        printf("%d %s %s ", entry.st.size, date, entry.name);
+
+        // Print the value of the attribute as an 8 bit binary value
+        printf("%d%d%d%d%d%d%d%d\n",
+        (attribute >> 7) & 0x01,
+        (attribute >> 6) & 0x01,
+        (attribute >> 5) & 0x01,
+        (attribute >> 4) & 0x01,
+        (attribute >> 3) & 0x01,
+        (attribute >> 2) & 0x01,
+        (attribute >> 1) & 0x01,
+         attribute & 0x01);
+    }
+
+    if (not_found)
+    {
+        printf("list: No files found.\n");
+    }
+}
+
+// Reads a whole host file into memory.
+uint8_t *readHostFile(char *command, char *hostfile, uint32_t *size)
+{
+    // Input: char *command - Command name used to prefix error messages.
+    //        char *hostfile - The host file to read.
+    //        uint32_t *size - Receives the file's size.
+    // Output: uint8_t *. The contents, freed by the caller, or NULL after
+    //         an error has been printed.
+
+    const char *error;
+    uint8_t *data = loadHostFile(hostfile, size, &error);
+
+    if (data == NULL)
+    {
+        printf("%s: %s.\n", command, error);
+    }
+
+    return data;
+}
+
+// Reads a whole host file into memory without printing.
+uint8_t *loadHostFile(char *hostfile, uint32_t *size, const char **error)
+{
+    // Input: char *hostfile - The host file to read.
+    //        uint32_t *size - Receives the file's size.
+    //        const char **error - Receives a message if the file can not be read.
+    // Output: uint8_t *. The contents, freed by the caller, or NULL.
+    // Description: Safe to call from several threads at once. Files read
+    //              are logged under --record, and under --replay the
+    //              recorded size is generated instead of reading the file.
+
+    if (replaying)
+    {
+        return replayHostFile(hostfile, size, error);
+    }
+
+    // Verify the file exists.
+    struct stat buf;
+
+    if (stat(hostfile, &buf) == -1)
+    {
+        *error = "File does not exist";
+        return NULL;
+    }
+
+    // Verify the file isn't too big.
+    if (buf.st_size > MFS_MAX_FILE_SIZE)
+    {
+        *error = "File is too large";
+        return NULL;
+    }
+
+    FILE *ifp = fopen(hostfile, "r");
+
+    if (ifp == NULL)
+    {
+        *error = "Can not open file";
+        return NULL;
+    }
+
+    // One spare byte so an empty file still gets a buffer.
+    uint8_t *data = malloc(buf.st_size + 1);
+
+    if (data == NULL)
+    {
+        *error = "Out of memory";
+        fclose(ifp);
+        return NULL;
+    }
+
+    if (fread(data, 1, buf.st_size, ifp) != buf.st_size)
+    {
+        *error = "An error occured reading from the input file";
+        free(data);
+        fclose(ifp);
+        return NULL;
+    }
+
+    fclose(ifp);
+
+    *size = buf.st_size;
+
+    if (recording)
+    {
+        recordHostFile(hostfile, data, *size);
+    }
+
+    return data;
+}
+
+// The insert command.
+void insert(char *filename, uint8_t *key)
+{
+    // Input: char *filename - The file to put into the file system.
+    //        uint8_t *key - ChaCha20 key to encrypt the file with, or NULL.
+    // Output: void. Inserts filename into the file system.
+
+    uint32_t size;
+    uint8_t *data = readHostFile("insert", filename, &size);
+
+    if (data == NULL)
+    {
+        return;
+    }
+
+    printf("Reading %d bytes from %s\n", (int)size, filename);
+
+    report("insert", mfs_insert(fs, filename, data, size, key));
+
+    free(data);
+}
+
+// Host files being read for insertMany().
+struct hostRead
+{
+    char **paths;
+    struct mfs_file *files;
+    const char **errors;
+    int count;
+    int next;               // Next path to read, taken atomically
+};
+
+// Thread body for insertMany().
+void *hostReadWorker(void *arg)
+{
+    struct hostRead *job = (struct hostRead *)arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        job->files[i].name = job->paths[i];
+        job->files[i].data = loadHostFile(job->paths[i], &job->files[i].size, &job->errors[i]);
+    }
+
+    return NULL;
+}
+
+// The insert command with several files, glob patterns or a manifest.
+void insertMany(char **args, int count, int manifest, uint8_t *key)
+{
+    // Input: char **args - File names or glob patterns, or with manifest set
+    //                      the one manifest file. NULL entries are skipped.
+    //        int count - Entries in args.
+    //        int manifest - 1 if args[0] lists the files one per line.
+    //        uint8_t *key - ChaCha20 key to encrypt the files with, or NULL.
+    // Output: void. Inserts every file that could be read as one batch.
+    // Description: The host files are read by a pool of threads, then
+    //              handed to mfs_insert_batch() together, which stores them
+    //              in parallel and adds them to the directory in one step.
+
+    char **paths = NULL;
+    int files_count = 0;
+
+    // Globs and manifests name host files that need not exist under
+    // --replay, so take the files the command read when it was recorded.
+    if (replaying)
+    {
+        for (int i = 0; replayHostPath(i) != NULL; i++)
+        {
+            files_count = addPath(&paths, files_count, (char *)replayHostPath(i));
+        }
+    }
+    else if (manifest)
+    {
+        FILE *fp = fopen(args[0], "r");
+
+        if (fp == NULL)
+        {
+            printf("insert: Can not open manifest.\n");
+            return;
+        }
+
+        // Lines are taken as they are, without glob expansion.
+        char line[MAX_COMMAND_SIZE];
+
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+            trim(line);
+
+            if (line[0] == '\0' || line[0] == '#')
+            {
+                continue;
+            }
+
+            files_count = addPath(&paths, files_count, line);
+        }
+
+        fclose(fp);
+    }
+    else
+    {
+        for (int i = 0; i < count; i++)
+        {
+            glob_t matches;
+
+            if (args[i] == NULL)
+            {
+                continue;
+            }
+
+            // A pattern that matches nothing is kept, so it is reported as
+            // a file that does not exist.
+            if (glob(args[i], GLOB_NOCHECK, NULL, &matches) == 0)
+            {
+                for (size_t m = 0; m < matches.gl_pathc; m++)
+                {
+                    files_count = addPath(&paths, files_count, matches.gl_pathv[m]);
+                }
+                globfree(&matches);
+            }
+        }
+    }
+
+    if (files_count <= 0)
+    {
+        printf(files_count == 0 ? "insert: No filename specified.\n" : "insert: Out of memory.\n");
+        freePaths(paths, -files_count);
+        return;
+    }
+
+    struct mfs_file *files = calloc(files_count, sizeof(struct mfs_file));
+    const char **errors = calloc(files_count, sizeof(char *));
+
+    if (files == NULL || errors == NULL)
+    {
+        printf("insert: Out of memory.\n");
+        free(files);
+        free(errors);
+        freePaths(paths, files_count);
+        return;
+    }
+
+    struct hostRead job = { paths, files, errors, files_count, 0 };
+    int threads = files_count < HOST_IO_THREADS ? files_count : HOST_IO_THREADS;
+    pthread_t tids[HOST_IO_THREADS];
+    int spawned[HOST_IO_THREADS] = { 0 };
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int t = 1; t < threads; t++)
+    {
+        spawned[t] = pthread_create(&tids[t], NULL, hostReadWorker, &job) == 0;
+    }
+    hostReadWorker(&job);
+    for (int t = 1; t < threads; t++)
+    {
+        if (spawned[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+    }
+
+    // Files that could not be read are left out of the batch.
+    struct mfs_file *batch = calloc(files_count, sizeof(struct mfs_file));
+    int batch_count = 0;
+    uint64_t bytes = 0;
+
+    for (int i = 0; i < files_count && batch != NULL; i++)
+    {
+        if (files[i].data == NULL)
+        {
+            printf("insert: %s: %s.\n", files[i].name, errors[i]);
+            continue;
+        }
+
+        batch[batch_count++] = files[i];
+    }
+
+    int inserted = 0;
+
+    if (batch == NULL)
+    {
+        printf("insert: Out of memory.\n");
+    }
+    else
+    {
+        mfs_insert_batch(fs, batch, batch_count, key);
+
+        for (int i = 0; i < batch_count; i++)
+        {
+            if (batch[i].result != MFS_OK)
+            {
+                printf("insert: %s: %s.\n", batch[i].name, mfs_strerror(batch[i].result));
+                continue;
+            }
+
+            inserted++;
+            bytes += batch[i].size;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("Inserted %d of %d files, %llu bytes in %.3f s.\n", inserted, files_count,
+           (unsigned long long)bytes,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    for (int i = 0; i < files_count; i++)
+    {
+        free((void *)files[i].data);
+    }
+
+    free(batch);
+    free(files);
+    free(errors);
+    freePaths(paths, files_count);
+}
+
+// Appends a copy of a path to a growing list.
+int addPath(char ***paths, int count, char *path)
+{
+    // Input: char ***paths - The list, grown as needed.
+    //        int count - Paths already in the list, negative once out of memory.
+    //        char *path - The path to add.
+    // Output: int. The new count, or -count if out of memory, after which
+    //         further paths are ignored.
+
+    if (count < 0)
+    {
+        return count;
+    }
+
+    // Grow by doubling once the count reaches a power of two.
+    if ((count & (count - 1)) == 0)
+    {
+        char **grown = realloc(*paths, (count ? 2 * count : 16) * sizeof(char *));
+
+        if (grown == NULL)
+        {
+            return -count;
+        }
+        *paths = grown;
+    }
+
+    (*paths)[count] = strdup(path);
+
+    if ((*paths)[count] == NULL)
+    {
+        return -count;
+    }
+
+    return count + 1;
+}
+
+// Frees a list built by addPath().
+void freePaths(char **paths, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+// The write and append commands.
+void writeFile(char *command, char *filename, int offset, char *hostfile)
+{
+    // Input: char *command - Command name used to prefix error messages.
+    //        char *filename - The file in the file system to modify.
+    //        int offset - Byte offset to start writing at, -1 to append.
+    //        char *hostfile - The host file whose contents are written.
+    // Output: void. Overwrites or extends the file with hostfile's contents.
+
+    if (offset < 0 && offset != MFS_APPEND)
+    {
+        printf("%s: Invalid offset.\n", command);
+        return;
+    }
+
+    uint32_t size;
+    uint8_t *data = readHostFile(command, hostfile, &size);
+
+    if (data == NULL)
+    {
+        return;
+    }
+
+    report(command, mfs_write(fs, filename, offset, data, size));
+
+    free(data);
+}
+
+// The truncate command.
+void truncateFile(char *filename, int size)
+{
+    // Input: char *filename - The file to resize.
+    //        int size - The new size in bytes.
+    // Output: void. Shrinks or extends the file to size bytes.
+
+    if (size < 0)
+    {
+        printf("truncate: Invalid size.\n");
+        return;
+    }
+
+    report("truncate", mfs_truncate(fs, filename, size));
+}
+
+// The attrib command.
+void attrib(char *attribute, char *filename)
+{
+    // Input: char *attribute - the attribute we want to add/subtract.
+    //        char *filename - The file we want to edit.
+    // Output: void. Sets or removes an attribute from the file.
+
+    uint8_t set = 0;
+    uint8_t clear = 0;
+
+	if (strcmp(attribute, "+h") == 0)
+	{
+		set = MFS_HIDDEN;
+	}
+	else if (strcmp(attribute, "+r") == 0)
+	{
+		set = MFS_READONLY;
+	}
+	else if (strcmp(attribute, "-h") == 0)
+	{
+		clear = MFS_HIDDEN;
+	}
+	else if (strcmp(attribute, "-r") == 0)
+	{
+		clear = MFS_READONLY;
+	}
+
+    report("attrib", mfs_setattr(fs, filename, set, clear));
+}
+
+// The snapshots command.
+void listSnapshots()
+{
+    // Input: None.
+    // Output: void. Prints each snapshot's name and the time it was taken.
+
+    int found = 0;
+    int cursor = 0;
+    struct mfs_snapinfo info;
+
+    while (mfs_snapshot_next(fs, &cursor, &info) == MFS_OK)
+    {
+        char *date = ctime(&info.date);
+        trim(date);
+
+        printf("%s %s\n", date, info.name);
+        found = 1;
+    }
+
+    if (!found)
+    {
+        printf("snapshots: No snapshots found.\n");
+    }
+}
+
+// The read command.
+void readFile(char *filename, int start, int num_bytes, uint8_t *key)
+{
+    // Input: char *filename - The file we want to read.
+    //        int start - the bytes we want to start reading the file at.
+    //        int num_bytes - the number of bytes we want to read.
+    //        uint8_t *key - ChaCha20 key for an encrypted file, or NULL.
+    // Output: void. reads a file from the file system and prints its
+    //         hexadecimal values.
+
+    struct mfs_stat st;
+
+    if (report("read", mfs_stat(fs, filename, &st)) != MFS_OK)
+    {
+        return;
+    }
+
+    if (start < 0 || num_bytes < 0 || start >= st.size)
+    {
+        printf("read: Invalid byte range.\n");
+        return;
+    }
+
+    if (num_bytes > st.size - start)
+    {
+        num_bytes = st.size - start;
+    }
+
+    uint8_t *buffer = malloc(num_bytes + 1);
+
+    if (buffer == NULL)
+    {
+        printf("read: Out of memory.\n");
+        return;
+    }
+
+    int bytes = mfs_read(fs, filename, start, buffer, num_bytes, key);
+
+    if (report("read", bytes) >= 0)
+    {
+        for (int i = 0; i < bytes; i++)
+        {
+            printf("%02x ", buffer[i]);
+        }
+
+        printf("\n");
+    }
+
+    free(buffer);
+}
+
+// The retrieve command.
+void retrieve(char *snapshot, char *filename, char *new_filename, uint8_t *key)
+{
+    // Input: char *snapshot - Snapshot to retrieve the file from, or NULL
+    //                         for the live file.
+    //        char *filename - The file we want to retrieve.
+    //        char *new_filename - Optional name for the retrieved file.
+    //        uint8_t *key - ChaCha20 key for an encrypted file, or NULL.
+    // Output: void. retrieve a file from the file system and place it
+    //               in the current working directory.
+    // Description: The whole file is read, and verified if verification
+    //              is on, before the output file is created so a corrupt
+    //              file never overwrites a good copy on the host.
+
+    struct mfs_stat st;
+    int err;
+
+    if (snapshot != NULL)
+    {
+        err = mfs_snapshot_stat(fs, snapshot, filename, &st);
+    }
+    else
+    {
+        err = mfs_stat(fs, filename, &st);
+    }
+
+    if (report("retrieve", err) != MFS_OK)
+    {
+        return;
+    }
+
+    uint8_t *buffer = malloc(st.size + 1);
+
+    if (buffer == NULL)
+    {
+        printf("retrieve: Out of memory.\n");
+        return;
+    }
+
+    int bytes;
+
+    if (snapshot != NULL)
+    {
+        bytes = mfs_snapshot_read(fs, snapshot, filename, 0, buffer, st.size);
+    }
+    else
+    {
+        bytes = mfs_read(fs, filename, 0, buffer, st.size, key);
+    }
+
+    if (report("retrieve", bytes) < 0)
+    {
+        free(buffer);
+        return;
+    }
+
+    FILE *ofp;
+
+    if (new_filename != NULL)
+    {
+        ofp = fopen(new_filename, "w");
+    }
+    else
+    {
+        ofp = fopen(filename, "w");
+    }
+
+    if (ofp == NULL)
+    {
+        printf("retrieve: Could not open output file: %s\n", filename);
+        free(buffer);
+        return;
+    }
+
+    printf("Writing %d bytes to %s\n", bytes, filename);
+
+    fwrite(buffer, 1, bytes, ofp);
+
+    free(buffer);
+
+    // Close the output file, we're done.
+    fclose(ofp);
+}
+
+// Files being written out by retrieveAll().
+struct hostWrite
+{
+    char *directory;
+    struct mfs_dirent *entries;
+    int *results;           // Bytes read from the image, or a libmfs error code
+    int *host_errors;       // errno if the host file could not be written
+    int count;
+    int next;               // Next entry to write, taken atomically
+};
+
+// Thread body for retrieveAll().
+void *hostWriteWorker(void *arg)
+{
+    struct hostWrite *job = (struct hostWrite *)arg;
+    uint8_t *buffer = malloc(MFS_MAX_FILE_SIZE);
+    char path[PATH_MAX];
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        if (buffer == NULL)
+        {
+            job->results[i] = MFS_ENOMEM;
+            continue;
+        }
+
+        // The whole file is read before the output is created, as
+        // retrieve() does, so a bad file never replaces a good copy.
+        int bytes = mfs_read(fs, job->entries[i].name, 0, buffer, MFS_MAX_FILE_SIZE, NULL);
+
+        if (bytes >= 0)
+        {
+            if (hostPath(path, sizeof(path), job->directory, job->entries[i].name) == -1 ||
+                writeHostFile(path, buffer, bytes) == -1)
+            {
+                job->host_errors[i] = errno;
+            }
+        }
 
-    if (ret == -1)
-    {
-        printf("insert: File does not exist.\n");
-        return;
+        job->results[i] = bytes;
     }
 
-    // Verify the file isn't too big.
-    if (buf.st_size > MAX_FILE_SIZE)
+    free(buffer);
+
+    return NULL;
+}
+
+// Builds the host path a file is retrieved to under a directory.
+int hostPath(char *path, size_t size, char *directory, char *name)
+{
+    // Input: char *path - Receives <directory>/<name>.
+    //        size_t size - Bytes in path.
+    //        char *directory - The host directory, which exists.
+    //        char *name - The file's name in the image, such as data/a.txt
+    //                     from a batch insert.
+    // Output: int. 0, or -1 with errno set.
+    // Description: Directories in the name are created under directory. A
+    //              name with a .. component is refused with EINVAL, so no
+    //              file is written outside directory.
+
+    for (char *part = name; part != NULL; part = strchr(part, '/'))
     {
-        printf("insert: File is too large.\n");
-        return;
+        part += *part == '/';
+
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0'))
+        {
+            errno = EINVAL;
+            return -1;
+        }
     }
 
-    // Verify that there is enough disk space.
-    if (buf.st_size > df())
+    if (snprintf(path, size, "%s/%s", directory, name) >= (int)size)
     {
-        printf("insert: Not enough free disk space.\n");
-        return;
+        errno = ENAMETOOLONG;
+        return -1;
     }
 
-    // Find an empty directory entry
-    int directory_entry = searchDirectory(filename);
-    int rewrite = 1;
-
-    if (directory_entry == -1)
+    // Other threads may be creating the same directories.
+    for (char *slash = strchr(path + strlen(directory) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
     {
-        rewrite = 0;
-        for (int i = 0; i < NUM_FILES; i++)
+        *slash = '\0';
+        int ret = mkdir(path, 0777);
+        *slash = '/';
+
+        if (ret == -1 && errno != EEXIST)
         {
-            if (directory_ptr[i].in_use == 0)
-            {
-                directory_entry = i;
-                break;
-            }
+            return -1;
         }
     }
-    
-    if (directory_entry == -1)
-    {
-        printf("insert: Could not find a free directory entry.\n");
-        return;
-    }
-
-    // Open the input file read-only 
-    FILE *ifp = fopen (filename, "r"); 
-    printf("Reading %d bytes from %s\n", (int)buf.st_size, filename);
- 
-    // Save off the size of the input file since we'll use it in a couple of places and 
-    // also initialize our index variables to zero. 
-    int32_t copy_size = buf.st_size;
 
-    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-    int32_t offset = 0;               
+    return 0;
+}
 
-    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-    // memory pool. Why? We are simulating the way the file system stores file data in
-    // blocks of space on the disk. block_index will keep us pointing to the area of
-    // the area that we will read from or write to.
-    int32_t block_index = -1;
+// Creates a host file holding size bytes of data.
+int writeHostFile(char *path, uint8_t *data, uint32_t size)
+{
+    // Input: char *path - The host file to create or replace.
+    //        uint8_t *data - The contents.
+    //        uint32_t size - Bytes in data.
+    // Output: int. 0, or -1 if the file could not be written.
+    // Description: The file's space is allocated up front so it is laid out
+    //              in one piece, then written with as few writev() calls as
+    //              possible, WRITE_CHUNK bytes per iovec.
 
-    // Find a free inode.
-    int32_t inode_index = -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-    if (rewrite == 1)
+    if (fd == -1)
     {
-        inode_index = directory_ptr[directory_entry].inode;
+        return -1;
     }
-    else
+
+    // Not every host filesystem supports this, and the writes work without it.
+    if (size > 0)
     {
-        inode_index = findFreeInode();
+        fallocate(fd, 0, 0, size);
     }
 
-    if (inode_index == -1)
+    struct iovec iov[MFS_MAX_FILE_SIZE / WRITE_CHUNK + 1];
+    int iov_count = 0;
+
+    for (uint32_t offset = 0; offset < size; offset += WRITE_CHUNK)
     {
-        printf("insert: Can not find a free inode.\n");
-        return;
+        iov[iov_count].iov_base = data + offset;
+        iov[iov_count].iov_len = size - offset < WRITE_CHUNK ? size - offset : WRITE_CHUNK;
+        iov_count++;
     }
 
-    // Place the file info in the directory
-    directory_ptr[directory_entry].in_use = 1;
-    directory_ptr[directory_entry].inode = inode_index;
-    strncpy(directory_ptr[directory_entry].filename, filename, strlen(filename));
+    struct iovec *next = iov;
 
-    // Place the file info in the inode
-    inode_ptr[inode_index].file_size = buf.st_size;
-    inode_ptr[inode_index].in_use = 1;
-    inode_ptr[inode_index].date = time(NULL);
-    inode_ptr[inode_index].attribute &= ~HIDDEN;
-    inode_ptr[inode_index].attribute &= ~READONLY;
-
-    int i = 0;
- 
-    // copy_size is initialized to the size of the input file so each loop iteration we
-    // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-    // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-    // we have copied all the data from the input file.
-    while (copy_size > 0)
+    while (iov_count > 0)
     {
-        // Index into the input file by offset number of bytes.  Initially offset is set to
-        // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-        // then increase the offset by BLOCK_SIZE and continue the process.  This will
-        // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-        fseek(ifp, offset, SEEK_SET);
-    
-        // Read BLOCK_SIZE number of bytes from the input file and store them in our
-        // data array. 
-
-        // Find a free block.
-        block_index = findFreeBlock();
+        ssize_t written = writev(fd, next, iov_count);
 
-        if (block_index == -1)
+        if (written == -1)
         {
-            printf("insert: Can not find a free block.\n");
-            return;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return -1;
         }
 
-        int32_t bytes = fread(data_blocks[block_index], BLOCK_SIZE, 1, ifp);
-
-        // Save the block in the inode
-        int32_t inode_block = -1;
-
-        if (rewrite == 1)
-        {
-            inode_block = inode_ptr[inode_index].blocks[i++];
-        }
-        else
+        // Skip what was written; a short write resumes mid-iovec.
+        while (iov_count > 0 && (size_t)written >= next->iov_len)
         {
-            inode_block = findFreeInodeBlock(inode_index);
+            written -= next->iov_len;
+            next++;
+            iov_count--;
         }
-        
-        inode_ptr[inode_index].blocks[inode_block] = block_index;
-
-        // If bytes == 0 and we haven't reached the end of the file then something is 
-        // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-        // It means we've reached the end of our input file.
-        if (bytes == 0 && !feof(ifp))
+        if (iov_count > 0)
         {
-            printf("An error occured reading from the input file.\n");
-            return;
+            next->iov_base = (uint8_t *)next->iov_base + written;
+            next->iov_len -= written;
         }
-
-        // Clear the EOF file flag.
-        clearerr(ifp);
-
-        // Reduce copy_size by the BLOCK_SIZE bytes.
-        copy_size -= BLOCK_SIZE;
-        
-        // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-        // the fseek at the top of the loop to position us to the correct spot.
-        offset += BLOCK_SIZE;
-
-        // block_index = findFreeBlock();
     }
 
-    // We are done copying from the input file so close it out.
-    fclose(ifp);
+    return close(fd);
 }
 
-// Used for encryption/decryption.
-void XOR_insert(char *filename)
+// The retrieve -a command.
+void retrieveAll(char *directory, char *pattern)
 {
-    // Input: char *filename - The file to put into the file system.
-    // Output: void. Inserts filename into the file system.
-    // Description: After checking if the file exists, the input read-only
-    //              file is open. Data is copied and stored into 
-    //              the file system in BLOCK_SIZE chunks
-
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
+    // Input: char *directory - Host directory to write the files into,
+    //                          created if missing.
+    //        char *pattern - Glob pattern the names must match, or NULL
+    //                        for every file.
+    // Output: void. Copies the files out, reporting any that fail by name.
+    // Description: A pool of threads reads files from the image and writes
+    //              them to the host at the same time. Encrypted files are
+    //              written as stored, as retrieve does without -k.
+
+    if (mkdir(directory, 0777) == -1 && errno != EEXIST)
     {
-        printf("insert: Filename is NULL\n");
+        printf("retrieve: Can not create directory %s.\n", directory);
         return;
     }
 
-    // Verify name isn't too long.
-    if (strlen(filename) > 64)
-	{
-		printf("insert: Only supports filenames of up to 64 characters.\n");
-		return;
-	}
-
-    // Verify the file exists.
-    struct stat buf;
-    int ret = stat(filename, &buf);
+    struct mfs_dirent *entries = malloc(MFS_MAX_FILES * sizeof(struct mfs_dirent));
+    int *results = malloc(MFS_MAX_FILES * sizeof(int));
+    int *host_errors = calloc(MFS_MAX_FILES, sizeof(int));
+    int count = 0;
 
-    if (ret == -1)
+    if (entries == NULL || results == NULL || host_errors == NULL)
     {
-        printf("insert: File does not exist.\n");
+        printf("retrieve: Out of memory.\n");
+        free(entries);
+        free(results);
+        free(host_errors);
         return;
     }
 
-    // Verify the file isn't too big.
-    if (buf.st_size > MAX_FILE_SIZE)
-    {
-        printf("insert: File is too large.\n");
-        return;
-    }
+    int cursor = 0;
 
-    // Verify that there is enough disk space.
-    if (buf.st_size > df())
+    while (count < MFS_MAX_FILES && mfs_readdir(fs, &cursor, &entries[count]) == MFS_OK)
     {
-        printf("insert: Not enough free disk space.\n");
-        return;
+        if (pattern == NULL || fnmatch(pattern, entries[count].name, 0) == 0)
+        {
+            count++;
+        }
     }
 
-    // Find an empty directory entry
-    int directory_entry = searchDirectory(filename);
-    
-    if (directory_entry == -1)
+    if (count == 0)
     {
-        printf("insert: Could not find a free directory entry.\n");
+        printf("retrieve: No files found.\n");
+        free(entries);
+        free(results);
+        free(host_errors);
         return;
     }
 
-    // Open the input file read-only 
-    FILE *ifp = fopen (filename, "r"); 
- 
-    // Save off the size of the input file since we'll use it in a couple of places and 
-    // also initialize our index variables to zero. 
-    int32_t copy_size = buf.st_size;
-
-    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-    int32_t offset = 0;               
+    struct hostWrite job = { directory, entries, results, host_errors, count, 0 };
+    int threads = count < HOST_IO_THREADS ? count : HOST_IO_THREADS;
+    pthread_t tids[HOST_IO_THREADS];
+    int spawned[HOST_IO_THREADS] = { 0 };
 
-    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-    // memory pool. Why? We are simulating the way the file system stores file data in
-    // blocks of space on the disk. block_index will keep us pointing to the area of
-    // the area that we will read from or write to.
-    int32_t block_index = -1;
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    // Find a free inode.
-    int32_t inode_index = -1;
-
-    
-    inode_index = directory_ptr[directory_entry].inode;
-    
-    if (inode_index == -1)
+    for (int t = 1; t < threads; t++)
     {
-        printf("insert: Can not find a free inode.\n");
-        return;
+        spawned[t] = pthread_create(&tids[t], NULL, hostWriteWorker, &job) == 0;
     }
-
-    // Place the file info in the directory
-    directory_ptr[directory_entry].in_use = 1;
-    directory_ptr[directory_entry].inode = inode_index;
-    strncpy(directory_ptr[directory_entry].filename, filename, strlen(filename));
-
-    // Place the file info in the inode
-    inode_ptr[inode_index].file_size = buf.st_size;
-    inode_ptr[inode_index].in_use = 1;
-    
-    int i = 0;
- 
-    // copy_size is initialized to the size of the input file so each loop iteration we
-    // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-    // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-    // we have copied all the data from the input file.
-    while (copy_size > 0)
+    hostWriteWorker(&job);
+    for (int t = 1; t < threads; t++)
     {
-        // Index into the input file by offset number of bytes.  Initially offset is set to
-        // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-        // then increase the offset by BLOCK_SIZE and continue the process.  This will
-        // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-        fseek(ifp, offset, SEEK_SET);
-    
-        // Read BLOCK_SIZE number of bytes from the input file and store them in our
-        // data array. 
-
-        // Find a free block.
-        block_index = findFreeBlock();
-
-        if (block_index == -1)
+        if (spawned[t])
         {
-            printf("insert: Can not find a free block.\n");
-            return;
+            pthread_join(tids[t], NULL);
         }
+    }
 
-        int32_t bytes = fread(data_blocks[block_index], BLOCK_SIZE, 1, ifp);
-
-        // Save the block in the inode
-        int32_t inode_block = -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-       
-        inode_block = inode_ptr[inode_index].blocks[i++];
-        
-        inode_ptr[inode_index].blocks[inode_block] = block_index;
+    int written = 0;
+    uint64_t bytes = 0;
 
-        // If bytes == 0 and we haven't reached the end of the file then something is 
-        // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-        // It means we've reached the end of our input file.
-        if (bytes == 0 && !feof(ifp))
+    for (int i = 0; i < count; i++)
+    {
+        if (results[i] < 0)
         {
-            printf("An error occured reading from the input file.\n");
-            return;
+            printf("retrieve: %s: %s.\n", entries[i].name, mfs_strerror(results[i]));
+        }
+        else if (host_errors[i] != 0)
+        {
+            printf("retrieve: %s: Could not write output file: %s.\n", entries[i].name,
+                   strerror(host_errors[i]));
+        }
+        else
+        {
+            written++;
+            bytes += results[i];
         }
-
-        // Clear the EOF file flag.
-        clearerr(ifp);
-
-        // Reduce copy_size by the BLOCK_SIZE bytes.
-        copy_size -= BLOCK_SIZE;
-        
-        // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-        // the fseek at the top of the loop to position us to the correct spot.
-        offset += BLOCK_SIZE;
-
-        // block_index = findFreeBlock();
     }
 
-    // We are done copying from the input file so close it out.
-    fclose(ifp);
+    printf("Retrieved %d of %d files, %llu bytes to %s in %.3f s.\n", written, count,
+           (unsigned long long)bytes, directory,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    free(entries);
+    free(results);
+    free(host_errors);
 }
 
-// The attrib command.
-void attrib(char *attribute, char *filename)
+// The cache command.
+void cacheStats()
 {
-    // Input: char *attribute - the attribute we want to add/subtract.
-    //        char *filename - The file we want to edit.
-    // Output: void. Sets or removes an attribute from the file.
-    // Description: After checking if the file exists in the directory, 
-    //              if-else statements set/remove the attribute bit
-    //              in the file.
+    // Input: None.
+    // Output: void. Prints the image memory and its pages, then the block
+    //         cache's size and hit rate.
 
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
-    {
-        printf("attrib: Filename is NULL\n");
-        return;
-    }
+    struct mfs_cache_stats stats;
 
-	int directory_entry = searchDirectory(filename);
-	
-    if (directory_entry == -1)
-	{	
-		printf("attrib: File not found in directory.\n");
-        return;
-	}
-    if (directory_ptr[directory_entry].in_use == 0)
-    {
-        printf("attrib: File not found in directory.\n");
-        return;
-    }
-	
-	int inode_index = directory_ptr[directory_entry].inode;
-	
-	if (strcmp(attribute, "+h") == 0)
-	{
-		inode_ptr[inode_index].attribute |= HIDDEN;
-	}	
-	else if (strcmp(attribute, "+r") == 0)
-	{
-		inode_ptr[inode_index].attribute |= READONLY;
-	}
-	else if (strcmp(attribute, "-h") == 0)
-	{
-		inode_ptr[inode_index].attribute &= ~HIDDEN;
-	}
-	else if (strcmp(attribute, "-r") == 0)
-	{
-		inode_ptr[inode_index].attribute &= ~READONLY;
-	}
-}
+    mfs_cache_stats(fs, &stats);
 
-// The delete command.
-void delete(char *filename)
-{
-    // Input: char *filename - The file we want to delete.
-    // Output: void. deletes a file from the file system.
-    // Description: After checking if the file exists in the directory, 
-    //              directory_entry, inode_index, and blocks
-    //              associated with the inode are set to free.
+    printf("cache: %.1f MiB of image memory in %s pages.\n", stats.memory_bytes / 1048576.0,
+           stats.pages == MFS_PAGES_SMALL ? "base" : stats.pages == MFS_PAGES_TRANSPARENT ?
+           "transparent huge" : "explicit huge");
 
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
+    if (stats.capacity == 0)
     {
-        printf("delete: Filename is NULL\n");
+        printf("cache: Image is fully resident.\n");
         return;
     }
 
-	int directory_entry = searchDirectory(filename);
+    uint64_t lookups = stats.hits + stats.misses;
 
-	if (directory_entry == -1)
-	{	
-		printf("delete: File not found in directory.\n");
-        return;
-	}
+    printf("cache: %d blocks, %llu hits, %llu misses (%.1f%% hit rate), %llu spilled, %llu I/O errors.\n",
+           stats.capacity,
+           (unsigned long long)stats.hits,
+           (unsigned long long)stats.misses,
+           lookups ? 100.0 * stats.hits / lookups : 0.0,
+           (unsigned long long)stats.writebacks,
+           (unsigned long long)stats.io_errors);
+}
 
-	int inode_index = directory_ptr[directory_entry].inode;
-	
-	if (inode_ptr[inode_index].attribute & READONLY)
-	{
-		printf("delete: The file is marked read-only and can not be deleted.\n");
-		return;
-	}
+// The stats command.
+void printStats()
+{
+    // Input: None.
+    // Output: void. Prints the count and latency of every command run since
+    //         the last reset, then the open image's counters and the
+    //         latency of the library calls behind insert, read, savefs and
+    //         open.
 
-    directory_ptr[directory_entry].in_use = 0;
-	inode_ptr[inode_index].in_use = 0;
-    free_inodes[inode_index] = 1;
+    printf("%-16s %8s %10s %10s %10s %10s\n", "command", "count", "p50", "p90", "p99", "max");
 
-    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) 
+    for (int i = 0; i < (int)NUM_COMMANDS; i++)
     {
-        int block_index = inode_ptr[inode_index].blocks[i];
-        free_blocks[block_index] = 1;
+        if (command_latency[i].count > 0)
+        {
+            printLatency(commands[i].name, &command_latency[i]);
+        }
     }
-}
-
-// The undelete command.
-void undelete(char *filename)
-{
-    // Input: char *filename - The file we want to undelete.
-    // Output: void. undeletes a file from the file system.
-    // Description: After checking if the file exists in the directory, 
-    //              directory_entry, inode_index, and blocks
-    //              associated with the inode are set to in use.
 
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
+    if (fs == NULL)
     {
-        printf("undelete: Filename is NULL\n");
         return;
     }
 
-	int directory_entry = searchDirectory(filename);
-
-	if (directory_entry == -1)
-	{	
-		printf("undelete: File not found in directory.\n");
-        return;
-	}
+    struct mfs_stats stats;
 
-    int inode_index = directory_ptr[directory_entry].inode;
+    mfs_stats(fs, &stats);
 
-    directory_ptr[directory_entry].in_use = 1;
-	inode_ptr[inode_index].in_use = 1;
-    free_inodes[inode_index] = 0;
+    const char *names[] = { "mfs_insert", "mfs_read", "mfs_save", "mfs_open" };
+    const struct mfs_histogram *calls[] = { &stats.insert, &stats.read, &stats.save, &stats.open };
 
-    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) 
+    for (int i = 0; i < 4; i++)
     {
-        int block_index = inode_ptr[inode_index].blocks[i];
-        free_blocks[block_index] = 0;
+        if (calls[i]->count > 0)
+        {
+            printLatency(names[i], calls[i]);
+        }
     }
+
+    printf("%llu bytes written, %llu bytes read.\n",
+           (unsigned long long)stats.bytes_written, (unsigned long long)stats.bytes_read);
+    printf("%llu blocks allocated, %llu blocks freed, %llu free map entries scanned.\n",
+           (unsigned long long)stats.blocks_allocated, (unsigned long long)stats.blocks_freed,
+           (unsigned long long)stats.blocks_scanned);
+    printf("%llu system calls on the image file.\n", (unsigned long long)stats.syscalls);
 }
 
-// The read command.
-void readFile(char *filename, int start, int num_bytes)
+// Prints one line of the stats table.
+void printLatency(const char *name, const struct mfs_histogram *hist)
 {
-    // Input: char *filename - The file we want to read.
-    //        int start - the bytes we want to start reading the file at.
-    //        int num_bytes - the number of bytes we want to read.
-    // Output: void. reads a file from the file system and prints its
-    //         hexadecimal values.
-    // Description: After checking if the file exists in the directory, 
-    //              fseek is used to go to the start pos.
-    //              fread reads the number of bytes and is stored in buffer[num_bytes];
-    //              for loop prints what's stored in buffer as hexadecimal values.
-    
-    // Verify file is in directory
-    int directory_entry = searchDirectory(filename);
-	if (directory_entry == -1)
-	{	
-		printf("read: File not found in directory.\n");
-        return;
-	}
-    if (directory_ptr[directory_entry].in_use == 0)
+    char p50[16], p90[16], p99[16], max[16];
+
+    printf("%-16s %8llu %10s %10s %10s %10s\n", name, (unsigned long long)hist->count,
+           formatNs(mfs_hist_percentile(hist, 50), p50),
+           formatNs(mfs_hist_percentile(hist, 90), p90),
+           formatNs(mfs_hist_percentile(hist, 99), p99),
+           formatNs(hist->max_ns, max));
+}
+
+// Formats a latency with a unit that keeps it short.
+char *formatNs(uint64_t ns, char *buf)
+{
+    if (ns < 1000)
     {
-        printf("read: File not found in directory.\n");
-        return;
+        sprintf(buf, "%llu ns", (unsigned long long)ns);
+    }
+    else if (ns < 1000000)
+    {
+        sprintf(buf, "%.1f us", ns / 1e3);
+    }
+    else if (ns < 1000000000)
+    {
+        sprintf(buf, "%.1f ms", ns / 1e6);
+    }
+    else
+    {
+        sprintf(buf, "%.2f s", ns / 1e9);
     }
 
-    readFileRetrieve(filename, directory_entry);
+    return buf;
+}
 
-    FILE *fp = fopen("temp", "rb");
-    
-    if (fp == NULL) 
-    { 
-        printf("read: Can not open file.\n");
-        return;
-    }
+// The scrub command.
+void scrub()
+{
+    // Input: None.
+    // Output: void. Prints every allocated block that fails its checksum,
+    //         then a summary with the scrub throughput.
 
-    uint8_t buffer[num_bytes];
+    struct mfs_scrub result;
 
-    fseek(fp, start + 1, SEEK_CUR);
-    fread(buffer, num_bytes, 1, fp);
+    mfs_scrub(fs, &result);
 
-    for (int i = 0; i < num_bytes; i++)
+    for (int i = 0; i < result.reported; i++)
     {
-        printf("%02x ", buffer[i]);
+        printf("scrub: Checksum mismatch in block %d (%s).\n", result.bad_blocks[i],
+               result.owners[i][0] ? result.owners[i] : "unowned");
     }
 
-    fclose(fp);
-    remove("temp");
+    double mb = (double)result.checked * MFS_BLOCK_SIZE / (1024 * 1024);
 
-    printf("\n");
+    printf("scrub: %d blocks checked, %d errors, %d threads, %.3f s, %.1f MB/s.\n",
+           result.checked, result.errors, result.threads, result.seconds,
+           result.seconds > 0 ? mb / result.seconds : 0.0);
 }
 
-// The retrieve command.
-void retrieve(char *filename, char *new_filename)
+// The fsck command.
+void fsck(int repair)
 {
-    // Input: char *filename - The file we want to retrieve.
-    //        char *new_filename - Optional name for the retrieved file.
-    // Output: void. retrieve a file from the file system and place it 
-    //               in the current working directory.
-    // Description: After checking if the file exists in the directory, 
-    //              output file is opened. Using copy_size as a count to determine 
-    //              when we've copied enough bytes to the output file.
+    // Input: int repair - 1 to fix the problems found.
+    // Output: void. Prints the first problems found, then a summary.
 
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
-    {
-        printf("retrieve: Filename is NULL\n");
-        return;
-    }
+    struct mfs_fsck result;
 
-    // Verify file is in directory
-    int directory_entry = searchDirectory(filename);
-	if (directory_entry == -1)
-	{	
-		printf("retrieve: File not found in directory.\n");
-        return;
-	}
-    if (directory_ptr[directory_entry].in_use == 0)
+    int err = mfs_fsck(fs, repair, &result);
+
+    if (err == MFS_ENOMEM)
     {
-        printf("retrieve: File not found in directory.\n");
+        report("fsck", err);
         return;
     }
-    
-    FILE *ofp;
 
-    if (new_filename != NULL)
+    for (int i = 0; i < result.reported; i++)
     {
-        ofp = fopen(new_filename, "w");
+        printf("fsck: %s.\n", result.messages[i]);
     }
-    else
+    if (result.problems > result.reported)
     {
-        ofp = fopen(filename, "w");
+        printf("fsck: ... and %d more.\n", result.problems - result.reported);
     }
 
-    if (ofp == NULL)
+    printf("fsck: %d files, %d blocks in use, %d threads, %.3f s.\n",
+           result.files, result.blocks, result.threads, result.seconds);
+
+    if (result.problems == 0)
     {
-        printf("retrieve: Could not open output file: %s\n", filename);
+        printf("fsck: No problems found.\n");
         return;
     }
 
-    int block_pos = 0;
-    int inode_index = directory_ptr[directory_entry].inode;
-	int block_index = inode_ptr[inode_index].blocks[block_pos];
-
-    int copy_size = inode_ptr[inode_index].file_size;
-    int offset = 0;
-
-    printf("Writing %d bytes to %s\n", inode_ptr[inode_index].file_size, filename);
-
-    // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-    // Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-    // our stored data to the file fp, then we will increment the offset into the file we are writing to.
-    // On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just copy
-    // how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on the
-    // last iteration we'd end up with gibberish at the end of our file. 
-    while (copy_size > 0)
-    { 
-        int num_bytes;
-
-        // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-        // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-        // end up with garbage at the end of the file.
-        if (copy_size < BLOCK_SIZE)
-        {
-            num_bytes = copy_size;
-        }
-        else 
-        {
-            num_bytes = BLOCK_SIZE;
-        }
-
-        // Write num_bytes number of bytes from our data array into our output file.
-        fwrite(data_blocks[block_index], num_bytes, 1, ofp); 
+    printf("fsck: %d problems: %d bad entries, %d bad inodes, %d bad block lists, %d leaked blocks, "
+           "%d lost blocks, %d double allocated blocks, %d blocks with extra references.\n",
+           result.problems, result.bad_entries, result.bad_inodes, result.bad_block_lists,
+           result.leaked_blocks, result.lost_blocks, result.double_allocated, result.extra_refs);
 
-        // Reduce the amount of bytes remaining to copy, increase the offset into the file
-        // and increment the block_pos to move us to the next data block.
-        copy_size -= BLOCK_SIZE;
-        offset += BLOCK_SIZE;
-        block_pos++;
-        block_index = inode_ptr[inode_index].blocks[block_pos];	     
-
-        // Since we've copied from the point pointed to by our current file pointer, increment
-        // offset number of bytes so we will be ready to copy to the next area of our output file.
-        fseek(ofp, offset, SEEK_SET);
+    if (repair)
+    {
+        printf("fsck: %d repaired%s.\n", result.repaired,
+               result.repaired < result.problems ? ", snapshots are left as they are" : "");
+    }
+    else
+    {
+        printf("fsck: Run fsck -r to repair.\n");
     }
-
-    // Close the output file, we're done. 
-    fclose(ofp);
 }
 
-// Useful for reading a file in the file system.
-void readFileRetrieve(char *filename, int directory_entry)
+// The frag command.
+void frag(char *filename)
 {
-    // Input: char *filename - The file we want to retrieve.
-    //        int directory_entry - The index for the file in the directory.
-    // Output: void. Creates a file for read() to read from.
-    // Description: The data from the file in the the file system is put
-    //              into the cwd. The file in the cwd is used to read the
-    //              bytes of the file we want to read.
+    // Input: char *filename - One file to report on, or NULL for every file
+    //                         and then the whole image.
+    // Output: void. Prints blocks, runs and last block slack per file, then
+    //         the free space by run size and how full the inode table and
+    //         directory are.
+
+    struct mfs_fragfile info;
 
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
+    if (filename != NULL)
     {
-        printf("read: Filename is NULL\n");
+        if (report("frag", mfs_frag_file(fs, filename, &info)) == MFS_OK)
+        {
+            printf("%s: %d blocks in %d runs, %u bytes of slack.\n", filename, info.blocks, info.runs, info.slack);
+        }
         return;
     }
 
-    FILE *ofp;
+    struct mfs_dirent entry;
+    int cursor = 0;
 
-    ofp = fopen("temp", "w");
+    printf("%-32s %8s %8s %8s\n", "File", "Blocks", "Runs", "Slack");
 
-    if (ofp == NULL)
+    while (mfs_readdir(fs, &cursor, &entry) == MFS_OK)
     {
-        printf("read: Could not open file: %s\n", filename);
-        return;
+        if (mfs_frag_file(fs, entry.name, &info) == MFS_OK)
+        {
+            printf("%-32s %8d %8d %8u\n", entry.name, info.blocks, info.runs, info.slack);
+        }
     }
 
-    int block_pos = 0;
-    int inode_index = directory_ptr[directory_entry].inode;
-	int block_index = inode_ptr[inode_index].blocks[block_pos];
+    struct mfs_frag image;
+
+    mfs_frag(fs, &image);
 
-    int copy_size = inode_ptr[inode_index].file_size;
-    int offset = 0;
+    printf("\n%d files in %d blocks and %d runs, %.1f blocks per run, %d files in more than one run.\n",
+           image.files, image.file_blocks, image.runs,
+           image.runs ? (double)image.file_blocks / image.runs : 0.0, image.fragmented_files);
+    printf("%llu bytes of slack in last blocks.\n", (unsigned long long)image.slack);
+    printf("%d of %d data blocks free in %d runs, the largest %d blocks.\n",
+           image.free_blocks, image.data_blocks, image.free_runs, image.largest_free_run);
 
-    while (copy_size > 0)
+    printf("\n%-16s %8s\n", "Free run", "Runs");
+
+    for (int i = 0; i < MFS_FRAG_BUCKETS; i++)
     {
-        int num_bytes;
+        if (image.free_run_sizes[i] == 0)
+        {
+            continue;
+        }
 
-        if (copy_size < BLOCK_SIZE)
+        char range[32];
+
+        if (i == 0)
         {
-            num_bytes = copy_size;
+            snprintf(range, sizeof(range), "1");
         }
-        else 
+        else
         {
-            num_bytes = BLOCK_SIZE;
+            snprintf(range, sizeof(range), "%d-%d", 1 << i, (2 << i) - 1);
         }
-
-        fwrite(data_blocks[block_index], num_bytes, 1, ofp); 
-
-        copy_size -= BLOCK_SIZE;
-        offset += BLOCK_SIZE;
-        block_pos++;
-        block_index = inode_ptr[inode_index].blocks[block_pos];	     
-
-        fseek(ofp, offset, SEEK_SET);
+        printf("%-16s %8d\n", range, image.free_run_sizes[i]);
     }
 
-    // Close the output file, we're done. 
-    fclose(ofp);
+    printf("\nInodes: %d of %d used. Directory: %d entries used, %d deleted, %d free.\n",
+           image.inodes_used, MFS_MAX_FILES, image.entries_used, image.entries_deleted,
+           MFS_MAX_FILES - image.entries_used - image.entries_deleted);
 }
 
-// The encrypt command.
-void encrypt(char *filename, char cipher)
+// The defrag command.
+void defrag(char *filename, int max_blocks, double max_seconds)
 {
-    // Input: char *filename - The file we want to encrypt.
-    //        char *cipher - The cipher used to encrypt the file.
-    // Output: void. Encrypts the file using the given cipher.
-    // Description: The data from the file in the the file system is put
-    //              into the cwd. The file in the cwd is used to read the
-    //              bytes of the file we want to encrypt. Each byte in
-    //              the file is encrypted using the XOR cipher. 
-
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
-    {
-        printf("encrypt: Filename is NULL\n");
-        return;
-    }
-
-    // Verify file is in directory
-    int directory_entry = searchDirectory(filename);
-	if (directory_entry == -1)
-	{	
-		printf("encrypt: File not found in directory.\n");
-        return;
-	}
-    if (directory_ptr[directory_entry].in_use == 0)
+    // Input: char *filename - The file to defragment, or NULL to compact
+    //                         every file toward the start of the image.
+    //        int max_blocks - Blocks to move before stopping, 0 for no limit.
+    //        double max_seconds - Seconds to run before stopping, 0 for no
+    //                             limit.
+    // Output: void. Prints how many blocks were moved and whether there is
+    //         more to do.
+    // Description: ^C stops the defrag between two block moves instead of
+    //              ending the shell. The image is consistent after every
+    //              move, and running defrag again continues from there.
+
+    const char *name = filename != NULL ? filename : "";
+
+    if (!defrag_resume || strcmp(defrag_name, name) != 0)
     {
-        printf("encrypt: File not found in directory.\n");
-        return;
-    }
-
-    readFileRetrieve(filename, directory_entry);
-
-    FILE *fpi = fopen("temp", "rb"); 
-    if (fpi == NULL) 
-    { 
-        printf("encrypt: Can not open file.\n");
-        return;
-    }
-
-    FILE *fpo = fopen(filename, "wb"); 
-    if (fpo == NULL) 
-    { 
-        printf("encrypt: Can not open file.\n");
-        return;
+        memset(&defrag_progress, 0, sizeof(defrag_progress));
+        snprintf(defrag_name, sizeof(defrag_name), "%s", name);
     }
 
-    unsigned char block[1];
-    int num_bytes;
-
-    do {
-		num_bytes = fread(block, 1, 1, fpi);
-
-		for (int i = 0; i < num_bytes; i++) 
-			block[i] ^= cipher;
-
-		fwrite(block, 1, num_bytes, fpo);
-	} while (num_bytes == 1);
+    defrag_progress.max_blocks = max_blocks;
+    defrag_progress.max_seconds = max_seconds;
+    defrag_progress.interrupt = &defrag_interrupted;
+    defrag_interrupted = 0;
 
-    fclose(fpi);
-    fclose(fpo);
+    struct sigaction action, previous;
 
-    delete(filename);
-    XOR_insert(filename);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onDefragInterrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous);
 
-    remove("temp");
-}
+    int err = mfs_defrag(fs, filename, &defrag_progress);
 
-// The decrypt command.
-void decrypt(char *filename, char cipher)
-{
-    // Input: char *filename - The file we want to decrypt.
-    //        char *cipher - The cipher used to decrypt the file.
-    // Output: void. Decrypts the file using the given cipher.
-    // Description: The data from the file in the the file system is put
-    //              into the cwd. The file in the cwd is used to read the
-    //              bytes of the file we want to decrypt. Each byte in
-    //              the file is decrypted using the XOR cipher. 
+    sigaction(SIGINT, &previous, NULL);
 
-    // Verify the filename isn't NULL.
-    if (filename == NULL)
+    if (defrag_progress.moved > 0)
     {
-        printf("decrypt: Filename is NULL\n");
-        return;
+        printf("defrag: %d blocks moved, %d of them out of the way.\n",
+               defrag_progress.moved, defrag_progress.evicted);
     }
 
-    // Verify file is in directory
-    int directory_entry = searchDirectory(filename);
-	if (directory_entry == -1)
-	{	
-		printf("decrypt: File not found in directory.\n");
-        return;
-	}
-    if (directory_ptr[directory_entry].in_use == 0)
+    if (report("defrag", err) != MFS_OK)
     {
-        printf("decrypt: File not found in directory.\n");
+        defrag_resume = 0;
         return;
     }
 
-    readFileRetrieve(filename, directory_entry);
+    defrag_resume = !defrag_progress.done;
 
-    FILE *fpi = fopen("temp", "rb"); 
-    if (fpi == NULL) 
-    { 
-        printf("decrypt: Can not open file.\n");
-        return;
+    if (defrag_progress.done)
+    {
+        printf("defrag: Done.\n");
     }
-
-    FILE *fpo = fopen(filename, "wb"); 
-    if (fpo == NULL) 
-    { 
-        printf("decrypt: Can not open file.\n");
-        return;
+    else
+    {
+        printf("defrag: %s. Run defrag again to continue.\n",
+               defrag_interrupted ? "Interrupted" : "Stopped at the limit");
     }
+}
 
-	unsigned char block[1];
-    int num_bytes;
+// Stops a running defrag at the next block.
+void onDefragInterrupt(int sig)
+{
+    defrag_interrupted = 1;
+}
 
-    do {
-		num_bytes = fread(block, 1, 1, fpi);
+// Used to convert a 64 digit hex key into MFS_KEY_SIZE bytes.
+int hex_to_key(char *hex, uint8_t *key)
+{
+    // Input: char *hex - Hex value key.
+    //        uint8_t *key - Receives the MFS_KEY_SIZE key bytes.
+    // Output: int. Returns 0 on success, -1 if hex is not a 256-bit hex value.
 
-		for (int i = 0; i < num_bytes; i++) 
-			block[i] ^= cipher;
+    if (strlen(hex) != 2 * MFS_KEY_SIZE)
+    {
+        return -1;
+    }
 
-		fwrite(block, 1, num_bytes, fpo);
-	} while (num_bytes == 1);
+    for (int i = 0; i < MFS_KEY_SIZE; i++)
+    {
+        char byte[3] = { hex[2 * i], hex[2 * i + 1], 0 };
 
-    fclose(fpi);
-    fclose(fpo);
+        if (!isxdigit(byte[0]) || !isxdigit(byte[1]))
+        {
+            return -1;
+        }
 
-    delete(filename);
-    XOR_insert(filename);
+        key[i] = (uint8_t)strtol(byte, NULL, 16);
+    }
 
-    remove("temp");
+    return 0;
 }
 
 // Used to convert the hex value cipher given into a single decimal byte.
@@ -1905,4 +3230,4 @@ uint8_t hex_to_byte(char *hex)
     }
 
     return (uint8_t)value;
-}
\ No newline at end of file
+}
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+#include "record.h"
+
+// A host file the command being replayed read when it was recorded.
+struct hostFile
+{
+    char *path;
+    uint32_t size;
+    uint32_t crc;
+    int taken;              // Handed out already, set atomically
+};
+
+int recording;
+int replaying;
+
+static FILE *record_file;
+static struct timespec record_start;
+
+// The host files of the command being replayed. Worker threads look them up
+// while the command runs, and only the main thread adds or clears them.
+static struct hostFile *expected;
+static int expected_count;
+static int expected_capacity;
+
+// Starts writing commands to a log.
+int recordOpen(const char *path)
+{
+    // Input: const char *path - The log to create or replace.
+    // Output: int. 0, or -1 if the log can not be created.
+
+    record_file = fopen(path, "w");
+
+    if (record_file == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(record_file, "# mfs record 1\n");
+    clock_gettime(CLOCK_MONOTONIC, &record_start);
+    recording = 1;
+
+    return 0;
+}
+
+// Logs a host file a command read. Safe to call from several threads at once.
+void recordHostFile(const char *path, const uint8_t *data, uint32_t size)
+{
+    // stdio locks the stream, so lines from different threads do not mix.
+    fprintf(record_file, "+ %u %08x %s\n", size, crc32c(data, size), path);
+}
+
+// Logs a command once it has run.
+void recordCommand(const struct timespec *start, uint64_t ns, char **token, int token_count)
+{
+    // Input: const struct timespec *start - CLOCK_MONOTONIC when it started.
+    //        uint64_t ns - How long it took.
+    //        char **token - The command line's tokens.
+    //        int token_count - Entries in token.
+    // Output: void.
+    // Description: The log is flushed after every command, so a session
+    //              that ends with ^C still has everything up to it.
+
+    fprintf(record_file, "%.6f %.6f",
+            (start->tv_sec - record_start.tv_sec) + (start->tv_nsec - record_start.tv_nsec) / 1e9, ns / 1e9);
+
+    for (int i = 0; i < token_count; i++)
+    {
+        fprintf(record_file, " %s", token[i]);
+    }
+
+    fputc('\n', record_file);
+    fflush(record_file);
+}
+
+// Adds a host file for the next command to replay.
+int replayExpect(const char *path, uint32_t size, uint32_t crc)
+{
+    // Input: const char *path - The path the command read.
+    //        uint32_t size - Its size.
+    //        uint32_t crc - The CRC32C of its contents.
+    // Output: int. 0, or -1 if out of memory.
+
+    if (expected_count == expected_capacity)
+    {
+        int capacity = expected_capacity ? expected_capacity * 2 : 16;
+        struct hostFile *grown = realloc(expected, capacity * sizeof(struct hostFile));
+
+        if (grown == NULL)
+        {
+            return -1;
+        }
+
+        expected = grown;
+        expected_capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+
+    if (copy == NULL)
+    {
+        return -1;
+    }
+
+    expected[expected_count++] = (struct hostFile){ copy, size, crc, 0 };
+
+    return 0;
+}
+
+// Returns the path of the index'th host file of the command being replayed,
+// or NULL past the last.
+const char *replayHostPath(int index)
+{
+    return index < expected_count ? expected[index].path : NULL;
+}
+
+// Generates the contents of a host file for the command being replayed.
+uint8_t *replayHostFile(const char *path, uint32_t *size, const char **error)
+{
+    // Input: const char *path - The host file to read.
+    //        uint32_t *size - Receives the file's size.
+    //        const char **error - Receives a message if the file was not
+    //                             read when the command was recorded.
+    // Output: uint8_t *. Recorded size bytes, freed by the caller, or NULL.
+    // Description: Takes the first entry for path not handed out yet, so a
+    //              file read twice by one command is found twice. A file
+    //              whose CRC is that of all zeros is replayed as zeros, so
+    //              sparse inserts still leave holes. Other bytes come from
+    //              an xorshift generator seeded with the CRC and size, which
+    //              gives files with the same contents the same data. Safe to
+    //              call from several threads at once.
+
+    for (int i = 0; i < expected_count; i++)
+    {
+        int free_entry = 0;
+
+        if (strcmp(expected[i].path, path) != 0 ||
+            !__atomic_compare_exchange_n(&expected[i].taken, &free_entry, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        // Spare bytes so an empty file still gets a buffer, as loadHostFile()
+        // does, and the generator can fill whole words.
+        uint8_t *data = calloc(expected[i].size + 8, 1);
+
+        if (data == NULL)
+        {
+            *error = "Out of memory";
+            return NULL;
+        }
+
+        *size = expected[i].size;
+
+        if (crc32c(data, expected[i].size) == expected[i].crc)
+        {
+            return data;
+        }
+
+        uint64_t state = ((uint64_t)expected[i].crc << 32 | expected[i].size) ^ 0x9e3779b97f4a7c15ULL;
+
+        for (uint32_t offset = 0; offset < expected[i].size; offset += 8)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            memcpy(data + offset, &state, 8);
+        }
+
+        return data;
+    }
+
+    *error = "File does not exist";
+    return NULL;
+}
+
+// Forgets the host files of the command just replayed.
+uint64_t replayClear()
+{
+    // Input: None.
+    // Output: uint64_t. Bytes of host files the command read.
+
+    uint64_t bytes = 0;
+
+    for (int i = 0; i < expected_count; i++)
+    {
+        if (expected[i].taken)
+        {
+            bytes += expected[i].size;
+        }
+        free(expected[i].path);
+    }
+
+    expected_count = 0;
+
+    return bytes;
+}
@@ -0,0 +1,41 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <time.h>
+
+// mfs --record writes every filesystem command the shell runs to a log, and
+// mfs --replay runs the commands in a log again. The log is text with one
+// event per line:
+//
+//   # mfs record 1
+//   + <size> <crc32c> <host path>      A host file the next command read
+//   <start> <seconds> <command line>   When the command started, in seconds
+//                                      since recording began, and how long
+//                                      it took
+//
+// Host files are logged by size and CRC32C rather than content, so a log
+// can be replayed where the files do not exist. Replay hands each command
+// generated data of the recorded size instead, the same bytes for files
+// whose CRCs match, and zeros for files that were all zeros.
+//
+// ChaCha20 keys are not logged. Each is written as RECORD_KEY, so a replay
+// encrypts and decrypts with that key instead. Since a replay starts from
+// an empty image, the files it decrypts were encrypted with it too.
+
+#define RECORD_KEY "0000000000000000000000000000000000000000000000000000000000000000"
+
+// Nonzero while commands are being recorded or replayed.
+extern int recording;
+extern int replaying;
+
+int recordOpen(const char *path);
+void recordHostFile(const char *path, const uint8_t *data, uint32_t size);
+void recordCommand(const struct timespec *start, uint64_t ns, char **token, int token_count);
+
+int replayExpect(const char *path, uint32_t size, uint32_t crc);
+const char *replayHostPath(int index);
+uint8_t *replayHostFile(const char *path, uint32_t *size, const char **error);
+uint64_t replayClear();
+
+#endif
@@ -0,0 +1,668 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "libmfs.h"
+#include "serve.h"
+
+// mfs --serve: keeps one image open and answers requests from local clients.
+//
+// A single thread runs an epoll loop that accepts connections, reads
+// requests and writes responses without blocking. Every request is queued
+// for a pool of worker threads, which call libmfs and start writing the
+// response themselves, so a request waiting on the image (say, behind a
+// save) never holds up the loop. Every connection is registered with
+// EPOLLONESHOT, so only one thread works on it at a time.
+
+#define SERVE_WORKERS 4
+#define MAX_EVENTS 64
+#define LISTEN_BACKLOG 64
+
+// Where a connection is in its request/response cycle.
+enum
+{
+    READ_HEADER,
+    READ_NAME,
+    READ_DATA,
+    WORKING,        // Queued for or running on a worker
+    WRITING
+};
+
+struct connection
+{
+    int fd;
+    int state;
+
+    struct serve_request request;
+    char name[MFS_NAME_MAX + 1];
+    uint8_t *data;                  // SERVE_INSERT data
+    size_t have;                    // Bytes of the current part read so far
+
+    struct serve_response response;
+    uint8_t *payload;
+    size_t sent;                    // Header and payload bytes written so far
+
+    struct connection *next;        // Work queue link
+    struct connection *open_prev;   // Links in the list of open connections
+    struct connection *open_next;
+};
+
+struct server
+{
+    struct mfs *fs;
+    int epoll_fd;
+    int listen_fd;
+    int signal_fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct connection *queue_head;
+    struct connection *queue_tail;
+    struct connection *open;        // Every open connection, closed on shutdown
+    int stopping;
+};
+
+static void *worker(void *arg);
+static void acceptConnections(struct server *server);
+static void handleConnection(struct server *server, struct connection *conn);
+static int readRequest(struct connection *conn);
+static void runRequest(struct server *server, struct connection *conn);
+static void startResponse(struct server *server, struct connection *conn);
+static int writeResponse(struct connection *conn);
+static void arm(struct server *server, struct connection *conn, uint32_t events);
+static void closeConnection(struct server *server, struct connection *conn);
+
+// Serves an image on a Unix domain socket until SIGINT or SIGTERM.
+int serve(const char *socket_path, const char *image, int cache_blocks)
+{
+    // Input: const char *socket_path - Socket to listen on. A stale socket
+    //                                  file is replaced.
+    //        const char *image - Image to open.
+    //        int cache_blocks - Block cache size, 0 to load the whole image,
+    //                           or MFS_SHARED.
+    // Output: int. The exit status. The image is saved before returning.
+
+    struct server server;
+    struct sockaddr_un addr;
+
+    memset(&server, 0, sizeof(server));
+    memset(&addr, 0, sizeof(addr));
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        printf("serve: Socket path is too long.\n");
+        return 1;
+    }
+
+    int err = mfs_open(image, cache_blocks, &server.fs);
+
+    if (err != MFS_OK)
+    {
+        printf("serve: %s.\n", mfs_strerror(err));
+        return 1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (server.listen_fd == -1 ||
+        bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(server.listen_fd, LISTEN_BACKLOG) == -1)
+    {
+        printf("serve: Can not listen on %s: %s.\n", socket_path, strerror(errno));
+        mfs_close(server.fs);
+        return 1;
+    }
+
+    // Signals arrive through the event loop so shutdown happens between
+    // requests. A client that goes away mid-response must not kill us.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    // The listening socket and signalfd are told apart from connections by
+    // their data pointer.
+    struct epoll_event listen_ev = { .events = EPOLLIN, .data.ptr = &server.listen_fd };
+    struct epoll_event signal_ev = { .events = EPOLLIN, .data.ptr = &server.signal_fd };
+
+    if (server.signal_fd == -1 || server.epoll_fd == -1 ||
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &listen_ev) == -1 ||
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd, &signal_ev) == -1)
+    {
+        printf("serve: Can not set up the event loop: %s.\n", strerror(errno));
+        close(server.listen_fd);
+        if (server.signal_fd != -1)
+        {
+            close(server.signal_fd);
+        }
+        if (server.epoll_fd != -1)
+        {
+            close(server.epoll_fd);
+        }
+        unlink(socket_path);
+        mfs_close(server.fs);
+        return 1;
+    }
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.work, NULL);
+
+    // Workers inherit the blocked signal mask.
+    pthread_t workers[SERVE_WORKERS];
+    int spawned[SERVE_WORKERS] = { 0 };
+
+    for (int t = 0; t < SERVE_WORKERS; t++)
+    {
+        spawned[t] = pthread_create(&workers[t], NULL, worker, &server) == 0;
+    }
+
+    printf("Serving %s on %s.\n", image, socket_path);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    int running = 1;
+
+    while (running)
+    {
+        int count = epoll_wait(server.epoll_fd, events, MAX_EVENTS, -1);
+
+        if (count == -1 && errno != EINTR)
+        {
+            printf("serve: %s.\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.ptr == &server.listen_fd)
+            {
+                acceptConnections(&server);
+            }
+            else if (events[i].data.ptr == &server.signal_fd)
+            {
+                running = 0;
+            }
+            else
+            {
+                handleConnection(&server, events[i].data.ptr);
+            }
+        }
+    }
+
+    // Let the workers finish what is queued, then save.
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.work);
+    pthread_mutex_unlock(&server.lock);
+
+    for (int t = 0; t < SERVE_WORKERS; t++)
+    {
+        if (spawned[t])
+        {
+            pthread_join(workers[t], NULL);
+        }
+    }
+
+    // The rest are idle, or part way through a request or response that
+    // no one will finish now.
+    while (server.open != NULL)
+    {
+        closeConnection(&server, server.open);
+    }
+
+    close(server.listen_fd);
+    close(server.signal_fd);
+    close(server.epoll_fd);
+    unlink(socket_path);
+
+    err = mfs_save(server.fs);
+    mfs_close(server.fs);
+
+    if (err != MFS_OK)
+    {
+        printf("serve: %s.\n", mfs_strerror(err));
+        return 1;
+    }
+
+    printf("Saved %s.\n", image);
+
+    return 0;
+}
+
+// Thread body: runs queued requests.
+static void *worker(void *arg)
+{
+    struct server *server = (struct server *)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&server->lock);
+
+        while (server->queue_head == NULL && !server->stopping)
+        {
+            pthread_cond_wait(&server->work, &server->lock);
+        }
+
+        struct connection *conn = server->queue_head;
+
+        if (conn == NULL)
+        {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+
+        server->queue_head = conn->next;
+        if (server->queue_head == NULL)
+        {
+            server->queue_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&server->lock);
+
+        runRequest(server, conn);
+        startResponse(server, conn);
+    }
+}
+
+// Accepts every pending connection.
+static void acceptConnections(struct server *server)
+{
+    int fd;
+
+    while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        struct connection *conn = calloc(1, sizeof(struct connection));
+
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+
+        conn->fd = fd;
+        conn->state = READ_HEADER;
+
+        pthread_mutex_lock(&server->lock);
+        conn->open_next = server->open;
+        if (server->open != NULL)
+        {
+            server->open->open_prev = conn;
+        }
+        server->open = conn;
+        pthread_mutex_unlock(&server->lock);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            closeConnection(server, conn);
+        }
+    }
+}
+
+// Makes progress on a connection the event loop was woken for.
+static void handleConnection(struct server *server, struct connection *conn)
+{
+    if (conn->state == WRITING)
+    {
+        int ret = writeResponse(conn);
+
+        if (ret == -1)
+        {
+            closeConnection(server, conn);
+        }
+        else
+        {
+            arm(server, conn, ret == 1 ? EPOLLIN : EPOLLOUT);
+        }
+        return;
+    }
+
+    int ret = readRequest(conn);
+
+    if (ret == -1)
+    {
+        closeConnection(server, conn);
+        return;
+    }
+
+    if (ret == 0)
+    {
+        arm(server, conn, EPOLLIN);
+        return;
+    }
+
+    // Every request calls libmfs, which may wait on the image, so all of
+    // them go to the workers.
+    conn->state = WORKING;
+    conn->next = NULL;
+
+    pthread_mutex_lock(&server->lock);
+    if (server->queue_tail != NULL)
+    {
+        server->queue_tail->next = conn;
+    }
+    else
+    {
+        server->queue_head = conn;
+    }
+    server->queue_tail = conn;
+    pthread_cond_signal(&server->work);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Reads as much of the current request as is available.
+static int readRequest(struct connection *conn)
+{
+    // Input: struct connection *conn - A connection in one of the READ_* states.
+    // Output: int. 1 once the request is complete, 0 if more is needed,
+    //         -1 if the client closed the connection or broke the protocol.
+
+    while (1)
+    {
+        uint8_t *part;
+        size_t need;
+
+        if (conn->state == READ_HEADER)
+        {
+            part = (uint8_t *)&conn->request;
+            need = sizeof(conn->request);
+        }
+        else if (conn->state == READ_NAME)
+        {
+            part = (uint8_t *)conn->name;
+            need = conn->request.name_len;
+        }
+        else
+        {
+            part = conn->data;
+            need = conn->request.length;
+        }
+
+        while (conn->have < need)
+        {
+            ssize_t got = read(conn->fd, part + conn->have, need - conn->have);
+
+            if (got == 0)
+            {
+                return -1;
+            }
+            if (got == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+
+            conn->have += got;
+        }
+
+        conn->have = 0;
+
+        if (conn->state == READ_HEADER)
+        {
+            // A bad header leaves no way to find the next request.
+            if (conn->request.name_len > MFS_NAME_MAX ||
+                (conn->request.op == SERVE_INSERT && conn->request.length > MFS_MAX_FILE_SIZE))
+            {
+                return -1;
+            }
+
+            memset(conn->name, 0, sizeof(conn->name));
+            conn->state = READ_NAME;
+        }
+        else if (conn->state == READ_NAME && conn->request.op == SERVE_INSERT)
+        {
+            // One spare byte so an empty file still gets a buffer.
+            conn->data = malloc(conn->request.length + 1);
+
+            if (conn->data == NULL)
+            {
+                return -1;
+            }
+
+            conn->state = READ_DATA;
+        }
+        else
+        {
+            return 1;
+        }
+    }
+}
+
+// Runs a complete request and fills in the response.
+static void runRequest(struct server *server, struct connection *conn)
+{
+    struct serve_request *req = &conn->request;
+    struct serve_response *res = &conn->response;
+    struct mfs *fs = server->fs;
+
+    res->status = MFS_OK;
+    res->length = 0;
+    conn->payload = NULL;
+
+    switch (req->op)
+    {
+        case SERVE_INSERT:
+            res->status = mfs_insert(fs, conn->name, conn->data, req->length, NULL);
+            free(conn->data);
+            conn->data = NULL;
+            break;
+
+        case SERVE_RETRIEVE:
+        case SERVE_READ:
+        {
+            uint32_t offset = 0;
+            uint32_t length = req->length;
+
+            if (req->op == SERVE_RETRIEVE)
+            {
+                struct mfs_stat st;
+
+                res->status = mfs_stat(fs, conn->name, &st);
+                length = st.size;
+            }
+            else
+            {
+                offset = req->offset;
+                if (length > MFS_MAX_FILE_SIZE)
+                {
+                    res->status = MFS_EINVAL;
+                }
+            }
+
+            if (res->status != MFS_OK)
+            {
+                break;
+            }
+
+            conn->payload = malloc(length + 1);
+
+            if (conn->payload == NULL)
+            {
+                res->status = MFS_ENOMEM;
+                break;
+            }
+
+            // The file may change size between the stat and the read; the
+            // bytes actually read are what is sent.
+            res->status = mfs_read(fs, conn->name, offset, conn->payload, length, NULL);
+            res->length = res->status > 0 ? res->status : 0;
+            break;
+        }
+
+        case SERVE_LIST:
+        {
+            struct serve_entry *entries = calloc(MFS_MAX_FILES, sizeof(struct serve_entry));
+            struct mfs_dirent entry;
+            int cursor = 0;
+            int count = 0;
+
+            if (entries == NULL)
+            {
+                res->status = MFS_ENOMEM;
+                break;
+            }
+
+            while (count < MFS_MAX_FILES && mfs_readdir(fs, &cursor, &entry) == MFS_OK)
+            {
+                memcpy(entries[count].name, entry.name, sizeof(entries[count].name));
+                entries[count].size = entry.st.size;
+                entries[count].blocks = entry.st.blocks;
+                entries[count].date = entry.st.date;
+                entries[count].attribute = entry.st.attribute;
+                count++;
+            }
+
+            conn->payload = (uint8_t *)entries;
+            res->length = count * sizeof(struct serve_entry);
+            break;
+        }
+
+        case SERVE_DF:
+            res->status = mfs_df(fs);
+            break;
+
+        case SERVE_ATTRIB:
+            res->status = mfs_setattr(fs, conn->name, req->set, req->clear);
+            break;
+
+        case SERVE_DELETE:
+            res->status = mfs_unlink(fs, conn->name);
+            break;
+
+        case SERVE_SAVE:
+            res->status = mfs_save(fs);
+            break;
+
+        default:
+            res->status = MFS_EINVAL;
+            break;
+    }
+}
+
+// Starts sending a response, leaving the rest to the event loop.
+static void startResponse(struct server *server, struct connection *conn)
+{
+    conn->state = WRITING;
+    conn->sent = 0;
+
+    int ret = writeResponse(conn);
+
+    if (ret == -1)
+    {
+        closeConnection(server, conn);
+        return;
+    }
+
+    arm(server, conn, ret == 1 ? EPOLLIN : EPOLLOUT);
+}
+
+// Writes as much of the response as the socket takes.
+static int writeResponse(struct connection *conn)
+{
+    // Input: struct connection *conn - A connection in the WRITING state.
+    // Output: int. 1 once the response is sent and the connection is ready
+    //         for the next request, 0 if the socket is full, -1 on error.
+
+    size_t header = sizeof(conn->response);
+    size_t total = header + conn->response.length;
+
+    while (conn->sent < total)
+    {
+        struct iovec iov[2];
+        int iov_count = 0;
+
+        if (conn->sent < header)
+        {
+            iov[iov_count].iov_base = (uint8_t *)&conn->response + conn->sent;
+            iov[iov_count].iov_len = header - conn->sent;
+            iov_count++;
+        }
+        if (conn->response.length > 0)
+        {
+            size_t done = conn->sent > header ? conn->sent - header : 0;
+
+            iov[iov_count].iov_base = conn->payload + done;
+            iov[iov_count].iov_len = conn->response.length - done;
+            iov_count++;
+        }
+
+        ssize_t written = writev(conn->fd, iov, iov_count);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        conn->sent += written;
+    }
+
+    free(conn->payload);
+    conn->payload = NULL;
+    conn->state = READ_HEADER;
+
+    return 1;
+}
+
+// Re-enables events for a connection.
+static void arm(struct server *server, struct connection *conn, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Closes a connection and frees it.
+static void closeConnection(struct server *server, struct connection *conn)
+{
+    pthread_mutex_lock(&server->lock);
+    if (conn->open_prev != NULL)
+    {
+        conn->open_prev->open_next = conn->open_next;
+    }
+    else
+    {
+        server->open = conn->open_next;
+    }
+    if (conn->open_next != NULL)
+    {
+        conn->open_next->open_prev = conn->open_prev;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    // Closing the socket also removes it from the epoll set.
+    close(conn->fd);
+    free(conn->data);
+    free(conn->payload);
+    free(conn);
+}
@@ -0,0 +1,55 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+#include "libmfs.h"
+
+// Binary protocol spoken by mfs --serve over a Unix domain socket.
+//
+// A client sends a request header, then name_len bytes of file name (no
+// terminator), then length bytes of data for SERVE_INSERT. The server
+// answers each request, in order, with a response header followed by
+// length bytes of payload. Integers are in host byte order, as both ends
+// are on the same machine. A connection may carry any number of requests.
+
+#define SERVE_INSERT 1      // Create or replace name with the data sent
+#define SERVE_RETRIEVE 2    // Payload is the whole file
+#define SERVE_READ 3        // Payload is length bytes from offset
+#define SERVE_LIST 4        // Payload is one serve_entry per file
+#define SERVE_DF 5          // status is the free space in bytes
+#define SERVE_ATTRIB 6      // Sets the attributes in set, clears those in clear
+#define SERVE_DELETE 7
+#define SERVE_SAVE 8        // Writes the image back to its file
+
+struct serve_request
+{
+    uint8_t op;             // SERVE_*
+    uint8_t set;            // SERVE_ATTRIB: MFS_READONLY | MFS_HIDDEN to set
+    uint8_t clear;          // SERVE_ATTRIB: attributes to clear
+    uint8_t reserved;
+    uint16_t name_len;      // At most MFS_NAME_MAX
+    uint16_t reserved2;
+    uint32_t offset;        // SERVE_READ
+    uint32_t length;        // SERVE_INSERT data bytes, SERVE_READ bytes wanted
+};
+
+struct serve_response
+{
+    int32_t status;         // MFS_OK, bytes for reads, free bytes for df, or an MFS_E* code
+    uint32_t length;        // Payload bytes that follow
+};
+
+struct serve_entry
+{
+    char name[MFS_NAME_MAX + 1];
+    uint32_t size;
+    int32_t blocks;
+    int64_t date;
+    uint8_t attribute;
+    uint8_t reserved[7];
+};
+
+int serve(const char *socket_path, const char *image, int cache_blocks);
+
+#endif
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+struct traceEvent
+{
+    uint64_t ns;            // CLOCK_MONOTONIC
+    const char *category;
+    const char *name;
+    int32_t tid;
+    char phase;             // 'B' or 'E'
+};
+
+// One thread's events. Only the owning thread writes events and head, so
+// a dump reads them while they may be overwritten and drops any event the
+// owner could have reached by the time it is done.
+struct traceRing
+{
+    struct traceEvent events[TRACE_EVENTS];
+    uint64_t head;          // Events ever written, published with release
+    uint64_t floor;         // Events before this were cleared
+    int owned;              // A live thread writes this ring
+    struct traceRing *next;
+};
+
+int mfs_trace_on;
+
+// Rings are never freed. A thread that exits gives its ring back for the
+// next new thread, so threads started per call do not grow the list.
+static struct traceRing *rings;
+static __thread struct traceRing *my_ring;
+static __thread int32_t my_tid;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static uint64_t origin_ns;  // Timestamps in a dump count from here
+
+static uint64_t traceNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Gives an exiting thread's ring back.
+static void releaseRing(void *ring)
+{
+    __atomic_store_n(&((struct traceRing *)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void createKey()
+{
+    pthread_key_create(&ring_key, releaseRing);
+}
+
+// Finds the calling thread a ring.
+static struct traceRing *claimRing()
+{
+    // Input: None.
+    // Output: struct traceRing *. The ring, or NULL if out of memory.
+    // Description: A ring given back by a thread that exited is reused,
+    //              keeping its old events. Otherwise a new ring is pushed on
+    //              the list with a compare and swap.
+
+    pthread_once(&ring_once, createKey);
+
+    struct traceRing *ring;
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        int expected = 0;
+
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (ring == NULL)
+    {
+        ring = calloc(1, sizeof(struct traceRing));
+
+        if (ring == NULL)
+        {
+            return NULL;
+        }
+
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+    }
+
+    pthread_setspecific(ring_key, ring);
+    my_tid = syscall(SYS_gettid);
+
+    return ring;
+}
+
+// Starts or stops recording.
+void traceEnable(int on)
+{
+    uint64_t zero = 0;
+
+    __atomic_compare_exchange_n(&origin_ns, &zero, traceNow(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_store_n(&mfs_trace_on, on != 0, __ATOMIC_RELAXED);
+}
+
+// Records one event for the calling thread. Use TRACE_BEGIN() and TRACE_END().
+void traceEvent(const char *category, const char *name, char phase)
+{
+    struct traceRing *ring = my_ring;
+
+    if (ring == NULL && (ring = my_ring = claimRing()) == NULL)
+    {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    struct traceEvent *event = &ring->events[head % TRACE_EVENTS];
+
+    event->ns = traceNow();
+    event->category = category;
+    event->name = name;
+    event->tid = my_tid;
+    event->phase = phase;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Returns how many events a dump would write.
+uint64_t traceCount()
+{
+    uint64_t count = 0;
+
+    for (struct traceRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+        count += head - (first > ring->floor ? first : ring->floor);
+    }
+
+    return count;
+}
+
+// Drops every event recorded so far.
+void traceClear()
+{
+    for (struct traceRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        ring->floor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+}
+
+// Writes a string as a JSON string.
+static void writeString(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*str >= ' ')
+        {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Writes the events in every ring to a file as Chrome trace JSON.
+int traceDump(const char *path)
+{
+    // Input: const char *path - File to write.
+    // Output: int. 0, or -1 if the file can not be written.
+    // Description: Each ring is copied before it is written, then the
+    //              events its thread may have overwritten during the copy
+    //              are dropped. An end event whose begin was overwritten is
+    //              dropped too, as trace viewers reject it. Timestamps are
+    //              microseconds since tracing was first turned on. Rings go
+    //              on recording meanwhile.
+
+    FILE *file = fopen(path, "w");
+    struct traceEvent *copy = malloc(sizeof(struct traceEvent) * TRACE_EVENTS);
+
+    if (file == NULL || copy == NULL)
+    {
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        free(copy);
+        return -1;
+    }
+
+    int first_event = 1;
+
+    fprintf(file, "{\"traceEvents\":[\n");
+
+    for (struct traceRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t base = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+        base = base > ring->floor ? base : ring->floor;
+
+        for (uint64_t i = base; i < head; i++)
+        {
+            copy[i - base] = ring->events[i % TRACE_EVENTS];
+        }
+
+        // The owner may be writing the slot of event number now_head.
+        uint64_t now_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = now_head + 1 > base + TRACE_EVENTS ? now_head + 1 - TRACE_EVENTS : base;
+
+        int32_t tid = 0;
+        int depth = 0;
+
+        for (uint64_t i = first; i < head; i++)
+        {
+            struct traceEvent *event = &copy[i - base];
+
+            // A reused ring holds the events of several threads in turn.
+            if (event->tid != tid)
+            {
+                tid = event->tid;
+                depth = 0;
+            }
+
+            if (event->phase == 'E' && depth == 0)
+            {
+                continue;
+            }
+            depth += event->phase == 'B' ? 1 : -1;
+
+            fprintf(file, "%s{\"name\":", first_event ? "" : ",\n");
+            writeString(file, event->name);
+            fprintf(file, ",\"cat\":");
+            writeString(file, event->category);
+            fprintf(file, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", event->phase,
+                    (int64_t)(event->ns - origin_ns) / 1e3, (int)getpid(), (int)event->tid);
+            first_event = 0;
+        }
+    }
+
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    free(copy);
+
+    return fclose(file) == 0 ? 0 : -1;
+}
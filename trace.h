@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Begin and end events recorded into a ring buffer per thread, written out
+// in the Chrome trace event format. Each thread writes only its own ring,
+// so recording takes no lock. The newest TRACE_EVENTS events of a thread
+// are kept. Names and categories are not copied and must live as long as
+// the process, such as string literals.
+#define TRACE_EVENTS 8192
+
+// Nonzero while events are recorded. Read without a lock, so a thread may
+// record an event or two after tracing is turned off. It is exported from
+// libmfs for the macros below, hence the prefix.
+extern int mfs_trace_on;
+
+// Recording costs one predictable branch while tracing is off. With
+// MFS_STATS 0 it compiles to nothing.
+#if MFS_STATS
+#define TRACE_BEGIN(category, name) \
+    do { if (__builtin_expect(__atomic_load_n(&mfs_trace_on, __ATOMIC_RELAXED), 0)) traceEvent(category, name, 'B'); } while (0)
+#define TRACE_END(category, name) \
+    do { if (__builtin_expect(__atomic_load_n(&mfs_trace_on, __ATOMIC_RELAXED), 0)) traceEvent(category, name, 'E'); } while (0)
+#else
+#define TRACE_BEGIN(category, name) ((void)0)
+#define TRACE_END(category, name) ((void)0)
+#endif
+
+void traceEnable(int on);
+void traceEvent(const char *category, const char *name, char phase);
+uint64_t traceCount();
+int traceDump(const char *path);
+void traceClear();
+
+#endif